@@ -2,6 +2,7 @@
 
 #include "nray.h"
 #include "geometry.h"
+#include "vec3a.h"
 
 // BBox class
 // This is mainly used by the BVH Primitive to speed up intersection tests
@@ -9,21 +10,34 @@ class BBox {
   public:
         BBox() {}
         BBox(const Vec3& a, const Vec3& b) { _min = a; _max = b; }
+        BBox(const Vec3A& a, const Vec3A& b) : _min(a), _max(b) {}
 
-        Vec3 Min() const {return _min; }
-        Vec3 Max() const {return _max; }
+        Vec3 Min() const {return _min.ToVec3(); }
+        Vec3 Max() const {return _max.ToVec3(); }
 
         bool Intersect(const Ray& r, Float tmin, Float tmax) const ;
+        // Also returns the part of [tmin, tmax] that is inside the box
+        bool Intersect(const Ray& r, Float tmin, Float tmax, Float &t_enter, Float &t_exit) const ;
 
         Float Area() const;
 
         int LongestAxis() const;
 
+        friend BBox BBoxUnion(BBox &box0, BBox &box1);
+        friend BBox Lerp(Float t, const BBox &box0, const BBox &box1);
+
   private:
-        Vec3 _min;
-        Vec3 _max;
+        // Stored as Vec3A so the slab test runs on all the axes at once
+        Vec3A _min;
+        Vec3A _max;
 };
 
 // BBox utility Functions
 BBox BBoxUnion(BBox &box0, BBox &box1);
 
+// Box interpolated between box0 (t=0) and box1 (t=1)
+inline BBox Lerp(Float t, const BBox &box0, const BBox &box1) {
+    return BBox(box0._min + (box1._min - box0._min) * t,
+                box0._max + (box1._max - box0._max) * t);
+}
+
@@ -0,0 +1,235 @@
+#include <chrono>
+#include <functional>
+#include <vector>
+
+#include "benchmark.h"
+#include "geometry.h"
+#include "sampling.h"
+#include "vec3a.h"
+#include "bbox.h"
+#include "primitive.h"
+
+
+namespace {
+
+// Rejection sampling versions, as they were before the closed form mappings
+Vec3 RejectionInUnitSphere() {
+    while (true) {
+        Vec3 p = RandomVector<Float>(-1,1);
+        if (p.LengthSquared() >= 1) continue;
+        return p;
+    }
+}
+
+Vec3 RejectionInUnitDisk() {
+    while (true) {
+        auto p = Vec3(Rng::RandRange(-1,1), Rng::RandRange(-1,1), 0);
+        if (p.LengthSquared() >= 1) continue;
+        return p;
+    }
+}
+
+// Per axis slab test, as BBox::Intersect was before Vec3A
+bool ScalarBBoxIntersect(const Vec3 &bmin, const Vec3 &bmax, const Ray& r, Float tmin, Float tmax) {
+    for (int a = 0; a < 3; a++) {
+        auto invD = 1.0f / r.Direction()[a];
+        auto t0 = (bmin[a] - r.Origin()[a]) * invD;
+        auto t1 = (bmax[a] - r.Origin()[a]) * invD;
+        if (invD < 0.0f)
+            std::swap(t0, t1);
+        tmin = t0 > tmin ? t0 : tmin;
+        tmax = t1 < tmax ? t1 : tmax;
+        if (tmax <= tmin)
+            return false;
+    }
+    return true;
+}
+
+// Moller-Trumbore on Vec3, as Triangle::Intersect was before Vec3A
+bool ScalarTriangleIntersect(const TriangleMesh &mesh, int index, shared_ptr<Material> material, const Ray& r, Float tmin, Float tmax, Intersection& rec) {
+    const int *idx = &mesh.vertexIndices[3*index];
+    const Point &p0 = mesh.vp[idx[0]];
+    const Point &p1 = mesh.vp[idx[1]];
+    const Point &p2 = mesh.vp[idx[2]];
+
+    Vec3 v0v1 = p1 - p0;
+    Vec3 v0v2 = p2 - p0;
+    Vec3 pvec = Cross(r.Direction(),v0v2);
+    float det = Dot(v0v1, pvec);
+    float invDet = 1 / det;
+
+    Vec3 tvec = r.Origin() - p0;
+    Float u = Dot(tvec, pvec) * invDet;
+    if (u < 0 || u > 1) return false;
+
+    Vec3 qvec = Cross(tvec, v0v1);
+    Float v = Dot(r.Direction(), qvec) * invDet;
+    if (v < 0 || u + v > 1) return false;
+
+    Float t = Dot(v0v2, qvec) * invDet;
+    if (t < tmin || t > tmax) return false;
+
+    rec.t = t;
+    rec.p = r(rec.t);
+    rec.material = material;
+    Vec3 nn = u*mesh.vn[idx[1]] + v*mesh.vn[idx[2]] + (1-u-v)*mesh.vn[idx[0]];
+    rec.SetFaceNormal(r, nn);
+    return true;
+}
+
+// Times a function called count times
+// Returns the time in nanoseconds per call
+double TimeIt(int count, const std::function<void()> &fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / count;
+}
+
+void Report(char const *name, double ns) {
+    std::cout << "  " << name;
+    for (int i = std::string(name).size(); i < 44; i++)
+        std::cout << " ";
+    std::cout << ns << " ns\n";
+}
+
+// Keeps the compiler from removing the benchmarked code
+volatile Float sink;
+
+void BenchmarkSampling() {
+    const int n = 1 << 20;
+    std::vector<Float> u(n), v(n), w(n), x(n), y(n), z(n);
+    for (int i = 0; i < n; i++) {
+        u[i] = Rng::Rand01();
+        v[i] = Rng::Rand01();
+        w[i] = Rng::Rand01();
+    }
+
+    std::cout << "\nSampling (per sample)\n";
+
+    Report("Disk, rejection + Rng", TimeIt(n, [&]() {
+        Float acc = 0;
+        for (int i = 0; i < n; i++) acc += RejectionInUnitDisk().x;
+        sink = acc;
+    }));
+    Report("Disk, concentric + Rng", TimeIt(n, [&]() {
+        Float acc = 0;
+        for (int i = 0; i < n; i++) acc += ConcentricSampleDisk<Float>(Rng::Rand01(), Rng::Rand01()).x;
+        sink = acc;
+    }));
+    Report("Disk, concentric", TimeIt(n, [&]() {
+        Float acc = 0;
+        for (int i = 0; i < n; i++) acc += ConcentricSampleDisk<Float>(u[i], v[i]).x;
+        sink = acc;
+    }));
+    Report("Disk, concentric batch", TimeIt(n, [&]() {
+        ConcentricSampleDisk(n, u.data(), v.data(), x.data(), y.data());
+        sink = x[n-1];
+    }));
+
+    Report("Ball, rejection + Rng", TimeIt(n, [&]() {
+        Float acc = 0;
+        for (int i = 0; i < n; i++) acc += RejectionInUnitSphere().x;
+        sink = acc;
+    }));
+    Report("Ball, closed form + Rng", TimeIt(n, [&]() {
+        Float acc = 0;
+        for (int i = 0; i < n; i++) acc += RandomVectorInUnitSphere<Float>().x;
+        sink = acc;
+    }));
+    Report("Ball, closed form", TimeIt(n, [&]() {
+        Float acc = 0;
+        for (int i = 0; i < n; i++) acc += UniformSampleBall<Float>(u[i], v[i], w[i]).x;
+        sink = acc;
+    }));
+
+    Report("Sphere, equal area", TimeIt(n, [&]() {
+        Float acc = 0;
+        for (int i = 0; i < n; i++) acc += UniformSampleSphere<Float>(u[i], v[i]).x;
+        sink = acc;
+    }));
+    Report("Sphere, equal area batch", TimeIt(n, [&]() {
+        UniformSampleSphere(n, u.data(), v.data(), x.data(), y.data(), z.data());
+        sink = x[n-1];
+    }));
+
+    Report("Hemisphere, cosine", TimeIt(n, [&]() {
+        Float acc = 0;
+        for (int i = 0; i < n; i++) acc += CosineSampleHemisphere<Float>(u[i], v[i]).z;
+        sink = acc;
+    }));
+    Report("Hemisphere, cosine batch", TimeIt(n, [&]() {
+        CosineSampleHemisphere(n, u.data(), v.data(), x.data(), y.data(), z.data());
+        sink = z[n-1];
+    }));
+
+    // Make sure the batch versions match the scalar ones
+    Float err = 0;
+    UniformSampleSphere(n, u.data(), v.data(), x.data(), y.data(), z.data());
+    for (int i = 0; i < n; i++)
+        err = Max(err, MaxComponent(Abs(Vec3(x[i], y[i], z[i]) - UniformSampleSphere<Float>(u[i], v[i]))));
+    ConcentricSampleDisk(n, u.data(), v.data(), x.data(), y.data());
+    for (int i = 0; i < n; i++)
+        err = Max(err, MaxComponent(Abs(Vec3(x[i], y[i], 0) - ConcentricSampleDisk<Float>(u[i], v[i]))));
+    std::cout << "  Max batch/scalar difference: " << err << "\n";
+}
+
+void BenchmarkVector() {
+    const int n = 1 << 18;
+    std::vector<Ray> rays;
+    rays.reserve(n);
+    for (int i = 0; i < n; i++) {
+        Point o = RandomVector<Float>(-2, 2);
+        // Aim roughly at the unit box/triangle so about half the rays hit
+        Vec3 d = Normalize(RandomVector<Float>(-0.5, 0.5) - o);
+        rays.emplace_back(o, d, RayType::Primary);
+    }
+
+    std::cout << "\nVector math (per call)\n";
+
+    BBox box(Vec3(-0.5, -0.5, -0.5), Vec3(0.5, 0.5, 0.5));
+    Vec3 bmin = box.Min(), bmax = box.Max();
+    int hits = 0;
+    Report("BBox intersect, per axis", TimeIt(n, [&]() {
+        for (int i = 0; i < n; i++) hits += ScalarBBoxIntersect(bmin, bmax, rays[i], 0.001, Infinity);
+    }));
+    Report("BBox intersect, Vec3A", TimeIt(n, [&]() {
+        for (int i = 0; i < n; i++) hits += box.Intersect(rays[i], 0.001, Infinity);
+    }));
+
+    std::vector<shared_ptr<Primitive>> tris = CreateTriangleMesh(1, {0, 1, 2},
+        {Point(-1, -1, 0), Point(1, -1, 0), Point(0, 1, 0)}, {}, make_shared<LambertianMaterial>(Color(1, 1, 1)));
+    const Triangle &tri = *static_cast<Triangle *>(tris[0].get());
+    const TriangleMesh &mesh = *static_cast<Triangle *>(tris[0].get())->Mesh();
+    Intersection rec;
+    Report("Triangle intersect, Vec3", TimeIt(n, [&]() {
+        for (int i = 0; i < n; i++) hits += ScalarTriangleIntersect(mesh, 0, tri.material, rays[i], 0.001, Infinity, rec);
+    }));
+    Report("Triangle intersect, Vec3A", TimeIt(n, [&]() {
+        for (int i = 0; i < n; i++) hits += tri.Intersect(rays[i], 0.001, Infinity, rec);
+    }));
+
+    std::vector<Vec3> dirs(n);
+    for (int i = 0; i < n; i++)
+        dirs[i] = rays[i].Direction() * (1 + Rng::Rand01());
+    Report("Normalize, Vec3", TimeIt(n, [&]() {
+        Float acc = 0;
+        for (int i = 0; i < n; i++) acc += Normalize(dirs[i]).x;
+        sink = acc;
+    }));
+    Report("Normalize, Vec3A (rsqrt + Newton)", TimeIt(n, [&]() {
+        Float acc = 0;
+        for (int i = 0; i < n; i++) acc += Normalize(Vec3A(dirs[i])).X();
+        sink = acc;
+    }));
+    sink = hits;
+}
+
+} // namespace
+
+
+void RunBenchmarks() {
+    std::cout << "\nRunning benchmarks\n";
+    BenchmarkSampling();
+    BenchmarkVector();
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// Micro benchmarks
+// Times some of the hot functions of the renderer
+// against their previous (or naive) implementation
+
+// Runs all the benchmarks and prints the results
+void RunBenchmarks();
@@ -15,6 +15,7 @@ Camera::Camera(
     Float vfov, // top to bottom, in degrees
     Float aspect, Float aperture, Float focus_dist, bool dof, Float t0, Float t1
 ) {
+    settings = { lookfrom, lookat, vup, vfov, aperture, focus_dist, dof, t0, t1 };
     origin = lookfrom;
     lens_radius = aperture / 2;
     time0 = t0;
@@ -38,15 +39,41 @@ Camera::Camera(
     vertical = 2*half_height*focus_dist*v;
 }
 
-Ray Camera::GetRay(Float s, Float t) {
+Camera::Camera(const CameraSettings &settings, Float aspect)
+    : Camera(settings.lookfrom, settings.lookat, settings.vup, settings.vfov, aspect, settings.aperture,
+             settings.focus_dist, settings.do_dof, settings.shutter_open, settings.shutter_close) {}
+
+void Camera::Orbit(Float degrees) {
+    Vec3 center = lower_left_corner + horizontal/2 + vertical/2;
+    Float c = std::cos(Radians(degrees));
+    Float s = std::sin(Radians(degrees));
+    auto rotate = [c, s](const Vec3 &d) { return Vec3(c*d.x + s*d.z, d.y, -s*d.x + c*d.z); };
+
+    origin = center + rotate(origin - center);
+    lower_left_corner = center + rotate(lower_left_corner - center);
+    horizontal = rotate(horizontal);
+    vertical = rotate(vertical);
+    u = rotate(u);
+    v = rotate(v);
+    w = rotate(w);
+}
+
+Ray Camera::GetRay(Float s, Float t, Sampler &sampler) {
+    // Always consume the lens & time dimensions so the
+    // following ones stay consistent between cameras
+    Float lens_u, lens_v;
+    sampler.Get2D(lens_u, lens_v);
+    Float time = sampler.Get1D();
+
     Vec3 rd;
     if (do_dof)
-        rd = lens_radius * RandomInUnitDisk<Float>();
+        rd = lens_radius * ConcentricSampleDisk<Float>(lens_u, lens_v);
     Vec3 offset = u * rd.x + v * rd.y;
+    Vec3A dir = Vec3A(lower_left_corner - origin - offset) + s*Vec3A(horizontal) + t*Vec3A(vertical);
     return Ray(
         origin + offset,
-        Normalize(lower_left_corner + s*horizontal + t*vertical - origin - offset),
+        Normalize(dir).ToVec3(),
         RayType::Primary,
-        Rng::RandRange(time0, time1)
+        time0 + time * (time1 - time0)
     );
 }
\ No newline at end of file
@@ -2,8 +2,23 @@
 
 #include "nray.h"
 #include "geometry.h"
+#include "sampler.h"
+#include "vec3a.h"
 
 
+// Parameters of a camera, as described in the scene files
+struct CameraSettings {
+    Vec3 lookfrom;
+    Vec3 lookat;
+    Vec3 vup{0, 1, 0};
+    Float vfov{90};  // top to bottom, in degrees
+    Float aperture{0};
+    Float focus_dist{1};
+    bool do_dof{false};
+    Float shutter_open{0};
+    Float shutter_close{0};
+};
+
 // Camera Class
 // Used to shoot rays through the scene from given pixel.
 // It represents our 'eye'
@@ -26,7 +41,15 @@ class Camera {
             bool do_dof, Float t0, Float t1
         );
 
-        Ray GetRay(Float s, Float t) ;
+        Camera(const CameraSettings &settings, Float aspect);
+
+        // Returns the ray going through (s, t)
+        // The lens position and time are taken from the sampler
+        Ray GetRay(Float s, Float t, Sampler &sampler) ;
+
+        // Rotates the camera around the vertical (y) axis
+        // going through the center of its focus plane
+        void Orbit(Float degrees);
 
     public:
         Vec3 origin;
@@ -38,4 +61,7 @@ class Camera {
         Float time0{0};
         Float time1{0};  // shutter open/close times
         bool do_dof;
+        // Parameters it was created with (before any Orbit), to create
+        // it again for another aspect ratio or with a few changes
+        CameraSettings settings;
 };
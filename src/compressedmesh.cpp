@@ -0,0 +1,173 @@
+#include "compressedmesh.h"
+
+
+// Octahedral encoding (Meyer et al. 2010): the normal is projected on
+// the octahedron |x|+|y|+|z| = 1 whose lower half is folded over the upper one
+static Float _ToSnorm(Float v) {
+    return std::round(Clamp(v, -1, 1) * 32767);
+}
+
+uint32_t EncodeOctahedral(const Normal &n) {
+    Float inv_l1 = 1 / (std::abs(n.x) + std::abs(n.y) + std::abs(n.z));
+    Float x = n.x * inv_l1;
+    Float y = n.y * inv_l1;
+    if (n.z < 0) {
+        Float folded_x = (1 - std::abs(y)) * std::copysign((Float)1, x);
+        y = (1 - std::abs(x)) * std::copysign((Float)1, y);
+        x = folded_x;
+    }
+    uint16_t qx = (uint16_t)(int16_t)_ToSnorm(x);
+    uint16_t qy = (uint16_t)(int16_t)_ToSnorm(y);
+    return qx | (uint32_t(qy) << 16);
+}
+
+Normal DecodeOctahedral(uint32_t code) {
+    Float x = (int16_t)(code & 0xffff) * ((Float)1 / 32767);
+    Float y = (int16_t)(code >> 16) * ((Float)1 / 32767);
+    Float z = 1 - std::abs(x) - std::abs(y);
+    // Unfold the lower half
+    Float t = Max(-z, (Float)0);
+    x += (x >= 0) ? -t : t;
+    y += (y >= 0) ? -t : t;
+    return Normalize(Normal(x, y, z));
+}
+
+
+// CompressedTriangleMesh implementation
+CompressedTriangleMesh::CompressedTriangleMesh(const TriangleMesh &mesh, shared_ptr<Material> material_)
+    : nTriangles(mesh.nTriangles), material(material_) {
+
+    // Quantization grid over the mesh bounds
+    Vec3 pmin(Infinity, Infinity, Infinity), pmax(-Infinity, -Infinity, -Infinity);
+    for (const Point &p : mesh.vp) {
+        for (int axis = 0; axis < 3; axis++) {
+            pmin[axis] = Min(pmin[axis], p[axis]);
+            pmax[axis] = Max(pmax[axis], p[axis]);
+        }
+    }
+    Vec3 scale, inv_scale;
+    for (int axis = 0; axis < 3; axis++) {
+        scale[axis] = (pmax[axis] - pmin[axis]) / 65535;
+        inv_scale[axis] = scale[axis] > 0 ? 1 / scale[axis] : 0;
+    }
+    _origin = pmin;
+    _scale = scale;
+
+    _positions.resize(3 * mesh.vp.size());
+    for (size_t i = 0; i < mesh.vp.size(); i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            Float q = std::round((mesh.vp[i][axis] - pmin[axis]) * inv_scale[axis]);
+            _positions[3*i + axis] = (uint16_t)Clamp(q, (Float)0, (Float)65535);
+        }
+    }
+
+    _normals.resize(mesh.vn.size());
+    for (size_t i = 0; i < mesh.vn.size(); i++)
+        _normals[i] = EncodeOctahedral(mesh.vn[i]);
+
+    if (mesh.vp.size() <= 65536)
+        _indices16.assign(mesh.vertexIndices.begin(), mesh.vertexIndices.end());
+    else
+        _indices32.assign(mesh.vertexIndices.begin(), mesh.vertexIndices.end());
+}
+
+Normal CompressedTriangleMesh::VertexNormal(uint32_t vertex) const {
+    return DecodeOctahedral(_normals[vertex]);
+}
+
+size_t CompressedTriangleMesh::MemoryUsage() const {
+    return sizeof(*this) + _positions.size() * sizeof(uint16_t) + _normals.size() * sizeof(uint32_t)
+         + _indices16.size() * sizeof(uint16_t) + _indices32.size() * sizeof(uint32_t);
+}
+
+
+// CompressedTriangle implementation
+bool CompressedTriangle::Occluded(const Ray& r, Float tmin, Float tmax) const {
+    const CompressedTriangleMesh &mesh = *_mesh;
+    Float t, u, v;
+    return TriangleHit(mesh.Position(mesh.Index(3*_index + 0)), mesh.Position(mesh.Index(3*_index + 1)),
+                       mesh.Position(mesh.Index(3*_index + 2)), r, tmin, tmax, t, u, v);
+}
+
+bool CompressedTriangle::Intersect(const Ray& r, Float tmin, Float tmax, Intersection& rec) const {
+    const CompressedTriangleMesh &mesh = *_mesh;
+    uint32_t i0 = mesh.Index(3*_index + 0);
+    uint32_t i1 = mesh.Index(3*_index + 1);
+    uint32_t i2 = mesh.Index(3*_index + 2);
+    Float t, u, v;
+    if (!TriangleHit(mesh.Position(i0), mesh.Position(i1), mesh.Position(i2), r, tmin, tmax, t, u, v))
+        return false;
+
+    rec.t = t;
+    rec.p = r(rec.t);
+    rec.material = mesh.material;
+    // Only the normals of the hit are decoded
+    Vec3 nn = Normalize(u*mesh.VertexNormal(i1) + v*mesh.VertexNormal(i2) + (1-u-v)*mesh.VertexNormal(i0));
+    rec.SetFaceNormal(r, nn);
+    return true;
+}
+
+bool CompressedTriangle::BoundingBox(Float t0, Float t1, BBox& output_box) const {
+    // Bounds of the decompressed vertices, so they match what the rays hit
+    const CompressedTriangleMesh &mesh = *_mesh;
+    Vec3A p0 = mesh.Position(mesh.Index(3*_index + 0));
+    Vec3A p1 = mesh.Position(mesh.Index(3*_index + 1));
+    Vec3A p2 = mesh.Position(mesh.Index(3*_index + 2));
+    output_box = BBox(Min(Min(p0, p1), p2), Max(Max(p0, p1), p2));
+    return true;
+}
+
+void CompressedTriangle::_Corners(Point &p0, Point &p1, Point &p2) const {
+    const CompressedTriangleMesh &mesh = *_mesh;
+    p0 = mesh.Position(mesh.Index(3*_index + 0)).ToVec3();
+    p1 = mesh.Position(mesh.Index(3*_index + 1)).ToVec3();
+    p2 = mesh.Position(mesh.Index(3*_index + 2)).ToVec3();
+}
+
+bool CompressedTriangle::Emission(Color &radiance, LightBounds &bounds) const {
+    radiance = _mesh->material->Emitted();
+    if (MaxComponent(radiance) <= 0)
+        return false;
+    Point p0, p1, p2;
+    _Corners(p0, p1, p2);
+    bounds = TriangleEmitterBounds(p0, p1, p2, radiance);
+    return true;
+}
+
+bool CompressedTriangle::SampleDirection(const Point &p, Float u, Float v, Vec3 &wi, Float &distance, Float &pdf) const {
+    Point p0, p1, p2;
+    _Corners(p0, p1, p2);
+    return SampleTriangleDirection(p0, p1, p2, p, u, v, wi, distance, pdf);
+}
+
+Float CompressedTriangle::DirectionPdf(const Point &p, const Point &q) const {
+    Point p0, p1, p2;
+    _Corners(p0, p1, p2);
+    return TriangleDirectionPdf(p0, p1, p2, p, q);
+}
+
+
+// Builds the full precision mesh first (it creates the missing normals)
+// and keeps only its compressed copy
+std::vector<shared_ptr<Primitive>> CreateCompressedTriangleMesh(
+    int nTriangles, std::vector<int> &&vertexIndices,
+    std::vector<Point> &&vp, std::vector<Normal> &&vn,
+    shared_ptr<Material> material, Float crease_angle, int max_threads) {
+
+    std::cout << " - Creating compressed TriangleMesh: " << nTriangles << " triangles, " << vp.size() << " vertices\n";
+
+    shared_ptr<CompressedTriangleMesh> mesh;
+    size_t full_size;
+    {
+        TriangleMesh full(nTriangles, std::move(vertexIndices), std::move(vp), std::move(vn), crease_angle, max_threads);
+        full_size = full.MemoryUsage();
+        mesh = std::make_shared<CompressedTriangleMesh>(full, material);
+    }
+    std::cout << "   " << (mesh->MemoryUsage() >> 10) << " KB instead of " << (full_size >> 10) << " KB\n";
+
+    std::vector<shared_ptr<Primitive>> tris;
+    tris.reserve(nTriangles);
+    for (int i = 0; i < nTriangles; ++i)
+        tris.emplace_back(make_shared<CompressedTriangle>(mesh, i));
+    return tris;
+}
@@ -0,0 +1,168 @@
+#include <cmath>
+#include <vector>
+
+#include "denoiser.h"
+
+#include "parallel.h"
+
+
+static const int Passes = 5;
+// B3 spline weights, by distance to the center tap
+static const Float Kernel[3] = { 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+// Luminance differences tolerated, in standard deviations of the noise
+static const Float SigmaLuminance = 4;
+// Exponent of the cosine between the normals
+static const Float NormalPower = 128;
+// Depth differences tolerated, relative to the depth gradient
+static const Float SigmaDepth = 1;
+// Albedo channels below this aren't divided (black or missing surfaces)
+static const Float MinAlbedo = 0.01f;
+
+Image Denoise(const Image &beauty, const Image &albedo, const Image &normal,
+              const Image &depth, const Image &variance, int threads,
+              const Image &region) {
+    const int width = beauty.Width(), height = beauty.Height();
+    const int rows = 8;
+    const size_t count = (size_t)width * height;
+
+    // Flat copies of the buffers, the irradiance is divided by the albedo
+    std::vector<Color> factor(count), irradiance(count), normals(count);
+    std::vector<Float> depths(count), gradients(count), variances(count);
+    std::vector<char> rendered(count, 1);
+    ParallelForBlocks(height, rows, threads, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            for (int x = 0; x < width; x++) {
+                size_t p = (size_t)y * width + x;
+                if (region.Valid())
+                    rendered[p] = MaxComponent(region(x, y)) > 0;
+                Color a = albedo(x, y);
+                Color f(a.x > MinAlbedo ? a.x : 1, a.y > MinAlbedo ? a.y : 1, a.z > MinAlbedo ? a.z : 1);
+                Color c = beauty(x, y);
+                factor[p] = f;
+                irradiance[p] = Color(c.x / f.x, c.y / f.y, c.z / f.z);
+                Float l = Luminance(f);
+                variances[p] = variance(x, y).x / (l * l);
+                // Averaged normals are shorter on the edges
+                Normal n = normal(x, y);
+                normals[p] = n.LengthSquared() > 0 ? Normalize(n) : n;
+                depths[p] = depth(x, y).x;
+            }
+        }
+    });
+
+    // Depth change per pixel: the smallest of the one sided differences
+    // on each axis (not across an edge), the largest axis
+    auto difference = [&](size_t p, int x, int y, int dx, int dy) {
+        Float d = Infinity;
+        for (int s = -1; s <= 1; s += 2) {
+            int qx = x + s * dx, qy = y + s * dy;
+            if (qx < 0 || qy < 0 || qx >= width || qy >= height)
+                continue;
+            Float z = depths[(size_t)qy * width + qx];
+            if (z > 0)
+                d = Min(d, std::abs(z - depths[p]));
+        }
+        return d == Infinity ? 0 : d;
+    };
+    ParallelForBlocks(height, rows, threads, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            for (int x = 0; x < width; x++) {
+                size_t p = (size_t)y * width + x;
+                gradients[p] = Max(difference(p, x, y, 1, 0), difference(p, x, y, 0, 1));
+            }
+        }
+    });
+
+    std::vector<Color> filtered(count);
+    std::vector<Float> filtered_variances(count), blurred(count);
+    for (int pass = 0; pass < Passes; pass++) {
+        const int step = 1 << pass;
+
+        // The luminance weights use the variance blurred over 3x3 pixels,
+        // a single pixel's estimate is as noisy as its color
+        ParallelForBlocks(height, rows, threads, [&](int begin, int end) {
+            for (int y = begin; y < end; y++) {
+                for (int x = 0; x < width; x++) {
+                    size_t p = (size_t)y * width + x;
+                    if (!rendered[p]) {
+                        blurred[p] = variances[p];
+                        continue;
+                    }
+                    Float sum = 0, weights = 0;
+                    for (int dy = -1; dy <= 1; dy++) {
+                        for (int dx = -1; dx <= 1; dx++) {
+                            int qx = x + dx, qy = y + dy;
+                            if (qx < 0 || qy < 0 || qx >= width || qy >= height || !rendered[(size_t)qy * width + qx])
+                                continue;
+                            Float h = Kernel[std::abs(dx) + 1] * Kernel[std::abs(dy) + 1];
+                            sum += h * variances[(size_t)qy * width + qx];
+                            weights += h;
+                        }
+                    }
+                    blurred[p] = sum / weights;
+                }
+            }
+        });
+
+        ParallelForBlocks(height, rows, threads, [&](int begin, int end) {
+            for (int y = begin; y < end; y++) {
+                for (int x = 0; x < width; x++) {
+                    size_t p = (size_t)y * width + x;
+                    // Pixels left out of the render are kept as they are
+                    if (!rendered[p]) {
+                        filtered[p] = irradiance[p];
+                        filtered_variances[p] = variances[p];
+                        continue;
+                    }
+                    const bool hit = depths[p] > 0;
+                    Float luminance = Luminance(irradiance[p]);
+                    Color sum(0, 0, 0);
+                    Float weights = 0, sum_variance = 0;
+                    for (int dy = -2; dy <= 2; dy++) {
+                        for (int dx = -2; dx <= 2; dx++) {
+                            int qx = x + dx * step, qy = y + dy * step;
+                            if (qx < 0 || qy < 0 || qx >= width || qy >= height)
+                                continue;
+                            size_t q = (size_t)qy * width + qx;
+                            if (!rendered[q])
+                                continue;
+                            Float w = Kernel[std::abs(dx)] * Kernel[std::abs(dy)];
+                            if (q != p) {
+                                // The environment is only blended with itself
+                                if (hit != (depths[q] > 0))
+                                    continue;
+                                if (hit) {
+                                    w *= std::pow(Max(Dot(normals[p], normals[q]), (Float)0), NormalPower);
+                                    Float distance = step * std::sqrt((Float)(dx * dx + dy * dy));
+                                    w *= std::exp(-std::abs(depths[p] - depths[q]) /
+                                                  (SigmaDepth * gradients[p] * distance + 1e-4f));
+                                }
+                                // Noise of both pixels: outliers are spread to their
+                                // neighbours rather than kept as they are
+                                Float sigma = SigmaLuminance * std::sqrt(blurred[p] + blurred[q]) + 1e-4f;
+                                w *= std::exp(-std::abs(luminance - Luminance(irradiance[q])) / sigma);
+                            }
+                            sum += irradiance[q] * w;
+                            sum_variance += w * w * variances[q];
+                            weights += w;
+                        }
+                    }
+                    filtered[p] = sum / weights;
+                    filtered_variances[p] = sum_variance / (weights * weights);
+                }
+            }
+        });
+        irradiance.swap(filtered);
+        variances.swap(filtered_variances);
+    }
+
+    Image output(width, height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            size_t p = (size_t)y * width + x;
+            output.SetPixel(x, y, Color(irradiance[p].x * factor[p].x, irradiance[p].y * factor[p].y,
+                                        irradiance[p].z * factor[p].z));
+        }
+    }
+    return output;
+}
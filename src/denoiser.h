@@ -0,0 +1,18 @@
+#pragma once
+
+#include "nray.h"
+#include "geometry.h"
+#include "image.h"
+
+// Edge avoiding a-trous wavelet filter (Dammertz et al. 2010)
+// The irradiance (the beauty divided by the albedo, so textures stay
+// sharp) is blurred by 5x5 kernels spread twice as far every pass
+// Neighbours only count if their normal & depth match the pixel's, and
+// if their luminance is within the noise of both pixels (standard
+// deviations, filtered along like in SVGF)
+// The guides are the AOVs of the beauty render, all of the same size
+// Only the pixels where region isn't black (all if it's empty) are
+// filtered, from each other: the others weren't rendered
+Image Denoise(const Image &beauty, const Image &albedo, const Image &normal,
+              const Image &depth, const Image &variance, int threads,
+              const Image &region = Image());
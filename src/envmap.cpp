@@ -0,0 +1,280 @@
+#include <filesystem>
+#include <future>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#include "envmap.h"
+
+#include "parallel.h"
+#include "timer.h"
+
+
+// Size of the level above, down to 1x1
+static int HalfSize(int size) {
+    return Max((size + 1) / 2, 1);
+}
+
+EnvironmentMap::Level::Level(int width_, int height_) : width(width_), height(height_) {
+    tilesX = (width + TileSize - 1) / TileSize;
+    int tilesY = (height + TileSize - 1) / TileSize;
+    texels.resize((size_t)tilesX * tilesY * TileSize * TileSize);
+}
+
+EnvironmentMap::EnvironmentMap(const Image &image, int threads) {
+    const int rows = 16;
+    int width = image.Width(), height = image.Height();
+    if (width <= 0 || height <= 0)
+        throw std::runtime_error("Environment map image is empty");
+
+    // Full resolution, tiled
+    _levels.emplace_back(width, height);
+    ParallelForBlocks(height, rows, threads, [&](int begin, int end) {
+        Level &level = _levels[0];
+        for (int y = begin; y < end; y++) {
+            for (int x = 0; x < width; x++)
+                level(x, y) = image(x, y);
+        }
+    });
+
+    // Box filtered levels, odd sizes repeat their last row/column
+    while (width > 1 || height > 1) {
+        _levels.emplace_back(HalfSize(width), HalfSize(height));
+        const Level &below = _levels[_levels.size() - 2];
+        Level &level = _levels.back();
+        ParallelForBlocks(level.height, rows, threads, [&](int begin, int end) {
+            for (int y = begin; y < end; y++) {
+                int y0 = 2 * y, y1 = Min(2 * y + 1, below.height - 1);
+                for (int x = 0; x < level.width; x++) {
+                    int x0 = 2 * x, x1 = Min(2 * x + 1, below.width - 1);
+                    level(x, y) = (below(x0, y0) + below(x1, y0) + below(x0, y1) + below(x1, y1)) * 0.25f;
+                }
+            }
+        });
+        width = level.width;
+        height = level.height;
+    }
+
+    // Luminance of the texels, weighted by the solid angle they cover
+    // Bilinear lookups in a texel blend its neighbours, so it takes their
+    // maximum: a dark texel next to a bright one must still be sampled
+    width = Width();
+    height = Height();
+    _sums.emplace_back((size_t)width * height);
+    _sumSizes.emplace_back(width, height);
+    ParallelForBlocks(height, rows, threads, [&](int begin, int end) {
+        const Level &level = _levels[0];
+        for (int y = begin; y < end; y++) {
+            for (int x = 0; x < width; x++) {
+                Float luminance = 0;
+                for (int j = y - 1; j <= y + 1; j++) {
+                    for (int i = Max(x - 1, 0); i <= Min(x + 1, width - 1); i++)
+                        luminance = Max(luminance, Luminance(level(i, (j + height) % height)));
+                }
+                Float sin_theta = std::sin(Pi * (x + 0.5f) / width);
+                _sums[0][(size_t)y * width + x] = luminance * sin_theta;
+            }
+        }
+    });
+    for (int l = 1; l < Levels(); l++) {
+        int w = _levels[l].width, h = _levels[l].height;
+        _sums.emplace_back((size_t)w * h);
+        _sumSizes.emplace_back(w, h);
+        ParallelForBlocks(h, rows, threads, [&](int begin, int end) {
+            for (int y = begin; y < end; y++) {
+                for (int x = 0; x < w; x++) {
+                    _sums[l][(size_t)y * w + x] = _Sum(l - 1, 2*x, 2*y) + _Sum(l - 1, 2*x + 1, 2*y) +
+                                                  _Sum(l - 1, 2*x, 2*y + 1) + _Sum(l - 1, 2*x + 1, 2*y + 1);
+                }
+            }
+        });
+    }
+}
+
+Float EnvironmentMap::_Sum(int level, int x, int y) const {
+    int w = _sumSizes[level].first, h = _sumSizes[level].second;
+    if (x >= w || y >= h)
+        return 0;
+    return _sums[level][(size_t)y * w + x];
+}
+
+Color EnvironmentMap::_Bilinear(const Level &level, Float s, Float t) const {
+    Float fx = s * level.width - 0.5f;
+    Float fy = t * level.height - 0.5f;
+    int x0 = (int)std::floor(fx), y0 = (int)std::floor(fy);
+    Float dx = fx - x0, dy = fy - y0;
+    // Clamped along theta, wrapped around phi
+    int x1 = Clamp(x0 + 1, 0, level.width - 1);
+    x0 = Clamp(x0, 0, level.width - 1);
+    int y1 = (y0 + 1) % level.height;
+    y0 = (y0 + level.height) % level.height;
+    return (level(x0, y0) * (1 - dx) + level(x1, y0) * dx) * (1 - dy) +
+           (level(x0, y1) * (1 - dx) + level(x1, y1) * dx) * dy;
+}
+
+Color EnvironmentMap::Lookup(const Vec3 &w, Float width) const {
+    Float s = SphericalTheta(w) * InvPi;
+    Float t = SphericalPhi(w) * Inv2Pi;
+    // Degenerate (zero length) directions, the Image lookups ignored them too
+    if (s != s || t != t)
+        return Color(0, 0, 0);
+    if (width <= 0)
+        return _Bilinear(_levels[0], s, t);
+
+    // Level whose texels are as wide as the cone
+    Float texel = Max(Pi / Width(), 2 * Pi / Height());
+    Float level = Clamp(std::log2(width / texel), (Float)0, (Float)(Levels() - 1));
+    int l0 = (int)level;
+    int l1 = Min(l0 + 1, Levels() - 1);
+    Float d = level - l0;
+    if (d == 0)
+        return _Bilinear(_levels[l0], s, t);
+    return _Bilinear(_levels[l0], s, t) * (1 - d) + _Bilinear(_levels[l1], s, t) * d;
+}
+
+Color EnvironmentMap::Sample(Float u, Float v, Vec3 &w, Float &pdf) const {
+    pdf = 0;
+    Float total = _sums.back()[0];
+    if (total <= 0)
+        return Color(0, 0, 0);
+
+    // From the top level down, pick a column of the 2x2 children with u
+    // then one of its rows with v, reusing the remainder of each sample
+    int x = 0, y = 0;
+    for (int l = Levels() - 2; l >= 0; l--) {
+        x *= 2;
+        y *= 2;
+        Float left = _Sum(l, x, y) + _Sum(l, x, y + 1);
+        Float right = _Sum(l, x + 1, y) + _Sum(l, x + 1, y + 1);
+        Float p = left / (left + right);
+        if (u < p) {
+            u /= p;
+        }
+        else {
+            u = (u - p) / (1 - p);
+            x++;
+        }
+        Float top = _Sum(l, x, y);
+        Float bottom = _Sum(l, x, y + 1);
+        p = top / (top + bottom);
+        if (v < p) {
+            v /= p;
+        }
+        else {
+            v = (v - p) / (1 - p);
+            y++;
+        }
+        u = Min(u, (Float)0.99999994);
+        v = Min(v, (Float)0.99999994);
+    }
+
+    // Uniform in the texel
+    Float s = (x + u) / Width();
+    Float t = (y + v) / Height();
+    Float theta = s * Pi, phi = t * 2 * Pi;
+    Float sin_theta = std::sin(theta);
+    if (sin_theta <= 0)
+        return Color(0, 0, 0);
+    w = Vec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), std::cos(theta));
+    // Density in (s, t) over the 2 pi^2 sin(theta) solid angle per unit area
+    pdf = _Sum(0, x, y) / total * Width() * Height() / (2 * Pi * Pi * sin_theta);
+    return _Bilinear(_levels[0], s, t);
+}
+
+Float EnvironmentMap::Pdf(const Vec3 &w) const {
+    Float total = _sums.back()[0];
+    Float theta = SphericalTheta(w);
+    Float sin_theta = std::sin(theta);
+    if (total <= 0 || !(sin_theta > 0))
+        return 0;
+    int x = Min((int)(theta * InvPi * Width()), Width() - 1);
+    int y = Min((int)(SphericalPhi(w) * Inv2Pi * Height()), Height() - 1);
+    return _Sum(0, x, y) / total * Width() * Height() / (2 * Pi * Pi * sin_theta);
+}
+
+size_t EnvironmentMap::MemoryUsage() const {
+    size_t bytes = 0;
+    for (const Level &level : _levels)
+        bytes += level.texels.size() * sizeof(Color);
+    for (const std::vector<Float> &sums : _sums)
+        bytes += sums.size() * sizeof(Float);
+    return bytes;
+}
+
+shared_ptr<EnvironmentMap> LoadEnvironmentMap(const std::string &path, int max_threads) {
+    struct CachedMap {
+        std::filesystem::file_time_type time;
+        std::weak_ptr<EnvironmentMap> map;
+        // Valid while a thread loads the map, the others wait for it
+        std::shared_future<shared_ptr<EnvironmentMap>> loading;
+    };
+    static std::map<std::string, shared_ptr<CachedMap>> cache;
+    static std::mutex mtx;
+
+    std::error_code error;
+    auto time = std::filesystem::last_write_time(path, error);
+    std::promise<shared_ptr<EnvironmentMap>> promise;
+    shared_ptr<CachedMap> entry;
+    {
+        // Only the lookup is locked, maps are loaded outside of it
+        std::unique_lock<std::mutex> lck(mtx);
+        auto cached = cache.find(path);
+        if (!error && cached != cache.end() && cached->second->time == time) {
+            shared_ptr<EnvironmentMap> map = cached->second->map.lock();
+            auto loading = cached->second->loading;
+            if (map || loading.valid()) {
+                lck.unlock();
+                if (!map)
+                    map = loading.get();
+                std::cout << " - Environment " << path << " (cached)\n";
+                return map;
+            }
+        }
+        if (!error) {
+            entry = make_shared<CachedMap>();
+            entry->time = time;
+            entry->loading = promise.get_future().share();
+            cache[path] = entry;
+        }
+    }
+
+    try {
+        Timer timer;
+        timer.Start();
+        shared_ptr<EnvironmentMap> map;
+        size_t decoded;
+        {
+            Image image;
+            image.LoadFromFile(path.c_str());
+            decoded = (size_t)image.Width() * image.Height() * 3 * sizeof(Float);
+            map = make_shared<EnvironmentMap>(image, ThreadCount(max_threads));
+        }
+        timer.Stop();
+        // The decoded image & the pyramids are both alive while building
+        std::cout << " - Environment " << path << ": " << map->Width() << "x" << map->Height()
+                  << ", peak " << ((decoded + map->MemoryUsage()) >> 10) << " KB, kept "
+                  << (map->MemoryUsage() >> 10) << " KB, loaded in: ";
+        timer.Print();
+        std::cout << "\n";
+
+        if (entry) {
+            // Only kept while the scenes use it
+            std::unique_lock<std::mutex> lck(mtx);
+            entry->map = map;
+            entry->loading = {};
+        }
+        promise.set_value(map);
+        return map;
+    }
+    catch (...) {
+        // Loaded again by the next scene
+        if (entry) {
+            std::unique_lock<std::mutex> lck(mtx);
+            auto cached = cache.find(path);
+            if (cached != cache.end() && cached->second == entry)
+                cache.erase(cached);
+        }
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "nray.h"
+#include "geometry.h"
+#include "image.h"
+
+// Environment map (image based lighting)
+// The lat-long image is kept as a mip pyramid for filtered lookups
+// and a pyramid of luminance sums to sample its bright parts
+// Like the Image lookups it replaces, x follows theta and y follows phi
+class EnvironmentMap {
+    public:
+        // Builds both pyramids from the image, each level in parallel
+        EnvironmentMap(const Image &image, int threads);
+
+        // Radiance coming from the direction w (normalized), filtered over a
+        // cone of this width (in radians). 0 is a bilinear full resolution
+        // lookup, wider cones blend the two closest levels (trilinear)
+        Color Lookup(const Vec3 &w, Float width = 0) const;
+
+        // Samples a direction proportionally to the luminance of the map,
+        // descending the luminance pyramid from (u, v)
+        // Returns the radiance from w & its density (per solid angle)
+        Color Sample(Float u, Float v, Vec3 &w, Float &pdf) const;
+        // Density of the directions returned by Sample
+        Float Pdf(const Vec3 &w) const;
+
+        int Width() const { return _levels[0].width; }
+        int Height() const { return _levels[0].height; }
+        int Levels() const { return _levels.size(); }
+        // Bytes used by both pyramids
+        size_t MemoryUsage() const;
+
+        // Texels are stored in square tiles, so the texels of a
+        // bilinear lookup are most often on the same cache lines
+        static constexpr int TileSize = 8;
+
+    private:
+        struct Level {
+            int width{0};
+            int height{0};
+            int tilesX{0};
+            std::vector<Color> texels;
+
+            Level(int width_, int height_);
+            Color& operator()(int x, int y) {
+                return texels[_Tiled(x, y)];
+            }
+            const Color& operator()(int x, int y) const {
+                return texels[_Tiled(x, y)];
+            }
+            int _Tiled(int x, int y) const {
+                int tile = (y / TileSize) * tilesX + x / TileSize;
+                return tile * TileSize * TileSize + (y % TileSize) * TileSize + x % TileSize;
+            }
+        };
+
+        // Bilinear lookup of a level, wraps around phi
+        Color _Bilinear(const Level &level, Float s, Float t) const;
+
+        // Sum of the luminance pyramid at (x, y), 0 outside of the level
+        Float _Sum(int level, int x, int y) const;
+
+        // Color pyramid, _levels[0] is the full resolution
+        std::vector<Level> _levels;
+        // Luminance * sin(theta) of the texels (row major), each level
+        // sums 2x2 texels of the one below, the last one is a single total
+        std::vector<std::vector<Float>> _sums;
+        std::vector<std::pair<int, int>> _sumSizes;
+};
+
+// Loads the environment map of an image file, reporting its load time
+// & memory. Maps are shared while a scene uses them (sequences reloading
+// their scene, the render server): files already loaded & unchanged
+// on disk aren't decoded again. The pyramids are built on up to max_threads
+// (see ThreadCount)
+shared_ptr<EnvironmentMap> LoadEnvironmentMap(const std::string &path, int max_threads = -1);
@@ -21,18 +21,16 @@ struct Vector3
     
     Vector3<T> operator-() const { return Vector3<T>(-x, -y, -z); }
     
+    // Indexed access goes through a table of
+    // member pointers so it doesn't branch
     T operator[](unsigned i) const { 
         assert(i>=0 && i<=2);
-        if (i == 0) return x;
-        else if (i == 1) return y;
-        return z;
+        return this->*_members[i];
     }
 
     T& operator[](unsigned i) {
         assert(i>=0 && i<=2);
-        if (i == 0) return x;
-        else if (i == 1) return y;
-        return z;
+        return this->*_members[i];
     }
 
     Vector3<T> operator+(const Vector3<T> &v) const {
@@ -85,13 +83,13 @@ struct Vector3
 
     template <typename U>
     Vector3<T> operator/(U s) const {
-        Float k = (Float) 1 / s;
+        T k = (T) 1 / s;
         return Vector3(x * k, y * k, z * k);
     }
 
     template <typename U>
     Vector3<T>& operator/=(U s) {
-        Float k = (Float) 1 / s;
+        T k = (T) 1 / s;
         x *= k; y *= k; z *= k;
         return *this;
     }
@@ -115,6 +113,9 @@ struct Vector3
         // Returns if any member variable has a nan
         return IsNan(x) || IsNan(y) || IsNan(z);
     }
+
+  private:
+    static constexpr T Vector3::*_members[3] = { &Vector3::x, &Vector3::y, &Vector3::z };
 };
 
 template <typename T, typename U>
@@ -206,13 +207,66 @@ Vector3<T> Refract(const Vector3<T>& uv, const Vector3<T>& n, Float etai_over_et
     return r_out_parallel + r_out_perp;
 }
 
+// Sampling functions
+// Closed form mappings from uniform samples in [0,1)^n
+// No rejection so every sample is used and stratification is preserved
+
+template <typename T>
+Vector3<T> ConcentricSampleDisk(Float u, Float v) {
+    // Maps a 2D sample to a point in the unit disk (Shirley & Chiu)
+    Float uo = 2*u - 1;
+    Float vo = 2*v - 1;
+    if (uo == 0 && vo == 0)
+        return Vector3<T>(0, 0, 0);
+    Float r, theta;
+    if (std::abs(uo) > std::abs(vo)) {
+        r = uo;
+        theta = (Pi/4) * (vo / uo);
+    } else {
+        r = vo;
+        theta = (Pi/2) - (Pi/4) * (uo / vo);
+    }
+    return Vector3<T>(r*std::cos(theta), r*std::sin(theta), 0);
+}
+
+template <typename T>
+Vector3<T> CosineSampleHemisphere(Float u, Float v) {
+    // Maps a 2D sample to a cosine weighted direction around +z
+    // by projecting a disk sample up to the hemisphere (Malley's method)
+    Vector3<T> d = ConcentricSampleDisk<T>(u, v);
+    d.z = std::sqrt(Max((Float)0, 1 - d.x*d.x - d.y*d.y));
+    return d;
+}
+
+template <typename T>
+Vector3<T> UniformSampleSphere(Float u, Float v) {
+    // Maps a 2D sample to a unit vector using the equal area
+    // octahedral mapping (Clarberg), phi stays within [0, Pi/2]
+    Float uo = 2*u - 1;
+    Float vo = 2*v - 1;
+    Float up = std::abs(uo);
+    Float vp = std::abs(vo);
+    Float signed_distance = 1 - (up + vp);
+    Float r = 1 - std::abs(signed_distance);
+    Float phi = (r == 0 ? 1 : (vp - up) / r + 1) * (Pi/4);
+    Float z = std::copysign(1 - r*r, signed_distance);
+    Float rxy = r * std::sqrt(Max((Float)0, 2 - r*r));
+    return Vector3<T>(std::copysign(std::cos(phi), uo) * rxy,
+                      std::copysign(std::sin(phi), vo) * rxy,
+                      z);
+}
+
+template <typename T>
+Vector3<T> UniformSampleBall(Float u, Float v, Float w) {
+    // Maps a 3D sample to a point in the unit sphere
+    return UniformSampleSphere<T>(u, v) * std::cbrt(w);
+}
+
+
 template <typename T>
 Vector3<T> RandomUnitVector() {
     // Generates a random unit vector
-    Float a = Rng::RandRange(0, 2*Pi);
-    Float z = Rng::RandRange(-1, 1);
-    Float r = sqrt(1 - z*z);
-    return Vector3<T>(r*cos(a), r*sin(a), z);
+    return UniformSampleSphere<T>(Rng::Rand01(), Rng::Rand01());
 }
 
 template <typename T>
@@ -227,25 +281,16 @@ Vector3<T> RandomVector(Float min, Float max) {
     return Vector3<T>(Rng::RandRange(min, max), Rng::RandRange(min, max), Rng::RandRange(min, max));
 }
 
-
 template <typename T>
 Vector3<T> RandomVectorInUnitSphere() {
     // Generates a random vector in a unit sphere
-    while (true) {
-        Vector3<T> p = RandomVector<T>(-1,1);
-        if (p.LengthSquared() >= 1) continue;
-        return p;
-    }
+    return UniformSampleBall<T>(Rng::Rand01(), Rng::Rand01(), Rng::Rand01());
 }
 
 template <typename T>
 Vector3<T> RandomInUnitDisk() {
     // Generates a random vector in a unit disk
-    while (true) {
-        auto p = Vector3<T>(Rng::RandRange(-1,1), Rng::RandRange(-1,1), 0);
-        if (p.LengthSquared() >= 1) continue;
-        return p;
-    }
+    return ConcentricSampleDisk<T>(Rng::Rand01(), Rng::Rand01());
 }
 
 template <typename T>
@@ -268,6 +313,11 @@ T MaxComponent(const Vector3<T> &v) {
     return std::max(v.x, std::max(v.y, v.z));
 }
 
+// Relative luminance of a linear (Rec. 709) color
+inline Float Luminance(const Color &c) {
+    return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
 inline Float SphericalTheta(const Vec3 &v) {
     return std::acos(Clamp(v.z, -1, 1));
 }
@@ -294,12 +344,16 @@ class Ray
 {
 public:
     Ray() : _tMax(Infinity), _time(0.f) {}
-    Ray(const Point &o, const Vec3 &d, RayType type, Float time=0) : _origin(o), _direction(d), _type(type),_time(time) {}
+    Ray(const Point &o, const Vec3 &d, RayType type, Float time=0) : _origin(o), _direction(d), _type(type),_time(time) {
+        _invDirection = Vec3(1 / d.x, 1 / d.y, 1 / d.z);
+    }
 
     Point operator() (Float t) const { return _origin + _direction * t; }
 
     Point Origin() const { return _origin;}
     Vec3 Direction() const { return _direction;}
+    // 1/Direction, cached for the bbox slab tests
+    const Vec3& InvDirection() const { return _invDirection;}
     Float Time() const { return _time;}
     Float TMax() const { return _tMax;}
     RayType Type() const {return _type;}
@@ -307,6 +361,7 @@ public:
 private:
     Point _origin; // Ray origin
     Vec3 _direction; // Ray Direction
+    Vec3 _invDirection; // Inverse of the Ray Direction
     Float _time{0}; // Ray time
     Float _tMax{Infinity}; // Ray max distance
     RayType _type; // Type of Ray
@@ -1,3 +1,8 @@
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
@@ -9,7 +14,14 @@
 
 Image::Image(int width, int height) : _width(width), _height(height), _channels(3) {
     _size = _width * _height * _channels;
-    _pixels = make_unique<Float[]>(_size);
+    _pixels = _Allocate(_size);
+}
+
+unique_ptr<Float[], Image::_Free> Image::_Allocate(int size) {
+    Float *pixels = (Float*)std::calloc(Max(size, 1), sizeof(Float));
+    if (!pixels)
+        throw std::bad_alloc();
+    return unique_ptr<Float[], _Free>(pixels);
 }
 
 
@@ -21,7 +33,7 @@ Image::Image(const Image& other)
     _height = other._height;
     _channels = other._channels;
     _size = other._size;
-    _pixels = make_unique<Float[]>(_size);
+    _pixels = _Allocate(_size);
     std::copy(other._pixels.get(), other._pixels.get()+_size, _pixels.get());
 
 }
@@ -46,7 +58,7 @@ Image& Image::operator=(const Image& other)
         _height = other._height;
         _channels = other._channels;
         _size = other._size;
-        _pixels = make_unique<Float[]>(_size);
+        _pixels = _Allocate(_size);
         std::copy(other._pixels.get(), other._pixels.get()+_size, _pixels.get());
     }
     return *this;
@@ -94,6 +106,27 @@ void Image::SetPixel(int x, int y, const Color &c) {
     _pixels[index+2] = c.z;
 }
 
+Image Image::Resized(int width, int height) const {
+    Image resized(width, height);
+    if (_size == 0)
+        return resized;
+    for (int y = 0; y < height; y++) {
+        // Pixel centers of the resized image in this one
+        Float fy = Clamp((y + 0.5f) * _height / height - 0.5f, (Float)0, (Float)(_height - 1));
+        int y0 = (int)fy, y1 = Min(y0 + 1, _height - 1);
+        Float dy = fy - y0;
+        for (int x = 0; x < width; x++) {
+            Float fx = Clamp((x + 0.5f) * _width / width - 0.5f, (Float)0, (Float)(_width - 1));
+            int x0 = (int)fx, x1 = Min(x0 + 1, _width - 1);
+            Float dx = fx - x0;
+            Color c = ((*this)(x0, y0) * (1 - dx) + (*this)(x1, y0) * dx) * (1 - dy) +
+                      ((*this)(x0, y1) * (1 - dx) + (*this)(x1, y1) * dx) * dy;
+            resized.SetPixel(x, y, c);
+        }
+    }
+    return resized;
+}
+
 bool Image::_Index(int x, int y, int &index) const {
     index = -1;
     if ( (x < 0) || (x >= _width) || (y < 0) || (y >= _height) )
@@ -103,40 +136,49 @@ bool Image::_Index(int x, int y, int &index) const {
 }
 
 void Image::WriteToFile(char const *filename) const {
-    unsigned char *img;
-    img = new unsigned char[_width * _height * _channels];
+    std::vector<unsigned char> img(_size);
+
+    for (int i=0; i < _size; i++)
+        img[i] = ToByte(_pixels[i]);
 
-    for (int i=0; i < _size; i++) {
-        float val = _pixels[i];
-        if (val != val)
-            val = 0.0;
+    stbi_write_png(filename, _width, _height, _channels, img.data(), 0);
+}
 
-        // Gamma correction
-        val = sqrt(val);
+unsigned char Image::ToByte(Float value) {
+    if (value != value)
+        value = 0.0;
 
-        img[i] = static_cast<unsigned char>(256 * Clamp(val, 0.0, 0.999));
-    }
+    // Gamma correction
+    value = sqrt(value);
 
-    stbi_write_png(filename, _width, _height, _channels, img, 0);
+    return static_cast<unsigned char>(256 * Clamp(value, 0.0, 0.999));
 }
 
-void Image::LoadFromFile(char const *filename) {
-    // Get image info from file
-    int x,y,comp;
-    stbi_info(filename, &x, &y, &comp);
+void Image::LoadFromFile(char const *filename, bool rendered) {
+    // Always decoded to RGB, whatever the channels in the file
+    int x, y, n;
+    float *data;
+    if (rendered && !stbi_is_hdr(filename)) {
+        // The byte b is the middle of the values ToByte writes as b
+        unsigned char *bytes = stbi_load(filename, &x, &y, &n, 3);
+        data = bytes ? static_cast<float *>(std::malloc(sizeof(float) * x * y * 3)) : nullptr;
+        for (size_t i = 0; data && i < (size_t)x * y * 3; i++) {
+            float value = (bytes[i] + 0.5f) / 256;
+            data[i] = value * value;
+        }
+        stbi_image_free(bytes);
+    }
+    else {
+        data = stbi_loadf(filename, &x, &y, &n, 3);
+    }
+    if (!data)
+        throw std::runtime_error("Can't load image " + std::string(filename) + ": " + stbi_failure_reason());
 
     _width = x;
     _height = y;
     _channels = 3;
     _size = _width * _height * _channels;
-
-    // Load data
-    int n = 3;
-    float *data = stbi_loadf(filename, &x, &y, &n, 0);
-
-    // Copy data to our pixels array
-    _pixels = make_unique<Float[]>(_size);
-    for (int i = 0; i < _size; i++) {
-        _pixels[i] = data[i];
-    }
+    // The decoded buffer is used as it is
+    static_assert(std::is_same<Float, float>::value, "stbi_loadf decodes floats");
+    _pixels.reset(data);
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdlib>
+
 #include "nray.h"
 
 
@@ -29,16 +31,25 @@ class Image {
     // Sets the Color at pixel (x, y);
     void SetPixel(int x, int y, const Color &c);
 
-    // Loads an Image from a file
-    void LoadFromFile(char const *filename);
+    // Returns the Image scaled to width x height (bilinear)
+    Image Resized(int width, int height) const;
+
+    // Loads an Image from a file (converted to RGB), throws if it can't
+    // The decoded buffer is kept as the pixels, without any copy
+    // 8 bits files are decoded with a 2.2 gamma, or the 2 ToByte encodes
+    // for images written by WriteToFile, to get their values back
+    void LoadFromFile(char const *filename, bool rendered = false);
 
     // Writes the Image as a *.png file
     void WriteToFile(char const *filename) const;
 
-    int Width() {return _width;}
-    int Height() {return _height;}
+    // Gamma corrected 8 bits value of a channel, as written to the png files
+    static unsigned char ToByte(Float value);
 
-    bool Valid() { 
+    int Width() const {return _width;}
+    int Height() const {return _height;}
+
+    bool Valid() const { 
       return (_size > 0);
     }
 
@@ -47,8 +58,16 @@ class Image {
     int _height{0};
     int _channels{3};
 
-    unique_ptr<Float[]> _pixels;
+    // Pixels are allocated with malloc like the buffers stb_image
+    // decodes, so that they can be adopted as they are
+    struct _Free {
+      void operator()(Float *pixels) const { std::free(pixels); }
+    };
+    unique_ptr<Float[], _Free> _pixels;
     int _size{0};
 
+    // Zeroed pixels
+    static unique_ptr<Float[], _Free> _Allocate(int size);
+
     bool _Index(int x, int y, int &index) const;
 };
\ No newline at end of file
@@ -1,6 +1,53 @@
 #pragma once
 
+#include <atomic>
+
 #include "primitive.h"
+#include "sdf.h"
+#include "sdfcache.h"
+
+
+// Ray marching counts of one thread
+struct MarchCounts {
+    uint64_t marches{0};
+    uint64_t steps{0};
+    uint64_t hits{0};
+    // Steps answered by a brick cache instead of the sdf
+    uint64_t cached{0};
+};
+
+// Ray marching statistics, shared by all the ImplicitPrimitive
+struct MarchStats {
+    // Counted by each thread without contention, added to the totals
+    // by Flush once per tile
+    inline static thread_local MarchCounts local;
+
+    std::atomic<uint64_t> marches{0};
+    std::atomic<uint64_t> steps{0};
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> cached{0};
+
+    // Adds the counts of the calling thread to the totals
+    void Flush() {
+        if (local.marches == 0)
+            return;
+        marches.fetch_add(local.marches, std::memory_order_relaxed);
+        steps.fetch_add(local.steps, std::memory_order_relaxed);
+        hits.fetch_add(local.hits, std::memory_order_relaxed);
+        cached.fetch_add(local.cached, std::memory_order_relaxed);
+        local = MarchCounts();
+    }
+
+    void Print() const {
+        if (marches == 0)
+            return;
+        std::cout << "\nRay marching: " << marches << " marches, " << hits << " hits, "
+                  << steps / (Float)marches << " sdf evaluations per march";
+        if (cached > 0)
+            std::cout << " (" << 100 * cached / (Float)steps << "% from the brick caches)";
+        std::cout << "\n";
+    }
+};
 
 
 // ImplicitPrimitive Base virtual Class
@@ -9,36 +56,144 @@ class ImplicitPrimitive: public Primitive  {
     public:
 
         bool Intersect(const Ray& r, Float tmin, Float tmax, Intersection& rec) const {
-            Float t = tmin;
-            for(int i=0; i<512; i++) {
-                Float h = sdf( r(t) );
-                if( h < MachineEpsilon * t) {
-                    rec.t = t;
-                    rec.p = r(rec.t);
-                    // Compute Gradient to get normal
-                    Float delta = 10e-5;
-                    // Float delta = 0.0001;
-                    Normal norm = Normalize(Vec3( sdf(rec.p + Vec3(delta, 0, 0)) - sdf(rec.p + Vec3(-delta, 0, 0)),
-                                                  sdf(rec.p + Vec3(0, delta, 0)) - sdf(rec.p + Vec3(0, -delta, 0)),
-                                                  sdf(rec.p + Vec3(0, 0, delta)) - sdf(rec.p + Vec3(0, 0, -delta)) ));
-                    rec.SetFaceNormal(r, norm);
-                    rec.material = this->GetMaterial();
-                    return true;
+            // Only march the part of the ray inside the bounding box
+            BBox box;
+            Float t_enter, t_exit;
+            if (!BoundingBox(r.Time(), r.Time(), box) || !box.Intersect(r, tmin, tmax, t_enter, t_exit))
+                return false;
+
+            Float t;
+            int steps, cached = 0;
+            bool hit = March(r, t_enter, t_exit, t, steps, cached);
+            _Count(steps, cached, hit);
+            if (!hit)
+                return false;
+
+            rec.t = t;
+            rec.p = r(rec.t);
+            rec.SetFaceNormal(r, NormalAt(rec.p));
+            rec.material = this->GetMaterial();
+            return true;
+        };
+
+        // Same march as Intersect, without the normal
+        bool Occluded(const Ray& r, Float tmin, Float tmax) const {
+            BBox box;
+            Float t_enter, t_exit;
+            if (!BoundingBox(r.Time(), r.Time(), box) || !box.Intersect(r, tmin, tmax, t_enter, t_exit))
+                return false;
+
+            Float t;
+            int steps, cached = 0;
+            bool hit = March(r, t_enter, t_exit, t, steps, cached);
+            _Count(steps, cached, hit);
+            return hit;
+        }
+
+        // Over-relaxed sphere tracing (Keinert et al. 2014) between t0 and t1
+        // Steps are enlarged by MarchRelaxation as long as the consecutive
+        // unbounding spheres overlap, otherwise we fall back to plain sphere tracing
+        // Away from the surface, distances come from the brick cache if any
+        bool March(const Ray& r, Float t0, Float t1, Float &t_hit, int &steps, int &cached) const {
+            // Work in world distances, rays directions aren't always normalized
+            Float len = r.Direction().Length();
+            Float inv_len = 1 / len;
+            Float dist = t0 * len;
+            Float dist_max = t1 * len;
+
+            // Rays starting inside the surface march the negated field
+            Float radius = _Distance(r(t0), cached);
+            Float sign = (radius < 0) ? -1 : 1;
+            radius *= sign;
+            steps = 1;
+
+            Float omega = MarchRelaxation;
+            Float prev_radius = 0;
+            Float step = 0;
+            while (true) {
+                if (omega > 1 && radius + prev_radius < step) {
+                    // The spheres don't overlap, we might have stepped over the surface
+                    // Go back to the plain sphere tracing step and stop relaxing
+                    dist -= step - prev_radius;
+                    step = prev_radius;
+                    omega = 1;
                 }
-                t += h;
-                if (t >= tmax)
+                else {
+                    if (radius < SurfaceEpsilon * Max(dist, (Float)1)) {
+                        t_hit = dist * inv_len;
+                        return true;
+                    }
+                    step = radius * omega;
+                    prev_radius = radius;
+                    dist += step;
+                }
+                if (dist >= dist_max || steps >= MaxMarchSteps)
                     return false;
+                radius = sign * _Distance(r(dist * inv_len), cached);
+                steps++;
             }
-            return false;
-        };
+        }
 
         virtual bool BoundingBox(Float t0, Float t1, BBox& output_box) const = 0;
 
         virtual Float sdf(Point p) const = 0;
 
+        // Returns the surface normal at p
+        // Defaults to the tetrahedral (4 taps) gradient of the sdf
+        virtual Normal NormalAt(const Point &p) const {
+            const Float h = 1e-4;
+            const Vec3 k0(1, -1, -1), k1(-1, -1, 1), k2(-1, 1, -1), k3(1, 1, 1);
+            return Normalize( k0 * sdf(p + k0*h) + k1 * sdf(p + k1*h) +
+                              k2 * sdf(p + k2*h) + k3 * sdf(p + k3*h) );
+        }
+
         virtual shared_ptr<Material> GetMaterial() const = 0;
 
+        // Samples the sdf into a sparse brick cache used by March
+        // Returns false (and keeps marching the sdf) if the primitive is unbounded
+        bool BuildCache(int resolution, size_t budget_bytes, int threads) {
+            BBox box;
+            if (!BoundingBox(0, 0, box))
+                return false;
+            // Pad the box so rays entering it start in the cache
+            Vec3 pad = (box.Max() - box.Min()) * (Float)0.01;
+            box = BBox(box.Min() - pad, box.Max() + pad);
+            _cache = make_shared<SdfBrickCache>([this](const Point &p) { return sdf(p); },
+                                                box, resolution, budget_bytes, threads);
+            return true;
+        }
+
+        const SdfBrickCache *Cache() const { return _cache.get(); }
+
+        // Maximum number of sdf evaluations per march
+        static constexpr int MaxMarchSteps = 256;
+        // Step enlargement factor of the over-relaxed sphere tracing
+        static constexpr Float MarchRelaxation = 1.6;
+        // We hit the surface when closer than this (relative to the distance)
+        static constexpr Float SurfaceEpsilon = 1e-5;
+
+        inline static MarchStats stats;
+
+    private:
+        static void _Count(int steps, int cached, bool hit) {
+            MarchCounts &counts = MarchStats::local;
+            counts.marches++;
+            counts.steps += steps;
+            counts.cached += cached;
+            counts.hits += hit;
+        }
+
+        // Distance used by March, cached when possible
+        Float _Distance(const Point &p, int &cached) const {
+            Float d;
+            if (_cache && _cache->Lookup(p, d)) {
+                cached++;
+                return d;
+            }
+            return sdf(p);
+        }
 
+        shared_ptr<SdfBrickCache> _cache;
 };
 
 class ImplicitSphere: public ImplicitPrimitive {
@@ -55,10 +210,31 @@ class ImplicitSphere: public ImplicitPrimitive {
             return ( p - _center ).Length() - _radius;
         }
 
+        Normal NormalAt(const Point &p) const {
+            return Normalize(p - _center);
+        }
+
         shared_ptr<Material> GetMaterial() const {
             return material;
         }
 
+        // Sampled like the analytic sphere it marches
+        bool Emission(Color &radiance, LightBounds &bounds) const {
+            radiance = material->Emitted();
+            if (MaxComponent(radiance) <= 0)
+                return false;
+            bounds = SphereEmitterBounds(_center, _radius, radiance);
+            return true;
+        }
+
+        bool SampleDirection(const Point &p, Float u, Float v, Vec3 &wi, Float &distance, Float &pdf) const {
+            return SampleSphereDirection(_center, _radius, p, u, v, wi, distance, pdf);
+        }
+
+        Float DirectionPdf(const Point &p, const Point &q) const {
+            return SphereDirectionPdf(_center, _radius, p, q);
+        }
+
 
     shared_ptr<Material> material;
 
@@ -84,6 +260,20 @@ class ImplicitBox: public ImplicitPrimitive {
             return Min(Max(d.x,Max(d.y,d.z)),0.0) + Vec3(Max(d.x,0),Max(d.y,0),Max(d.z,0)).Length();
         }
 
+        Normal NormalAt(const Point &p) const {
+            Vec3 q = p - _center;
+            Vec3 d = Abs(q) - _size;
+            Vec3 s(std::copysign(1, q.x), std::copysign(1, q.y), std::copysign(1, q.z));
+            // Outside, the gradient points from the closest point of the box
+            if (MaxComponent(d) > 0)
+                return Normalize(Vec3(Max(d.x, (Float)0), Max(d.y, (Float)0), Max(d.z, (Float)0)) * s);
+            // Inside, it's the normal of the closest face
+            Normal n;
+            int axis = MaxDimension(d);
+            n[axis] = s[axis];
+            return n;
+        }
+
         shared_ptr<Material> GetMaterial() const {
             return material;
         }
@@ -95,3 +285,35 @@ class ImplicitBox: public ImplicitPrimitive {
         Point _center;
         Vec3 _size;
 };
+
+
+// Implicit primitive defined by a compiled SDF graph
+// A whole composition (booleans, blends, repetitions...) is a single
+// BVH leaf marched once
+class ImplicitGraph: public ImplicitPrimitive {
+    public:
+        ImplicitGraph(SdfProgram &&program, shared_ptr<Material> mat) : material(mat), _program(std::move(program)) {
+            _bounded = _program.Bounds(_bbox);
+        }
+
+        bool BoundingBox(Float t0, Float t1, BBox& output_box) const {
+            output_box = _bbox;
+            return _bounded;
+        }
+
+        Float sdf(Point p) const {
+            return _program.Evaluate(p);
+        }
+
+        shared_ptr<Material> GetMaterial() const {
+            return material;
+        }
+
+
+    shared_ptr<Material> material;
+
+    private:
+        SdfProgram _program;
+        BBox _bbox;
+        bool _bounded{false};
+};
@@ -0,0 +1,394 @@
+#include <algorithm>
+#include <cmath>
+
+#include "lights.h"
+
+#include "primitive.h"
+
+
+static Float SafeSqrt(Float x) {
+    return std::sqrt(Max(x, (Float)0));
+}
+
+static Float SafeAcos(Float x) {
+    return std::acos(Clamp(x, (Float)-1, (Float)1));
+}
+
+// Cosine & sine of max(a - b, 0), from the ones of the angles a & b
+static Float CosSubClamped(Float sin_a, Float cos_a, Float sin_b, Float cos_b) {
+    return cos_a > cos_b ? 1 : cos_a * cos_b + sin_a * sin_b;
+}
+
+static Float SinSubClamped(Float sin_a, Float cos_a, Float sin_b, Float cos_b) {
+    return cos_a > cos_b ? 0 : sin_a * cos_b - cos_a * sin_b;
+}
+
+// Angle between unit vectors, without the acos precision loss near 0 & pi
+static Float AngleBetween(const Vec3 &a, const Vec3 &b) {
+    if (Dot(a, b) < 0)
+        return Pi - 2 * std::asin(Min((a + b).Length() / 2, (Float)1));
+    return 2 * std::asin(Min((b - a).Length() / 2, (Float)1));
+}
+
+static Point Center(const BBox &box) {
+    return (box.Min() + box.Max()) * 0.5f;
+}
+
+
+Float LightBounds::Importance(const Point &p, const Normal &n) const {
+    if (phi <= 0)
+        return 0;
+    // The bounds are seen within the cone of their bounding sphere
+    Point center = Center(box);
+    Float radius2 = ((box.Max() - box.Min()) * 0.5f).LengthSquared();
+    Float d2 = DistanceSquared(p, center);
+    if (d2 <= radius2)
+        return phi / radius2;
+    Vec3 wi = (p - center) / std::sqrt(d2);
+    Float sin2_b = radius2 / d2;
+    Float sin_b = std::sqrt(sin2_b), cos_b = SafeSqrt(1 - sin2_b);
+
+    // Smallest angle between the normals & the direction to p, once the
+    // normals cone & the bounds cone are taken away
+    Float cos_w = Dot(axis, wi);
+    if (twoSided)
+        cos_w = std::abs(cos_w);
+    Float sin_w = SafeSqrt(1 - cos_w * cos_w);
+    Float sin_o = SafeSqrt(1 - cosThetaO * cosThetaO);
+    Float cos_x = CosSubClamped(sin_w, cos_w, sin_o, cosThetaO);
+    Float sin_x = SinSubClamped(sin_w, cos_w, sin_o, cosThetaO);
+    Float cos_p = CosSubClamped(sin_x, cos_x, sin_b, cos_b);
+    if (cos_p <= cosThetaE)
+        return 0;
+
+    // Smallest angle between n & the directions to the bounds,
+    // lights behind the surface can't reach it
+    Float cos_i = -Dot(wi, n);
+    Float sin_i = SafeSqrt(1 - cos_i * cos_i);
+    Float cos_pi = CosSubClamped(sin_i, cos_i, sin_b, cos_b);
+    return Max(phi * cos_p * cos_pi / d2, (Float)0);
+}
+
+LightBounds Union(const LightBounds &a, const LightBounds &b) {
+    if (a.phi <= 0)
+        return b;
+    if (b.phi <= 0)
+        return a;
+    LightBounds bounds;
+    BBox box_a = a.box, box_b = b.box;
+    bounds.box = BBoxUnion(box_a, box_b);
+    bounds.phi = a.phi + b.phi;
+    bounds.cosThetaE = Min(a.cosThetaE, b.cosThetaE);
+    bounds.twoSided = a.twoSided || b.twoSided;
+
+    // Two sided normals can be flipped toward the other cone
+    Vec3 axis_b = b.axis;
+    if (a.twoSided && b.twoSided && Dot(a.axis, axis_b) < 0)
+        axis_b = -axis_b;
+    Float theta_a = SafeAcos(a.cosThetaO), theta_b = SafeAcos(b.cosThetaO);
+    Float theta_d = AngleBetween(a.axis, axis_b);
+    if (Min(theta_d + theta_b, Pi) <= theta_a) {
+        bounds.axis = a.axis;
+        bounds.cosThetaO = a.cosThetaO;
+        return bounds;
+    }
+    if (Min(theta_d + theta_a, Pi) <= theta_b) {
+        bounds.axis = axis_b;
+        bounds.cosThetaO = b.cosThetaO;
+        return bounds;
+    }
+    // Cone spanning both, its axis rotated from a's toward b's
+    Float theta_o = (theta_a + theta_d + theta_b) / 2;
+    Vec3 k = Cross(a.axis, axis_b);
+    if (theta_o >= Pi || k.LengthSquared() == 0) {
+        bounds.axis = a.axis;
+        bounds.cosThetaO = -1;
+        return bounds;
+    }
+    k = Normalize(k);
+    Float theta_r = theta_o - theta_a;
+    bounds.axis = Normalize(a.axis * std::cos(theta_r) + Cross(k, a.axis) * std::sin(theta_r));
+    bounds.cosThetaO = std::cos(theta_o);
+    return bounds;
+}
+
+
+LightBounds SphereEmitterBounds(const Point &center, Float radius, const Color &radiance) {
+    LightBounds bounds;
+    bounds.box = BBox(center - Vec3(radius, radius, radius), center + Vec3(radius, radius, radius));
+    // Normals in every direction, each emitting over its hemisphere
+    bounds.cosThetaO = -1;
+    bounds.cosThetaE = 0;
+    bounds.phi = Luminance(radiance) * 4 * Pi * radius * radius * Pi;
+    return bounds;
+}
+
+bool SampleSphereDirection(const Point &center, Float radius, const Point &p, Float u, Float v,
+                           Vec3 &wi, Float &distance, Float &pdf) {
+    Vec3 to_center = center - p;
+    Float dc2 = to_center.LengthSquared();
+    if (dc2 <= radius * radius) {
+        // From the inside, every point of the sphere is visible
+        Point q = center + UniformSampleSphere<Float>(u, v) * radius;
+        wi = q - p;
+        distance = wi.Length();
+        if (distance <= 0)
+            return false;
+        wi /= distance;
+        pdf = SphereDirectionPdf(center, radius, p, q);
+        return pdf > 0;
+    }
+
+    // 1 - cos(theta_max) without the cancellation of far away spheres
+    Float sin2_max = radius * radius / dc2;
+    Float one_minus_cos_max = sin2_max / (1 + SafeSqrt(1 - sin2_max));
+    Float one_minus_cos = u * one_minus_cos_max;
+    Float cos_theta = 1 - one_minus_cos;
+    Float sin_theta = SafeSqrt(one_minus_cos * (2 - one_minus_cos));
+    Float phi = 2 * Pi * v;
+    Float dc = std::sqrt(dc2);
+    Vec3 w = to_center / dc, s, t;
+    CoordinateSystem(w, &s, &t);
+    wi = s * (sin_theta * std::cos(phi)) + t * (sin_theta * std::sin(phi)) + w * cos_theta;
+    // Nearest of the sphere hits along wi
+    distance = dc * cos_theta - SafeSqrt(radius * radius - dc2 * sin_theta * sin_theta);
+    pdf = 1 / (2 * Pi * one_minus_cos_max);
+    return true;
+}
+
+Float SphereDirectionPdf(const Point &center, Float radius, const Point &p, const Point &q) {
+    Float dc2 = DistanceSquared(p, center);
+    if (dc2 <= radius * radius) {
+        // Area density divided by the solid angle of an area unit
+        Vec3 d = q - p;
+        Float d2 = d.LengthSquared();
+        Float cos_q = std::abs(Dot(q - center, d)) / (radius * std::sqrt(d2));
+        if (!(cos_q > 0))
+            return 0;
+        return d2 / (cos_q * 4 * Pi * radius * radius);
+    }
+    Float sin2_max = radius * radius / dc2;
+    return (1 + SafeSqrt(1 - sin2_max)) / (2 * Pi * sin2_max);
+}
+
+LightBounds TriangleEmitterBounds(const Point &p0, const Point &p1, const Point &p2, const Color &radiance) {
+    LightBounds bounds;
+    Vec3 n = Cross(p1 - p0, p2 - p0);
+    Float area = n.Length() / 2;
+    if (!(area > 0))
+        return bounds;
+    Vec3 lo(Min(Min(p0.x, p1.x), p2.x), Min(Min(p0.y, p1.y), p2.y), Min(Min(p0.z, p1.z), p2.z));
+    Vec3 hi(Max(Max(p0.x, p1.x), p2.x), Max(Max(p0.y, p1.y), p2.y), Max(Max(p0.z, p1.z), p2.z));
+    bounds.box = BBox(lo, hi);
+    // A single normal, the material emits on both faces
+    bounds.axis = Normalize(n);
+    bounds.cosThetaO = 1;
+    bounds.cosThetaE = 0;
+    bounds.twoSided = true;
+    bounds.phi = Luminance(radiance) * 2 * area * Pi;
+    return bounds;
+}
+
+bool SampleTriangleDirection(const Point &p0, const Point &p1, const Point &p2, const Point &p,
+                             Float u, Float v, Vec3 &wi, Float &distance, Float &pdf) {
+    // Uniform barycentric coordinates
+    Float su = std::sqrt(u);
+    Float b0 = 1 - su, b1 = v * su;
+    Point q = p0 * b0 + p1 * b1 + p2 * (1 - b0 - b1);
+    wi = q - p;
+    distance = wi.Length();
+    if (distance <= 0)
+        return false;
+    wi /= distance;
+    pdf = TriangleDirectionPdf(p0, p1, p2, p, q);
+    return pdf > 0;
+}
+
+Float TriangleDirectionPdf(const Point &p0, const Point &p1, const Point &p2, const Point &p, const Point &q) {
+    Vec3 n = Cross(p1 - p0, p2 - p0);
+    Float twice_area = n.Length();
+    Vec3 d = q - p;
+    Float d2 = d.LengthSquared();
+    Float cos_q = std::abs(Dot(n, d)) / (twice_area * std::sqrt(d2));
+    if (!(cos_q > 0))
+        return 0;
+    return d2 / (cos_q * twice_area / 2);
+}
+
+
+LightBVH::LightBVH(const std::vector<const Primitive*> &primitives) {
+    std::vector<std::pair<int, LightBounds>> bounded;
+    for (const Primitive *primitive : primitives) {
+        Color radiance;
+        LightBounds bounds;
+        if (!primitive->Emission(radiance, bounds) || !(bounds.phi > 0))
+            continue;
+        bounded.emplace_back(_emitters.size(), bounds);
+        _emitters.push_back({ primitive, radiance });
+    }
+    if (bounded.empty())
+        return;
+    _nodes.reserve(2 * bounded.size() - 1);
+    _trails.reserve(bounded.size());
+    _Build(bounded, 0, bounded.size(), 0, 0);
+}
+
+// Orientation & size term of the SAOH, for splits along axis
+static Float SplitCost(const LightBounds &b, const BBox &bounds, int axis) {
+    Float theta_o = SafeAcos(b.cosThetaO), theta_e = SafeAcos(b.cosThetaE);
+    Float theta_w = Min(theta_o + theta_e, Pi);
+    Float sin_o = SafeSqrt(1 - b.cosThetaO * b.cosThetaO);
+    // Solid angle measure of the cone, weighted by the emission falloff
+    Float m_omega = 2 * Pi * (1 - b.cosThetaO) +
+                    Pi / 2 * (2 * theta_w * sin_o - std::cos(theta_o - 2 * theta_w) -
+                              2 * theta_o * sin_o + b.cosThetaO);
+    // Thin slices across the longest axis are penalized
+    Vec3 d = bounds.Max() - bounds.Min();
+    Float kr = MaxComponent(d) / d[axis];
+    return b.phi * m_omega * kr * b.box.Area();
+}
+
+int LightBVH::_Build(std::vector<std::pair<int, LightBounds>> &emitters, int begin, int end,
+                     uint64_t trail, int depth) {
+    int node = _nodes.size();
+    if (end - begin == 1) {
+        int emitter = emitters[begin].first;
+        _nodes.push_back({ emitters[begin].second, emitter, true });
+        _trails[_emitters[emitter].primitive] = trail;
+        return node;
+    }
+
+    LightBounds bounds;
+    Point lo(Infinity, Infinity, Infinity), hi(-Infinity, -Infinity, -Infinity);
+    for (int i = begin; i < end; i++) {
+        bounds = Union(bounds, emitters[i].second);
+        Point c = Center(emitters[i].second.box);
+        lo = Point(Min(lo.x, c.x), Min(lo.y, c.y), Min(lo.z, c.z));
+        hi = Point(Max(hi.x, c.x), Max(hi.y, c.y), Max(hi.z, c.z));
+    }
+
+    // Cheapest split between buckets of the centers along an axis
+    const int Buckets = 12;
+    auto bucket = [&](const LightBounds &b, int axis) {
+        int i = (int)(Buckets * (Center(b.box)[axis] - lo[axis]) / (hi[axis] - lo[axis]));
+        return Clamp(i, 0, Buckets - 1);
+    };
+    Float best_cost = Infinity;
+    int best_axis = -1, best_bucket = -1;
+    for (int axis = 0; axis < 3 && depth < MaxDepth / 2; axis++) {
+        if (hi[axis] == lo[axis])
+            continue;
+        LightBounds buckets[Buckets];
+        for (int i = begin; i < end; i++) {
+            int b = bucket(emitters[i].second, axis);
+            buckets[b] = Union(buckets[b], emitters[i].second);
+        }
+        for (int split = 0; split < Buckets - 1; split++) {
+            LightBounds below, above;
+            for (int b = 0; b <= split; b++)
+                below = Union(below, buckets[b]);
+            for (int b = split + 1; b < Buckets; b++)
+                above = Union(above, buckets[b]);
+            if (below.phi <= 0 || above.phi <= 0)
+                continue;
+            Float cost = SplitCost(below, bounds.box, axis) + SplitCost(above, bounds.box, axis);
+            if (cost > 0 && cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bucket = split;
+            }
+        }
+    }
+
+    int mid = begin;
+    if (best_axis >= 0) {
+        mid = std::partition(emitters.begin() + begin, emitters.begin() + end,
+                             [&](const auto &e) { return bucket(e.second, best_axis) <= best_bucket; })
+              - emitters.begin();
+    }
+    // Halves along the widest axis of the centers otherwise, which
+    // also bounds the depth once it gets close to MaxDepth
+    if (mid == begin || mid == end) {
+        Vec3 extent = hi - lo;
+        int axis = MaxDimension(extent);
+        mid = (begin + end) / 2;
+        std::nth_element(emitters.begin() + begin, emitters.begin() + mid, emitters.begin() + end,
+                         [&](const auto &a, const auto &b) {
+                             return Center(a.second.box)[axis] < Center(b.second.box)[axis];
+                         });
+    }
+
+    _nodes.push_back({ bounds, 0, false });
+    _Build(emitters, begin, mid, trail, depth + 1);
+    int second = _Build(emitters, mid, end, trail | (uint64_t(1) << depth), depth + 1);
+    _nodes[node].index = second;
+    return node;
+}
+
+const LightBVH::Emitter *LightBVH::Sample(const Point &p, const Normal &n, Float u, Float &pmf) const {
+    pmf = 0;
+    if (_nodes.empty())
+        return nullptr;
+    Normal nn = Normalize(n);
+    if (_nodes[0].leaf) {
+        if (_nodes[0].bounds.Importance(p, nn) <= 0)
+            return nullptr;
+        pmf = 1;
+        return &_emitters[_nodes[0].index];
+    }
+
+    // Down the children by their importance, reusing the remainder of u
+    Float probability = 1;
+    int index = 0;
+    while (!_nodes[index].leaf) {
+        int first = index + 1, second = _nodes[index].index;
+        Float i0 = _nodes[first].bounds.Importance(p, nn);
+        Float i1 = _nodes[second].bounds.Importance(p, nn);
+        if (i0 <= 0 && i1 <= 0)
+            return nullptr;
+        Float p0 = i0 / (i0 + i1);
+        if (u < p0) {
+            u = Min(u / p0, (Float)0.99999994);
+            probability *= p0;
+            index = first;
+        }
+        else {
+            u = Min((u - p0) / (1 - p0), (Float)0.99999994);
+            probability *= 1 - p0;
+            index = second;
+        }
+    }
+    pmf = probability;
+    return &_emitters[_nodes[index].index];
+}
+
+Float LightBVH::Pmf(const Point &p, const Normal &n, const Primitive *primitive) const {
+    auto found = _trails.find(primitive);
+    if (found == _trails.end())
+        return 0;
+    Normal nn = Normalize(n);
+    if (_nodes[0].leaf)
+        return _nodes[0].bounds.Importance(p, nn) > 0 ? 1 : 0;
+
+    // Same choices as Sample, along the trail of the emitter
+    uint64_t trail = found->second;
+    Float pmf = 1;
+    int index = 0;
+    for (int depth = 0; !_nodes[index].leaf; depth++) {
+        int first = index + 1, second = _nodes[index].index;
+        Float i0 = _nodes[first].bounds.Importance(p, nn);
+        Float i1 = _nodes[second].bounds.Importance(p, nn);
+        if (i0 <= 0 && i1 <= 0)
+            return 0;
+        Float p0 = i0 / (i0 + i1);
+        if ((trail >> depth) & 1) {
+            pmf *= 1 - p0;
+            index = second;
+        }
+        else {
+            pmf *= p0;
+            index = first;
+        }
+    }
+    return pmf;
+}
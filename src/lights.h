@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "nray.h"
+#include "geometry.h"
+#include "bbox.h"
+
+// Bounds of the light emitted by one or more emitters (Conty & Kulla 2018)
+// Their surfaces are in box with normals within theta_o of axis, and
+// emit up to theta_e away from their normals
+struct LightBounds {
+    BBox box;
+    Vec3 axis{0, 0, 1};
+    Float cosThetaO{1};
+    Float cosThetaE{0};
+    // Emitted power (luminance), 0 for empty bounds
+    Float phi{0};
+    // Emits on both sides of the normals
+    bool twoSided{false};
+
+    // Upper bound of the light reaching p, a surface facing n,
+    // up to a constant: only the ratios between bounds mean something
+    Float Importance(const Point &p, const Normal &n) const;
+};
+
+// Bounds of both emitters, the cones are merged into one around them
+LightBounds Union(const LightBounds &a, const LightBounds &b);
+
+// Emitters sampling, shared by the primitives
+// Directions are sampled from p toward the emitter with their density in
+// solid angle & the distance to the emitter along them
+
+// Bounds of a sphere emitting radiance
+LightBounds SphereEmitterBounds(const Point &center, Float radius, const Color &radiance);
+// Uniform in the cone the sphere subtends from p, or over its area if p is inside
+bool SampleSphereDirection(const Point &center, Float radius, const Point &p, Float u, Float v,
+                           Vec3 &wi, Float &distance, Float &pdf);
+// Density of the direction from p to q, a point of the sphere
+Float SphereDirectionPdf(const Point &center, Float radius, const Point &p, const Point &q);
+
+// Bounds of a (two sided) triangle emitting radiance
+LightBounds TriangleEmitterBounds(const Point &p0, const Point &p1, const Point &p2, const Color &radiance);
+// Uniform over the triangle area
+bool SampleTriangleDirection(const Point &p0, const Point &p1, const Point &p2, const Point &p,
+                             Float u, Float v, Vec3 &wi, Float &distance, Float &pdf);
+// Density of the direction from p to q, a point of the triangle
+Float TriangleDirectionPdf(const Point &p0, const Point &p1, const Point &p2, const Point &p, const Point &q);
+
+
+// Light BVH
+// Picks one of the emitters of the scene for a shading point, with a
+// probability following an estimate of the light it receives from it
+// Nodes bound the power, position & orientation of their emitters, the
+// traversal goes down one child per level by their importance, so picking
+// a light (or its probability) costs O(log n) whatever the lights count
+// The tree is built with the SAOH of Conty & Kulla 2018, as in pbrt-v4
+class LightBVH {
+    public:
+        struct Emitter {
+            const Primitive *primitive;
+            Color radiance;
+        };
+
+        // Keeps the primitives that emit light & can be sampled
+        LightBVH(const std::vector<const Primitive*> &primitives);
+
+        // Picks the emitter lighting p, a surface facing n, from u & the
+        // probability it had. Returns nullptr if none of them can light it
+        const Emitter *Sample(const Point &p, const Normal &n, Float u, Float &pmf) const;
+        // Probability Sample picks primitive from p (0 if it isn't an emitter)
+        Float Pmf(const Point &p, const Normal &n, const Primitive *primitive) const;
+
+        int Size() const { return (int)_emitters.size(); }
+
+        // The trails of the emitters keep a bit per level
+        static constexpr int MaxDepth = 64;
+
+    private:
+        struct Node {
+            LightBounds bounds;
+            // Emitter of the leaves, second child of the inner nodes
+            // (the first one follows its parent)
+            int index;
+            bool leaf;
+        };
+
+        // Builds the subtree of the emitters [begin, end) & returns its node,
+        // trail is the path to it (the bits of the children taken, root first)
+        int _Build(std::vector<std::pair<int, LightBounds>> &emitters, int begin, int end,
+                   uint64_t trail, int depth);
+
+        std::vector<Node> _nodes;
+        std::vector<Emitter> _emitters;
+        // Path from the root to the leaf of each emitter
+        std::unordered_map<const Primitive*, uint64_t> _trails;
+};
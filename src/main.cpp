@@ -1,12 +1,17 @@
 #include <string.h>
+#include <fstream>
+#include <sstream>
 #include "nray.h"
 
 #include "rand.h"
 #include "image.h"
 #include "scene.h"
+#include "implicit.h"
 #include "timer.h"
+#include "benchmark.h"
 
 #include "parser.h"
+#include "server.h"
 
 
 // Initialize Random Number Generator
@@ -16,6 +21,15 @@
 std::uniform_real_distribution<Float> Rng::distribution01 = std::uniform_real_distribution<Float>(0,1);
 std::mt19937 Rng::generator = std::mt19937(0);
 
+// Path of the image of a view: out.png -> out_cam2.png
+static string ViewPath(string const &path, int view) {
+    auto ext = path.rfind('.');
+    auto dir = path.find_last_of("/\\");
+    if (ext == string::npos || (dir != string::npos && ext < dir))
+        ext = path.size();
+    return path.substr(0, ext) + "_cam" + std::to_string(view) + path.substr(ext);
+}
+
 void PrintUsage() {
     std::cout << "\nUsage:\n";
 
@@ -25,6 +39,14 @@ void PrintUsage() {
     std::cout << "\n nray --testScene\n";
     std::cout << "\tRenders the test scene\n";
 
+    std::cout << "\n nray --serve [-j max_threads] [-serve_cache scenes] [-serve_jobs jobs]\n";
+    std::cout << "\tRenders the jobs read on stdin (JSON lines, see server.h), answering each on stdout\n";
+    std::cout << "\tUp to serve_jobs jobs (defaults to 2) render at once on the same threads, the last\n";
+    std::cout << "\tserve_cache scenes loaded (defaults to 4) are kept until one of their files changes\n";
+
+    std::cout << "\n nray --benchmark\n";
+    std::cout << "\tRuns the micro benchmarks\n";
+
     std::cout << "\nOptions: \n";
 
     std::cout << "\n -o /path/to/output/image.png\n";
@@ -39,6 +61,9 @@ void PrintUsage() {
     std::cout << "\n -s number_of_pixel_samples\n";
     std::cout << "\tSets the pixel samples\n";
 
+    std::cout << "\n -sampler independent|stratified|sobol|bluenoise\n";
+    std::cout << "\tSets the sampler used for pixel, lens & bounce samples (defaults to sobol)\n";
+
     std::cout << "\n -depth_refl ray_depth\n";
     std::cout << "\tSets the maximum depth/bounces for Reflection Rays, defaults to 5\n";
 
@@ -48,12 +73,50 @@ void PrintUsage() {
     std::cout << "\n -depth_diff ray_depth\n";
     std::cout << "\tSets the maximum depth/bounces for Diffuse Rays, defaults to 2\n";  
 
+    std::cout << "\n -rr_depth ray_depth\n";
+    std::cout << "\tEnables Russian roulette path termination from this depth on (disabled by default)\n";
+
+    std::cout << "\n -sdf_cache resolution\n";
+    std::cout << "\tCaches the implicit graphs in sparse SDF bricks of this resolution (disabled by default)\n";
+
+    std::cout << "\n -sdf_cache_mb size\n";
+    std::cout << "\tMemory budget of each SDF cache in MB (defaults to 256)\n";
+
+    std::cout << "\n --frames first last\n";
+    std::cout << "\tRenders a sequence, # in the obj paths & in the output path are replaced by the frame number\n";
+    std::cout << "\tThe BVH is refitted when the meshes topology doesn't change\n";
+
+    std::cout << "\n -orbit degrees\n";
+    std::cout << "\tRotates the camera around its focus point by this angle every frame\n";
+
+    std::cout << "\n -cameras /path/to/cameras.txt\n";
+    std::cout << "\tRenders a view per line of the file (in the <Camera> format) instead of the scene's cameras\n";
+    std::cout << "\tScenes with several cameras write image_cam0.png, image_cam1.png...\n";
+
     std::cout << "\n -t tile_size\n";
     std::cout << "\tSets the tile size (defaults to 16)\n";
 
+    std::cout << "\n --crop x0 y0 x1 y1\n";
+    std::cout << "\tOnly renders the pixels from (x0, y0) to (x1, y1) excluded, the others are kept from the existing output\n";
+
+    std::cout << "\n -mask /path/to/mask.png\n";
+    std::cout << "\tOnly renders the pixels where the mask (of the image size) isn't black, the others are kept from the existing output\n";
+
+    std::cout << "\n --preview\n";
+    std::cout << "\tWrites 1 sample previews at 1/8, 1/4 & 1/2 of the resolution to the output before the render\n";
+
+    std::cout << "\n --stream\n";
+    std::cout << "\tWrites the png by rows of tiles as they are rendered, for images too large to be kept in memory\n";
+
     std::cout << "\n -j max_threads\n";
     std::cout << "\tLimits the max number of threads\n";
 
+    std::cout << "\n --denoise\n";
+    std::cout << "\tFilters the noise of the image after rendering, guided by its albedo, normals & depth\n";
+
+    std::cout << "\n -aov albedo,normal,depth,primid,samples,variance|all\n";
+    std::cout << "\tAlso writes these buffers of the first hits, as image_albedo.pfm... next to the image\n";
+
     std::cout << "\n -color_limit max_value\n";
     std::cout << "\tClamps the maximum color value. Can help reduce fireflies with very bright lights (defaults to 10)\n";
 
@@ -62,6 +125,15 @@ void PrintUsage() {
 
     std::cout << "\n --normalOnly\n";
     std::cout << "\tRender the Scene's normal only. No Lighting/material computation\n";
+
+    std::cout << "\n --ao\n";
+    std::cout << "\tRender the Scene's ambient occlusion only, using any hit shadow rays\n";
+
+    std::cout << "\n -ao_samples number_of_rays\n";
+    std::cout << "\tSets the ambient occlusion rays per pixel sample (defaults to 4)\n";
+
+    std::cout << "\n -ao_distance distance\n";
+    std::cout << "\tSets the maximum distance of the ambient occlusion rays (defaults to 1)\n";
 }
 
 
@@ -78,10 +150,52 @@ int main(int argc, char *argv[]) {
     
     // Parse arguments before scene generation
     bool test_scene = false;
+    bool sequence = false;
+    int first_frame = 0, last_frame = 0;
+    Float orbit = 0;
+    string camera_file;
+    // The meshes created while loading use -j too
+    int max_threads = -1;
     for (int i=1; i < argc; i++) {
         if (strcmp(argv[i], "--testScene") == 0) {
             test_scene = true;
         }
+        else if (strcmp(argv[i], "-j") == 0) {
+            max_threads = std::stoi(argv[i+1]);
+        }
+        else if (strcmp(argv[i], "--frames") == 0) {
+            sequence = true;
+            first_frame = std::stoi(argv[i+1]);
+            last_frame = std::stoi(argv[i+2]);
+        }
+        else if (strcmp(argv[i], "-orbit") == 0) {
+            orbit = std::stof(argv[i+1]);
+        }
+        else if (strcmp(argv[i], "-cameras") == 0) {
+            camera_file = argv[i+1];
+        }
+        else if (strcmp(argv[i], "--serve") == 0) {
+            int threads = ThreadCount(), cache_size = 4, jobs = 2;
+            for (int j = 1; j + 1 < argc; j++) {
+                if (strcmp(argv[j], "-j") == 0)
+                    threads = std::stoi(argv[j+1]);
+                else if (strcmp(argv[j], "-serve_cache") == 0)
+                    cache_size = std::stoi(argv[j+1]);
+                else if (strcmp(argv[j], "-serve_jobs") == 0)
+                    jobs = std::stoi(argv[j+1]);
+            }
+            // Answers go to stdout, the render logs to stderr
+            std::ostream answers(std::cout.rdbuf());
+            std::cout.rdbuf(std::cerr.rdbuf());
+            RenderServer server(threads, cache_size, jobs);
+            server.Run(std::cin, answers);
+            std::cout.rdbuf(answers.rdbuf());
+            return 0;
+        }
+        else if (strcmp(argv[i], "--benchmark") == 0) {
+            RunBenchmarks();
+            return 0;
+        }
         else if ( strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0 ) {
             PrintUsage();
             return 0;
@@ -108,7 +222,7 @@ int main(int argc, char *argv[]) {
     }
     else {
         std::cout << "\nRendering " << argv[1] << "\n";
-        scene = LoadSceneFile(argv[1]);
+        scene = LoadSceneFile(argv[1], first_frame, max_threads);
     }
 
     // Parse the arguments again for scene settings override
@@ -126,6 +240,13 @@ int main(int argc, char *argv[]) {
         else if (strcmp(argv[i], "-s") == 0) {
             opt.pixel_samples = std::stoi(argv[i+1]);
         }
+        else if (strcmp(argv[i], "-sampler") == 0) {
+            opt.sampler = ToSamplerType(argv[i+1]);
+            if (opt.sampler == SamplerType::Unknown) {
+                std::cerr << "Unknown sampler: " << argv[i+1] << "\n";
+                return -1;
+            }
+        }
         else if (strcmp(argv[i], "-depth_refl") == 0) {
             opt.max_reflect_rdepth = std::stoi(argv[i+1]);
         }
@@ -135,12 +256,59 @@ int main(int argc, char *argv[]) {
         else if (strcmp(argv[i], "-depth_diff") == 0) {
             opt.max_diffuse_rdepth = std::stoi(argv[i+1]);
         }
+        else if (strcmp(argv[i], "-rr_depth") == 0) {
+            opt.rr_min_depth = std::stoi(argv[i+1]);
+        }
+        else if (strcmp(argv[i], "-sdf_cache") == 0) {
+            opt.sdf_cache_resolution = std::stoi(argv[i+1]);
+        }
+        else if (strcmp(argv[i], "-sdf_cache_mb") == 0) {
+            opt.sdf_cache_mb = std::stoi(argv[i+1]);
+        }
         else if (strcmp(argv[i], "-t") == 0) {
             opt.tile_size = std::stoi(argv[i+1]);
         }
         else if (strcmp(argv[i], "-j") == 0) {
             opt.max_threads = std::stoi(argv[i+1]);
         }
+        else if (strcmp(argv[i], "--crop") == 0) {
+            opt.crop_x0 = std::stoi(argv[i+1]);
+            opt.crop_y0 = std::stoi(argv[i+2]);
+            opt.crop_x1 = std::stoi(argv[i+3]);
+            opt.crop_y1 = std::stoi(argv[i+4]);
+            if (opt.crop_x1 <= opt.crop_x0 || opt.crop_y1 <= opt.crop_y0) {
+                std::cerr << "The crop should go from its top left to its bottom right corner\n";
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-mask") == 0) {
+            opt.render_mask = argv[i+1];
+        }
+        else if (strcmp(argv[i], "--preview") == 0) {
+            opt.preview = true;
+        }
+        else if (strcmp(argv[i], "--stream") == 0) {
+            opt.stream = true;
+        }
+        else if (strcmp(argv[i], "--denoise") == 0) {
+            opt.denoise = true;
+        }
+        else if (strcmp(argv[i], "-aov") == 0) {
+            std::stringstream names(argv[i+1]);
+            string name;
+            while (std::getline(names, name, ',')) {
+                if (name == "all") {
+                    opt.aovs = (1u << AovCount) - 1;
+                    continue;
+                }
+                Aov aov = ToAov(name);
+                if (aov == Aov::Count) {
+                    std::cerr << "Unknown AOV: " << name << "\n";
+                    return -1;
+                }
+                opt.aovs |= 1u << static_cast<int>(aov);
+            }
+        }
         else if (strcmp(argv[i], "-color_limit") == 0) {
             opt.color_limit = std::stoi(argv[i+1]);
         }
@@ -150,28 +318,130 @@ int main(int argc, char *argv[]) {
         else if (strcmp(argv[i], "--normalOnly") == 0) {
             opt.normalOnly = true;
         }
+        else if (strcmp(argv[i], "--ao") == 0) {
+            opt.aoOnly = true;
+        }
+        else if (strcmp(argv[i], "-ao_samples") == 0) {
+            // At least one ray, the occlusion is averaged over them
+            opt.ao_samples = Max(std::stoi(argv[i+1]), 1);
+        }
+        else if (strcmp(argv[i], "-ao_distance") == 0) {
+            opt.ao_distance = std::stof(argv[i+1]);
+        }
     }
 
     scene.Settings(opt);
     scene.PrintSettings();
+    scene.BuildImplicitCaches();
     timer.Stop();
     std::cout << "\nScene generated in: ";
     timer.Print();
     std::cout << "\n";
 
-    // Create image buffer
-    Image img;
+    // Sequences write one image per frame, # is replaced by the frame number
+    string image_out = opt.image_out;
+    if (sequence && image_out.find('#') == string::npos) {
+        auto ext = image_out.rfind('.');
+        image_out.insert(ext == string::npos ? image_out.size() : ext, "_####");
+    }
 
-    // Render the scene to the image
-    timer.Start();
-    img = scene.Render();
-    timer.Stop();
-    std::cout << "\nScene rendered in: ";
-    timer.Print();
+    // Every camera of the scene (or of the camera file) is rendered,
+    // each view to its own image
+    auto load_cameras = [&]() {
+        std::vector<Camera> cameras = scene.cameras;
+        if (!camera_file.empty()) {
+            cameras.clear();
+            for (const CameraSettings &settings : LoadCameraFile(camera_file.c_str()))
+                cameras.emplace_back(settings, opt.image_aspect_ratio);
+        }
+        if (cameras.empty())
+            cameras.push_back(scene.GetCamera());
+        return cameras;
+    };
+    std::vector<Camera> cameras = load_cameras();
+    const bool views = cameras.size() > 1;
+    if (views)
+        std::cout << "\nRendering " << cameras.size() << " views\n";
+
+    for (int frame = first_frame; frame <= last_frame; frame++) {
+        if (frame != first_frame) {
+            // Update the animated meshes, refitting the BVH
+            // unless their topology changed
+            timer.Start();
+            bool refit = test_scene || scene.LoadFrame(frame);
+            if (!refit) {
+                scene = LoadSceneFile(argv[1], frame, max_threads);
+                scene.Settings(opt);
+                scene.BuildImplicitCaches();
+                cameras = load_cameras();
+            }
+            timer.Stop();
+            std::cout << "\nFrame " << frame << (refit ? " updated in: " : " reloaded in: ");
+            timer.Print();
+            std::cout << "\n";
+        }
+        std::vector<Camera> frame_cameras = cameras;
+        for (Camera &camera : frame_cameras)
+            camera.Orbit(orbit * (frame - first_frame));
+        scene.GetCamera() = frame_cameras[0];
+
+        // Create image buffers
+        std::vector<Image> images;
+        string path = sequence ? FramePath(image_out, frame) : image_out;
+        std::vector<string> paths;
+        for (size_t v = 0; v < frame_cameras.size(); v++)
+            paths.push_back(views ? ViewPath(path, v) : path);
+
+        // Crops & masks are composited over the images already written
+        const bool region = opt.crop_x1 > opt.crop_x0 || opt.render_mask;
+        std::vector<Image> bases(paths.size());
+        for (size_t v = 0; region && !opt.stream && v < paths.size(); v++) {
+            std::ifstream exists(paths[v]);
+            if (exists)
+                bases[v].LoadFromFile(paths[v].c_str(), true);
+        }
 
-    // Write the image to disk
-    img.WriteToFile(scene.Settings().image_out);
+        // Quick previews to check the framing, each one written
+        // over the image until the render is done
+        if (opt.preview && opt.stream)
+            std::cerr << "Ignoring --preview with --stream\n";
+        for (int scale = 8; opt.preview && !opt.stream && scale > 1; scale /= 2) {
+            timer.Start();
+            std::vector<Image> previews = scene.RenderPreviews(frame_cameras, scale);
+            timer.Stop();
+            std::cout << "\nPreview 1/" << scale << " rendered in: ";
+            timer.Print();
+            for (size_t v = 0; v < paths.size(); v++)
+                previews[v].WriteToFile(paths[v].c_str());
+        }
 
-    std::cerr << "\nRendered image to " << scene.Settings().image_out << "\n";
+        // Render the scene to the images, or straight to the disk
+        // one view after the other
+        timer.Start();
+        if (opt.stream) {
+            for (size_t v = 0; v < frame_cameras.size(); v++) {
+                scene.GetCamera() = frame_cameras[v];
+                scene.RenderToFile(paths[v].c_str());
+            }
+        }
+        else {
+            images = scene.RenderViews(frame_cameras);
+        }
+        timer.Stop();
+        std::cout << "\n" << (sequence ? "Frame " + std::to_string(frame) : string("Scene")) << " rendered in: ";
+        timer.Print();
+
+        // Write the images to disk
+        for (size_t v = 0; v < paths.size(); v++) {
+            if (!opt.stream) {
+                scene.Composite(images[v], bases[v]);
+                images[v].WriteToFile(paths[v].c_str());
+                scene.WriteAovs(paths[v], v);
+            }
+            std::cerr << "\nRendered image to " << paths[v] << "\n";
+        }
+    }
+    ImplicitPrimitive::stats.Print();
+    BVH::stats.Print();
     return 0;
 }
\ No newline at end of file
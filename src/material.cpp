@@ -10,16 +10,27 @@ Float Schlick(Float cosine, Float ref_idx) {
 }
 
 
-bool LambertianMaterial::Scatter( const Ray& r_in, const Intersection& rec, Color& attenuation, Ray& scattered ) const  {
-    Vec3 scatter_direction = rec.normal + RandomUnitVector<Float>();
-    scattered = Ray(rec.p, scatter_direction, RayType::Diffuse);
+bool LambertianMaterial::Scatter( const Ray& r_in, const Intersection& rec, Color& attenuation, Ray& scattered, Sampler &sampler ) const  {
+    Float su, sv;
+    sampler.Get2D(su, sv);
+    // Offsetting the normal by a unit vector gives a cosine weighted direction
+    Vec3 scatter_direction = rec.normal + UniformSampleSphere<Float>(su, sv);
+    scattered = Ray(rec.p, scatter_direction, RayType::Diffuse, r_in.Time());
     attenuation = _albedo;
     // attenuation = Vec3(1, 0, 1);
     return true;
 }
 
+Color LambertianMaterial::Eval(const Intersection& rec, const Vec3& wi, Float &pdf) const {
+    // Scatter samples the cosine weighted hemisphere, albedo/pi * cos / pdf = albedo
+    Float cos_theta = Dot(rec.normal, Normalize(wi));
+    pdf = Max(cos_theta, (Float)0) * InvPi;
+    return _albedo * pdf;
+}
+
 
-bool DielectricMaterial::Scatter( const Ray& r_in, const Intersection& rec, Color& attenuation, Ray& scattered) const {
+bool DielectricMaterial::Scatter( const Ray& r_in, const Intersection& rec, Color& attenuation, Ray& scattered, Sampler &sampler) const {
+    Float choice = sampler.Get1D();
     attenuation = _albedo;
     Float etai_over_etat = (rec.front_face) ? (1.0 / _ref_idx) : (_ref_idx);
 
@@ -28,27 +39,30 @@ bool DielectricMaterial::Scatter( const Ray& r_in, const Intersection& rec, Colo
     Float sin_theta = sqrt(1.0 - cos_theta*cos_theta);
     if (etai_over_etat * sin_theta > 1.0 ) {
         Vec3 reflected = Reflect(unit_direction, rec.normal);
-        scattered = Ray(rec.p, reflected, RayType::Reflect);
+        scattered = Ray(rec.p, reflected, RayType::Reflect, r_in.Time());
         return true;
     }
 
     Float reflect_prob = Schlick(cos_theta, etai_over_etat);
-    if (Rng::Rand01() < reflect_prob)
+    if (choice < reflect_prob)
     {
         Vec3 reflected = Reflect(unit_direction, rec.normal);
-        scattered = Ray(rec.p, reflected, RayType::Reflect);
+        scattered = Ray(rec.p, reflected, RayType::Reflect, r_in.Time());
         return true;
     }
 
     Vec3 refracted = Refract(unit_direction, rec.normal, etai_over_etat);
-    scattered = Ray(rec.p, refracted, RayType::Refract);
+    scattered = Ray(rec.p, refracted, RayType::Refract, r_in.Time());
     return true;
 }
 
 
-bool MetalMaterial::Scatter( const Ray& r_in, const Intersection& rec, Color& attenuation, Ray& scattered ) const  {
+bool MetalMaterial::Scatter( const Ray& r_in, const Intersection& rec, Color& attenuation, Ray& scattered, Sampler &sampler ) const  {
+    Float su, sv;
+    sampler.Get2D(su, sv);
+    Float sw = sampler.Get1D();
     Vec3 reflected = Reflect(Normalize(r_in.Direction()), rec.normal);
-    scattered = Ray(rec.p, reflected + _fuzz*RandomVectorInUnitSphere<Float>(), RayType::Reflect);
+    scattered = Ray(rec.p, reflected + _fuzz*UniformSampleBall<Float>(su, sv, sw), RayType::Reflect, r_in.Time());
     attenuation = _albedo;
     return (Dot(scattered.Direction(), rec.normal) > 0);
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include "nray.h"
 #include "geometry.h"
+#include "sampler.h"
 
 // Fresnel like function to compute a mask
 // between reflections and refractions for
@@ -14,13 +15,34 @@ Float Schlick(Float cosine, Float ref_idx);
 // They return a color and scatter another ray
 class Material  {
     public:
+        // The sampler provides the random numbers
+        // for the current dimensions of the path
         virtual bool Scatter(
-            const Ray& r_in, const Intersection& rec, Color& attenuation, Ray& scattered
+            const Ray& r_in, const Intersection& rec, Color& attenuation, Ray& scattered, Sampler &sampler
         ) const = 0;
 
         virtual Color Emitted() const {
             return Color(0,0,0);
         }
+
+        // BSDF times the cosine toward wi & the density Scatter samples wi with
+        // Only non specular materials return a density (> 0), the other
+        // ones can't be lit by sampling the lights
+        virtual Color Eval(const Intersection& rec, const Vec3& wi, Float &pdf) const {
+            pdf = 0;
+            return Color(0,0,0);
+        }
+
+        // Surface color, written to the albedo AOV
+        virtual Color Albedo() const {
+            return Color(0,0,0);
+        }
+
+        // Angular width (in radians) of the scattered rays lobe,
+        // environment lookups are filtered over a part of it
+        virtual Float Spread() const {
+            return 0;
+        }
 };
 
 
@@ -30,9 +52,13 @@ class LambertianMaterial : public Material {
         LambertianMaterial(const Color& albedo) : _albedo(albedo) {}
 
         virtual bool Scatter(
-            const Ray& r_in, const Intersection& rec, Vec3& attenuation, Ray& scattered
+            const Ray& r_in, const Intersection& rec, Vec3& attenuation, Ray& scattered, Sampler &sampler
         ) const;
 
+        virtual Color Eval(const Intersection& rec, const Vec3& wi, Float &pdf) const;
+
+        virtual Color Albedo() const { return _albedo; }
+
     private:
         Color _albedo;
 };
@@ -44,9 +70,11 @@ class DielectricMaterial : public Material {
         DielectricMaterial(Color albedo, Float refractive_index) : _ref_idx(refractive_index), _albedo(albedo) {}
 
         virtual bool Scatter(
-            const Ray& r_in, const Intersection& rec, Color& attenuation, Ray& scattered
+            const Ray& r_in, const Intersection& rec, Color& attenuation, Ray& scattered, Sampler &sampler
         ) const;
 
+        virtual Color Albedo() const { return _albedo; }
+
     private:
         Color _albedo;
         Float _ref_idx{1};
@@ -58,9 +86,16 @@ class MetalMaterial : public Material {
         MetalMaterial(const Color& albedo, Float fuzziness) : _albedo(albedo), _fuzz(fuzziness < 1 ? fuzziness : 1) {}
 
         virtual bool Scatter(
-            const Ray& r_in, const Intersection& rec, Color& attenuation, Ray& scattered
+            const Ray& r_in, const Intersection& rec, Color& attenuation, Ray& scattered, Sampler &sampler
         ) const;
 
+        // The fuzz ball offsets the unit reflected direction by up to fuzz
+        virtual Float Spread() const {
+            return _fuzz;
+        }
+
+        virtual Color Albedo() const { return _albedo; }
+
     private:
         Color _albedo;
         Float _fuzz{0};
@@ -72,7 +107,7 @@ class EmissiveMaterial : public Material {
         EmissiveMaterial(const Color& albedo) : _albedo(albedo) {}
 
         virtual bool Scatter(
-            const Ray& r_in, const Intersection& rec, Color& attenuation, Ray& scattered
+            const Ray& r_in, const Intersection& rec, Color& attenuation, Ray& scattered, Sampler &sampler
         ) const {
             return false;
         }
@@ -80,6 +115,8 @@ class EmissiveMaterial : public Material {
         virtual Color Emitted() const {
             return _albedo;
         }
+
+        virtual Color Albedo() const { return _albedo; }
     private:
         Color _albedo;
 
@@ -0,0 +1,97 @@
+#include "motion.h"
+
+
+// MovingSphere implementation
+bool MovingSphere::Intersect(const Ray& r, Float t_min, Float t_max, Intersection& rec) const {
+    Point center = Center(r.Time());
+    Vec3 oc = r.Origin() - center;
+    Float a = r.Direction().LengthSquared();
+    Float half_b = Dot(oc, r.Direction());
+    Float c = oc.LengthSquared() - radius*radius;
+    Float discriminant = half_b*half_b - a*c;
+    if (discriminant <= 0)
+        return false;
+
+    Float root = sqrt(discriminant);
+    Float t = (-half_b - root) / a;
+    if (t >= t_max || t <= t_min) {
+        t = (-half_b + root) / a;
+        if (t >= t_max || t <= t_min)
+            return false;
+    }
+
+    rec.t = t;
+    rec.p = r(rec.t);
+    Vec3 outward_normal = (rec.p - center) / radius;
+    rec.SetFaceNormal(r, outward_normal);
+    rec.material = material;
+    return true;
+}
+
+bool MovingSphere::Occluded(const Ray& r, Float t_min, Float t_max) const {
+    Vec3 oc = r.Origin() - Center(r.Time());
+    Float a = r.Direction().LengthSquared();
+    Float half_b = Dot(oc, r.Direction());
+    Float c = oc.LengthSquared() - radius*radius;
+    Float discriminant = half_b*half_b - a*c;
+    if (discriminant <= 0)
+        return false;
+
+    Float root = sqrt(discriminant);
+    Float t0 = (-half_b - root) / a;
+    Float t1 = (-half_b + root) / a;
+    return (t0 < t_max && t0 > t_min) || (t1 < t_max && t1 > t_min);
+}
+
+bool MovingSphere::BoundingBox(Float t0, Float t1, BBox& output_box) const {
+    Vec3 r(radius, radius, radius);
+    BBox box0(Center(t0) - r, Center(t0) + r);
+    BBox box1(Center(t1) - r, Center(t1) + r);
+    output_box = BBoxUnion(box0, box1);
+    return true;
+}
+
+
+// Instance implementation
+Ray Instance::_ObjectRay(const Ray& r, Vec3 &translate, Float &scale) const {
+    Float time = r.Time();
+    translate = _translate0 + (_translate1 - _translate0) * time;
+    scale = _scale0 + (_scale1 - _scale0) * time;
+    // Same t along both rays
+    Float inv_scale = 1 / scale;
+    return Ray((r.Origin() - translate) * inv_scale, r.Direction() * inv_scale, r.Type(), time);
+}
+
+bool Instance::Intersect(const Ray& r, Float tmin, Float tmax, Intersection& rec) const {
+    Vec3 translate;
+    Float scale;
+    Ray object_ray = _ObjectRay(r, translate, scale);
+    if (!_object->Intersect(object_ray, tmin, tmax, rec))
+        return false;
+    // The uniform scale keeps the normal direction
+    rec.p = rec.p * scale + translate;
+    return true;
+}
+
+bool Instance::Occluded(const Ray& r, Float tmin, Float tmax) const {
+    Vec3 translate;
+    Float scale;
+    return _object->Occluded(_ObjectRay(r, translate, scale), tmin, tmax);
+}
+
+BBox Instance::_BoxAt(const BBox &box, Float time) const {
+    Vec3 translate = _translate0 + (_translate1 - _translate0) * time;
+    Float scale = _scale0 + (_scale1 - _scale0) * time;
+    return BBox(box.Min() * scale + translate, box.Max() * scale + translate);
+}
+
+bool Instance::BoundingBox(Float t0, Float t1, BBox& output_box) const {
+    BBox box;
+    if (!_object->BoundingBox(t0, t1, box))
+        return false;
+    // Translation & scale are linear in time, the keys bound the motion
+    BBox box0 = _BoxAt(box, t0);
+    BBox box1 = _BoxAt(box, t1);
+    output_box = BBoxUnion(box0, box1);
+    return true;
+}
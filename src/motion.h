@@ -0,0 +1,50 @@
+#pragma once
+
+// Moving primitives, used for motion blur
+// Both are keyed at time 0 & 1 and move linearly between
+// the keys, so their box at any time is the interpolation
+// of the boxes at the keys (see BVH::_BoundsAt)
+
+#include "nray.h"
+#include "primitive.h"
+
+
+// Sphere moving from center0 (time 0) to center1 (time 1)
+class MovingSphere: public Primitive {
+    public:
+        MovingSphere(Point center0_, Point center1_, Float radius_, shared_ptr<Material> mat_)
+            : center0(center0_), center1(center1_), radius(radius_), material(mat_) {}
+
+        virtual bool Intersect(const Ray& r, Float tmin, Float tmax, Intersection& rec) const;
+        virtual bool BoundingBox(Float t0, Float t1, BBox& output_box) const;
+        virtual bool Occluded(const Ray& r, Float tmin, Float tmax) const;
+
+        Point Center(Float time) const { return center0 + (center1 - center0) * time; }
+
+        Point center0, center1;
+        Float radius;
+        shared_ptr<Material> material;
+};
+
+
+// Instance of a primitive (usually a mesh BVH) with a translation
+// & uniform scale keyed at time 0 and 1
+class Instance: public Primitive {
+    public:
+        Instance(shared_ptr<Primitive> object, Vec3 translate0, Float scale0, Vec3 translate1, Float scale1)
+            : _object(object), _translate0(translate0), _translate1(translate1), _scale0(scale0), _scale1(scale1) {}
+
+        virtual bool Intersect(const Ray& r, Float tmin, Float tmax, Intersection& rec) const;
+        virtual bool BoundingBox(Float t0, Float t1, BBox& output_box) const;
+        virtual bool Occluded(const Ray& r, Float tmin, Float tmax) const;
+
+    private:
+        // Ray in the object space at the ray time
+        Ray _ObjectRay(const Ray& r, Vec3 &translate, Float &scale) const;
+        // Object box transformed at time
+        BBox _BoxAt(const BBox &box, Float time) const;
+
+        shared_ptr<Primitive> _object;
+        Vec3 _translate0, _translate1;
+        Float _scale0, _scale1;
+};
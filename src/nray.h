@@ -49,6 +49,7 @@ using std::make_unique;
 // Forward Class Declaration
 // class Ray;
 struct Intersection;
+class Primitive;
 class Scene;
 // class Material;
 template <typename T>
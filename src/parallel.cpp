@@ -0,0 +1,87 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "parallel.h"
+
+
+int ThreadCount(int max_threads) {
+    // hardware_concurrency is 0 when it can't be known
+    int threads = Max(1, (int)std::thread::hardware_concurrency());
+    if (max_threads != -1)
+        threads = Max(1, Min(threads, max_threads));
+    return threads;
+}
+
+void ParallelFor(int count, int threads, const std::function<void(int)> &fn) {
+    threads = Max(1, Min(threads, count));
+    std::atomic<int> next{0};
+    auto worker = [&]() {
+        for (int i = next++; i < count; i = next++)
+            fn(i);
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &thread : pool)
+        thread.join();
+}
+
+void ParallelForBlocks(int count, int block_size, int threads, const std::function<void(int, int)> &fn) {
+    int blocks = (count + block_size - 1) / block_size;
+    ParallelFor(blocks, threads, [&](int block) {
+        int begin = block * block_size;
+        fn(begin, Min(begin + block_size, count));
+    });
+}
+
+ThreadPool::ThreadPool(int threads) {
+    for (int t = 0; t < Max(threads, 1); t++)
+        _workers.emplace_back(&ThreadPool::_Work, this);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::unique_lock<std::mutex> lck(_mtx);
+        _stop = true;
+    }
+    _queued.notify_all();
+    for (auto &worker : _workers)
+        worker.join();
+}
+
+void ThreadPool::Run(int count, const std::function<void()> &fn) {
+    std::mutex mtx;
+    std::condition_variable done;
+    int remaining = count;
+    {
+        std::unique_lock<std::mutex> lck(_mtx);
+        for (int i = 0; i < count; i++) {
+            _tasks.emplace_back([&] {
+                fn();
+                std::unique_lock<std::mutex> lck(mtx);
+                if (--remaining == 0)
+                    done.notify_one();
+            });
+        }
+    }
+    _queued.notify_all();
+    std::unique_lock<std::mutex> lck(mtx);
+    done.wait(lck, [&] { return remaining == 0; });
+}
+
+void ThreadPool::_Work() {
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lck(_mtx);
+            _queued.wait(lck, [&] { return _stop || !_tasks.empty(); });
+            if (_tasks.empty())
+                return;
+            task = std::move(_tasks.front());
+            _tasks.pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+// Small parallel helpers for the scene setup work
+// (the render itself distributes tiles, see Scene::Render)
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "nray.h"
+
+// Threads of the machine (at least one), limited to max_threads unless it's -1
+int ThreadCount(int max_threads = -1);
+
+// Runs fn(i) for i in [0, count) on several threads
+void ParallelFor(int count, int threads, const std::function<void(int)> &fn);
+
+// Runs fn(begin, end) over [0, count) split in blocks of block_size items,
+// for loops whose iterations are too cheap to be dispatched one by one
+void ParallelForBlocks(int count, int block_size, int threads, const std::function<void(int, int)> &fn);
+
+// Fixed set of threads running the tasks queued by any thread, in order
+// Renders running at the same time (--serve) share one, so the machine
+// isn't oversubscribed: the tiles of a job start once the workers are
+// done with the tiles queued before them
+class ThreadPool {
+    public:
+        explicit ThreadPool(int threads);
+        ~ThreadPool();
+
+        // Runs fn on count workers & waits for all of them
+        void Run(int count, const std::function<void()> &fn);
+        int Size() const { return _workers.size(); }
+
+    private:
+        void _Work();
+
+        std::vector<std::thread> _workers;
+        std::deque<std::function<void()>> _tasks;
+        std::mutex _mtx;
+        std::condition_variable _queued;
+        bool _stop{false};
+};
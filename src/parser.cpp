@@ -1,8 +1,14 @@
 #include <fstream>
+#include <map>
 #include <sstream>
 
 #include "parser.h"
 #include "scene.h"
+#include "compressedmesh.h"
+#include "implicit.h"
+#include "motion.h"
+#include "sbvh.h"
+#include "timer.h"
 
 
 SceneItem ToSceneItem(string const &str) {
@@ -18,6 +24,14 @@ SceneItem ToSceneItem(string const &str) {
         return SceneItem::Material;
     else if (str == "<Environment>")
         return SceneItem::Environment;
+    else if (str == "<Implicit>")
+        return SceneItem::Implicit;
+    else if (str == "<Accel>")
+        return SceneItem::Accel;
+    else if (str == "<MovingSphere>")
+        return SceneItem::MovingSphere;
+    else if (str == "<Instance>")
+        return SceneItem::Instance;
 
     return SceneItem::Unknown;
 }
@@ -52,25 +66,106 @@ shared_ptr<Material> CreateMaterial(string const &line) {
 }
 
 
-std::vector<shared_ptr<Primitive>> LoadObjFile(char const *filename, shared_ptr<Material> material) {
+// Reads one node (and its children) from the tokens
+static shared_ptr<SdfNode> _ParseImplicitNode(std::vector<string> const &tokens, size_t &pos) {
+    auto next = [&tokens, &pos]() -> string const & {
+        if (pos >= tokens.size())
+            throw std::runtime_error("Unexpected end of <Implicit> block");
+        return tokens[pos++];
+    };
+    auto number = [&next]() -> Float {
+        string const &tok = next();
+        try {
+            return std::stof(tok);
+        } catch (...) {
+            throw std::runtime_error("Expected a number in <Implicit> block, got " + tok);
+        }
+    };
+    auto vector = [&number]() -> Vec3 {
+        Float x = number();
+        Float y = number();
+        Float z = number();
+        return Vec3(x, y, z);
+    };
+
+    if (next() != "(")
+        throw std::runtime_error("Expected ( in <Implicit> block");
+    string name = next();
+
+    shared_ptr<SdfNode> node;
+    if (name == "sphere")
+        node = make_shared<SdfNode>(SdfOp::Sphere, Vec3(number(), 0, 0));
+    else if (name == "box")
+        node = make_shared<SdfNode>(SdfOp::Box, vector());
+    else if (name == "union")
+        node = make_shared<SdfNode>(SdfOp::Union);
+    else if (name == "intersect")
+        node = make_shared<SdfNode>(SdfOp::Intersect);
+    else if (name == "subtract")
+        node = make_shared<SdfNode>(SdfOp::Subtract);
+    else if (name == "smooth_union")
+        node = make_shared<SdfNode>(SdfOp::SmoothUnion, Vec3(), number());
+    else if (name == "translate")
+        node = make_shared<SdfNode>(SdfOp::Translate, vector());
+    else if (name == "scale")
+        node = make_shared<SdfNode>(SdfOp::Scale, Vec3(), number());
+    else if (name == "repeat")
+        node = make_shared<SdfNode>(SdfOp::Repeat, vector());
+    else
+        throw std::runtime_error("Unknown implicit node: " + name);
+
+    // Children until the closing parenthesis
+    while (pos < tokens.size() && tokens[pos] == "(")
+        node->children.push_back(_ParseImplicitNode(tokens, pos));
+    if (next() != ")")
+        throw std::runtime_error("Expected ) after implicit node " + name);
+    return node;
+}
 
-    std::cerr << "Loading obj file: " << filename << "\n";
+shared_ptr<SdfNode> ParseImplicit(string const &text) {
+    // Split into tokens, parenthesis are tokens on their own
+    std::vector<string> tokens;
+    string token;
+    for (char c : text) {
+        if (c == '(' || c == ')' || std::isspace(static_cast<unsigned char>(c))) {
+            if (!token.empty())
+                tokens.push_back(token);
+            token.clear();
+            if (c == '(' || c == ')')
+                tokens.push_back(string(1, c));
+        }
+        else {
+            token += c;
+        }
+    }
+    if (!token.empty())
+        tokens.push_back(token);
+
+    size_t pos = 0;
+    shared_ptr<SdfNode> root = _ParseImplicitNode(tokens, pos);
+    if (pos != tokens.size())
+        throw std::runtime_error("Unexpected tokens after <Implicit> graph");
+    return root;
+}
 
-    std::vector<shared_ptr<Primitive>> trianglemesh;
+
+void ReadObjFile(char const *filename, int &nTriangles, std::vector<int> &vertexIndices,
+                 std::vector<Point> &vertexPos, std::vector<Normal> &vertexNorm) {
+
+    std::cerr << "Loading obj file: " << filename << "\n";
 
     // Data we need to parse
 
     // Number of triangles
-    int nTriangles = 0;
+    nTriangles = 0;
 
     // Vector containing all the faces vertex indices
     // Face0 -> vertexIndices[0],  vertexIndices[1], vertexIndices[2]
-    std::vector<int> vertexIndices;
+    vertexIndices.clear();
 
-    // All the vertices positions
-    std::vector<Point> vertexPos;
-    // All the vertices normals
-    std::vector<Normal> vertexNorm;
+    // All the vertices positions & normals
+    vertexPos.clear();
+    vertexNorm.clear();
 
 
     // Open file
@@ -117,18 +212,80 @@ std::vector<shared_ptr<Primitive>> LoadObjFile(char const *filename, shared_ptr<
         }
         key = "";
     }
+}
 
-    // std::cout << "Vertex pos: " << vertexPos.size() << " Vertex norm: " << vertexNorm.size() << "\n";
-    // std::cout << "Faces: " << vertexIndices.size() << " -> " << vertexIndices.size() / 3 << "\n";
+std::vector<shared_ptr<Primitive>> LoadObjFile(char const *filename, shared_ptr<Material> material,
+                                               bool compressed, Float crease_angle, int max_threads) {
 
+    int nTriangles;
+    std::vector<int> vertexIndices;
+    std::vector<Point> vertexPos;
+    std::vector<Normal> vertexNorm;
+    ReadObjFile(filename, nTriangles, vertexIndices, vertexPos, vertexNorm);
+
+    if (compressed)
+        return CreateCompressedTriangleMesh(nTriangles, std::move(vertexIndices),
+                                            std::move(vertexPos), std::move(vertexNorm), material, crease_angle,
+                                            max_threads);
+
+    std::vector<shared_ptr<Primitive>> trianglemesh;
     trianglemesh = CreateTriangleMesh( nTriangles, std::move(vertexIndices), 
-                                        std::move(vertexPos), std::move(vertexNorm), material);
+                                        std::move(vertexPos), std::move(vertexNorm), material, crease_angle,
+                                        max_threads);
 
     return std::move(trianglemesh);
     // return trianglemesh;
 }
 
-Scene LoadSceneFile(char const *filename) {
+CameraSettings ParseCamera(std::istream &in) {
+    CameraSettings camera;
+    int dof = 0;
+    in >> camera.lookfrom >> camera.lookat >> camera.vup;
+    in >> camera.vfov >> camera.aperture >> camera.focus_dist >> dof;
+    if (!in)
+        throw std::runtime_error("Incomplete <Camera> description");
+    camera.do_dof = dof == 1;
+    // Optional shutter interval, for motion blur
+    Float t0, t1;
+    if (in >> t0 >> t1) {
+        camera.shutter_open = t0;
+        camera.shutter_close = t1;
+    }
+    return camera;
+}
+
+std::vector<CameraSettings> LoadCameraFile(char const *filename) {
+    std::ifstream filestream(filename);
+    if (!filestream.is_open())
+        throw std::runtime_error("Failed opening camera file " + string(filename));
+    std::vector<CameraSettings> cameras;
+    string line;
+    while (std::getline(filestream, line)) {
+        if (line.find_first_not_of(" \t\r") == string::npos || line[line.find_first_not_of(" \t")] == '#')
+            continue;
+        // The lines can keep their <Camera> key
+        auto key = line.find("<Camera>");
+        std::istringstream linestream(key == string::npos ? line : line.substr(key + 8));
+        cameras.push_back(ParseCamera(linestream));
+    }
+    return cameras;
+}
+
+string FramePath(string const &pattern, int frame) {
+    auto last = pattern.rfind('#');
+    if (last == string::npos)
+        return pattern;
+    auto first = last;
+    while (first > 0 && pattern[first - 1] == '#')
+        first--;
+    string number = std::to_string(frame);
+    size_t width = last - first + 1;
+    if (number.size() < width)
+        number.insert(0, width - number.size(), '0');
+    return pattern.substr(0, first) + number + pattern.substr(last + 1);
+}
+
+Scene LoadSceneFile(char const *filename, int frame, int max_threads) {
 
     // Open file
     std::ifstream filestream(filename);
@@ -140,20 +297,28 @@ Scene LoadSceneFile(char const *filename) {
     // shared_ptr<PrimitiveList> world = make_shared<PrimitiveList>();
     PrimitiveList world;
 
-    // Camera attributes
-    Vec3 lookfrom, lookat, vup;
-    Float vfov, aperture, focus_dist;
-    int dof;
+    // Camera attributes, of every <Camera> (the first one is the default)
+    CameraSettings camera;
+    std::vector<CameraSettings> cameras;
+    // Moving spheres & instances, keyed at times 0 & 1
+    bool moving = false;
 
     // Default (and current) Material
     shared_ptr<Material> material = make_shared<LambertianMaterial> (Color(1,0,1));
 
     // Parse scene
-    Image ibl;
+    shared_ptr<EnvironmentMap> ibl;
+    std::vector<shared_ptr<ImplicitPrimitive>> implicits;
     bool has_settings = false;
     bool has_camera = false;
     std::vector<string> objs_to_load;
     std::vector<shared_ptr<Material>> objs_materials;
+    std::vector<bool> objs_compressed;
+    std::vector<Float> objs_crease;
+    // Instanced meshes, loaded once per obj & material
+    std::map<std::pair<string, Material*>, shared_ptr<BVH>> instanced;
+    // Files the scene is made of
+    std::vector<string> files = { filename };
     string line;
     string key;
     string path;
@@ -174,35 +339,48 @@ Scene LoadSceneFile(char const *filename) {
                 linestream >> options.max_diffuse_rdepth;
                 linestream >> options.max_reflect_rdepth;
                 linestream >> options.max_refract_rdepth;
+                // Optional Russian roulette depth
+                if (linestream >> val)
+                    options.rr_min_depth = (int)val;
                 break;
 
             case SceneItem::Camera :
+                cameras.push_back(ParseCamera(linestream));
+                if (!has_camera)
+                    camera = cameras.back();
                 has_camera = true;
-                // Lookfrom
-                linestream >> x >> y >> z;
-                lookfrom = Vec3(x, y, z);
-                // Lookat
-                linestream >> x >> y >> z;
-                lookat = Vec3(x, y, z);
-                // Vup
-                linestream >> x >> y >> z;
-                vup = Vec3(x, y, z);  
-                linestream >> vfov;
-                linestream >> aperture;
-                linestream >> focus_dist;
-                linestream >> dof;
-                break;            
+                break;
 
             case SceneItem::Sphere :
                 linestream >> x >> y >> z >> val;
                 world.add(make_shared<Sphere>(Point(x, y, z), val, material));
                 break;
 
+            case SceneItem::MovingSphere : {
+                linestream >> x >> y >> z;
+                Point center0(x, y, z);
+                linestream >> x >> y >> z >> val;
+                world.add(make_shared<MovingSphere>(center0, Point(x, y, z), val, material));
+                moving = true;
+                break;
+            }
+
             case SceneItem::ObjMesh :
                 linestream >> path;
                 // Add the obj file path & the current material
                 objs_to_load.push_back(path);
                 objs_materials.push_back(material);
+                // Optional compressed storage & crease angle
+                objs_compressed.push_back(false);
+                objs_crease.push_back(180);
+                while (linestream >> key) {
+                    if (key == "compressed")
+                        objs_compressed.back() = true;
+                    else if (key == "crease" && linestream >> val)
+                        objs_crease.back() = val;
+                    else
+                        throw std::runtime_error("Unknown <ObjMesh> option " + key);
+                }
                 path = "";
                 break;
 
@@ -213,10 +391,76 @@ Scene LoadSceneFile(char const *filename) {
             case SceneItem::Environment :
                 linestream >> x >> y >> z;
                 linestream >> path;
-                ibl.LoadFromFile(path.c_str());
+                ibl = LoadEnvironmentMap(path, max_threads);
+                files.push_back(path);
+                path = "";
+                break;
+
+            case SceneItem::Implicit : {
+                // The graph spans all the lines until </Implicit>
+                string text, block_line;
+                std::getline(linestream, text);
+                bool closed = false;
+                while (!closed && std::getline(filestream, block_line)) {
+                    auto end = block_line.find("</Implicit>");
+                    if (end != string::npos) {
+                        block_line = block_line.substr(0, end);
+                        closed = true;
+                    }
+                    if (block_line.find('#') == 0)
+                        continue;
+                    text += " " + block_line;
+                }
+                if (!closed)
+                    throw std::runtime_error("<Implicit> block is missing </Implicit>");
+
+                auto graph = make_shared<ImplicitGraph>(SdfProgram(*ParseImplicit(text)), material);
+                BBox box;
+                if (!graph->BoundingBox(0, 0, box))
+                    throw std::runtime_error("<Implicit> graph is unbounded, intersect repetitions with a box");
+                world.add(graph);
+                implicits.push_back(graph);
+                break;
+            }
+
+            case SceneItem::Accel :
+                linestream >> path;
+                if (path == "sbvh")
+                    options.bvh = BVHType::Spatial;
+                else if (path == "bvh")
+                    options.bvh = BVHType::Median;
+                else
+                    throw std::runtime_error("Unknown acceleration structure " + path);
+                // Optional SBVH references growth limit
+                if (linestream >> val)
+                    options.sbvh_max_growth = val;
                 path = "";
                 break;
 
+            case SceneItem::Instance : {
+                linestream >> path >> x >> y >> z >> val;
+                Vec3 translate0(x, y, z);
+                Float scale0 = val;
+                // Static unless the end keys are given
+                Vec3 translate1 = translate0;
+                Float scale1 = scale0;
+                if (linestream >> x >> y >> z >> val) {
+                    translate1 = Vec3(x, y, z);
+                    scale1 = val;
+                }
+                auto &object = instanced[{path, material.get()}];
+                if (!object) {
+                    PrimitiveList mesh;
+                    mesh.add(LoadObjFile(path.c_str(), material, false, 180, max_threads));
+                    object = make_shared<BVH>(mesh, 0.0, 0.0);
+                    files.push_back(path);
+                }
+                world.add(make_shared<Instance>(object, translate0, scale0, translate1, scale1));
+                moving |= translate1 != translate0 || scale1 != scale0;
+                path = "";
+                break;
+            }
+
             case SceneItem::Unknown :
                 // std::cerr << "Warning: Unknown descriptor " << key << "\n";
                 break;
@@ -229,21 +473,59 @@ Scene LoadSceneFile(char const *filename) {
         throw std::runtime_error("Scene is missing <Settings> or <Camera>");
     }
 
+    std::vector<AnimatedMesh> animated;
     if (!objs_to_load.empty()) {
         for (int i=0; i<objs_to_load.size(); i++) {
-            std::vector<shared_ptr<Primitive>> trianglemesh = LoadObjFile(objs_to_load[i].c_str(), objs_materials[i]);
+            string obj_path = FramePath(objs_to_load[i], frame);
+            files.push_back(obj_path);
+            // Animated meshes are updated in place, they stay uncompressed
+            bool is_animated = obj_path != objs_to_load[i];
+            std::vector<shared_ptr<Primitive>> trianglemesh = LoadObjFile(obj_path.c_str(), objs_materials[i],
+                                                                          objs_compressed[i] && !is_animated, objs_crease[i],
+                                                                          max_threads);
+            // Keep the animated meshes to update them on the next frames
+            if (is_animated && !trianglemesh.empty())
+                animated.push_back({objs_to_load[i], std::static_pointer_cast<Triangle>(trianglemesh[0])->Mesh()});
             world.add(std::move(trianglemesh));
         }
     }
 
     // Init camera
     options.image_aspect_ratio = Float(options.image_width) / options.image_height;
-    Camera cam(lookfrom, lookat, vup, vfov, options.image_aspect_ratio, aperture, focus_dist, dof==1);
-
-    // Create BVH
-    std::cout << "Creating BVH...\n";
-    shared_ptr<BVH> bvh = make_shared<BVH>(world, 0.0, 0.0);
-
-    Scene scene(bvh, cam, options, std::move(ibl));
+    Camera cam(camera, options.image_aspect_ratio);
+
+    // Create BVH over the motion keys & the shutter of every camera,
+    // moving primitives get their boxes at both ends
+    Float time0 = 0, time1 = 1;
+    for (const CameraSettings &settings : cameras) {
+        time0 = Min(time0, Min(settings.shutter_open, settings.shutter_close));
+        time1 = Max(time1, Max(settings.shutter_open, settings.shutter_close));
+    }
+    Timer timer;
+    timer.Start();
+    shared_ptr<BVH> bvh;
+    if (options.bvh == BVHType::Spatial) {
+        std::cout << "Creating SBVH...\n";
+        bvh = CreateSBVH(world.Objects(), time0, time1, options.sbvh_max_growth);
+    }
+    else {
+        std::cout << "Creating BVH...\n";
+        bvh = make_shared<BVH>(world, time0, time1);
+    }
+    timer.Stop();
+    std::cout << "BVH built in: ";
+    timer.Print();
+    std::cout << "\n";
+
+    Scene scene(bvh, cam, options, ibl);
+    scene.implicits = std::move(implicits);
+    scene.animated = std::move(animated);
+    scene.files = std::move(files);
+    if (moving) {
+        scene.motion_open = time0;
+        scene.motion_close = time1;
+    }
+    for (const CameraSettings &settings : cameras)
+        scene.cameras.emplace_back(settings, options.image_aspect_ratio);
     return std::move(scene);
 }
\ No newline at end of file
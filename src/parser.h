@@ -4,10 +4,13 @@
 // reads files and returns classes
 // for the renderer
 
+#include <istream>
 #include <string>
 
 #include "nray.h"
 #include "primitive.h"
+#include "sdf.h"
+#include "camera.h"
 
 using std::string;
 
@@ -19,12 +22,39 @@ enum class SceneItem
     ObjMesh,
     Material,
     Environment,
+    Implicit,
+    Accel,
+    MovingSphere,
+    Instance,
     Unknown
 };
 
 SceneItem ToSceneItem(string const &str);
 shared_ptr<Material> CreateMaterial(string const &line);
 
-std::vector<shared_ptr<Primitive>> LoadObjFile(char const *filename, shared_ptr<Material> material);
-
-Scene LoadSceneFile(char const *filename);
\ No newline at end of file
+// Parses an implicit graph written as nested lists
+// e.g. (smooth_union 0.2 (sphere 1) (translate 1 0 0 (box 0.5 0.5 0.5)))
+shared_ptr<SdfNode> ParseImplicit(string const &text);
+
+// Reads the faces & vertices of an obj file
+void ReadObjFile(char const *filename, int &nTriangles, std::vector<int> &vertexIndices,
+                 std::vector<Point> &vertexPos, std::vector<Normal> &vertexNorm);
+// Compressed meshes use quantized vertices (see compressedmesh.h)
+// crease_angle is used when the obj has no normals (see TriangleMesh::CreateNormals)
+std::vector<shared_ptr<Primitive>> LoadObjFile(char const *filename, shared_ptr<Material> material,
+                                               bool compressed=false, Float crease_angle=180, int max_threads=-1);
+
+// Reads the parameters of a <Camera> line (after its key)
+// lookfrom(x y z) lookat(x y z) vup(x y z) vfov aperture focus_dist dof [shutter_open shutter_close]
+CameraSettings ParseCamera(std::istream &in);
+// Reads a camera per line (in the <Camera> format), lines starting with # are skipped
+std::vector<CameraSettings> LoadCameraFile(char const *filename);
+
+// Replaces the last run of # in pattern by the zero padded frame number
+// e.g. FramePath("bunny_###.obj", 12) returns "bunny_012.obj"
+string FramePath(string const &pattern, int frame);
+
+// Loads a scene, obj paths containing # are animated
+// and loaded for the given frame. max_threads limits the threads
+// creating the missing mesh normals & the environment map (-1 for all)
+Scene LoadSceneFile(char const *filename, int frame=0, int max_threads=-1);
\ No newline at end of file
@@ -0,0 +1,54 @@
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "pfmwriter.h"
+
+
+PfmWriter::PfmWriter(char const *filename, int width, int height)
+    : _file(filename, std::ios::binary), _width(width), _height(height) {
+    if (!_file)
+        throw std::runtime_error("Can't open " + std::string(filename));
+    // RGB, a negative scale means little endian
+    _file << "PF\n" << width << " " << height << "\n-1.0\n";
+    _headerSize = _file.tellp();
+}
+
+void PfmWriter::WriteRows(const Image &band, int rows) {
+    rows = Min(rows, _height - _rowsWritten);
+    std::vector<float> row(3 * _width);
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < _width; x++) {
+            Color c = band(x, y);
+            row[3*x + 0] = c.x;
+            row[3*x + 1] = c.y;
+            row[3*x + 2] = c.z;
+        }
+        int file_row = _height - 1 - (_rowsWritten + y);
+        _file.seekp(_headerSize + (std::streamoff)file_row * 3 * _width * sizeof(float));
+        _file.write((const char*)row.data(), row.size() * sizeof(float));
+    }
+    _rowsWritten += rows;
+}
+
+Image ReadPfm(char const *filename) {
+    std::ifstream file(filename, std::ios::binary);
+    std::string magic;
+    int width = 0, height = 0;
+    float scale = 0;
+    file >> magic >> width >> height >> scale;
+    // A single whitespace ends the header
+    file.get();
+    if (!file || magic != "PF" || width <= 0 || height <= 0 || scale >= 0)
+        return Image();
+
+    Image image(width, height);
+    std::vector<float> row(3 * width);
+    for (int y = height - 1; y >= 0; y--) {
+        if (!file.read((char*)row.data(), row.size() * sizeof(float)))
+            return Image();
+        for (int x = 0; x < width; x++)
+            image.SetPixel(x, y, Color(row[3*x + 0], row[3*x + 1], row[3*x + 2]));
+    }
+    return image;
+}
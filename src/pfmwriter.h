@@ -0,0 +1,32 @@
+#pragma once
+
+#include <fstream>
+
+#include "nray.h"
+#include "geometry.h"
+#include "image.h"
+
+// Portable float map writer, for the buffers that can't be tone mapped
+// (depth, ids...). The values are written as they are (32 bits floats)
+// Like PngWriter it takes bands of rows, top to bottom: pfm files
+// store the bottom row first, so each row is written at its offset
+class PfmWriter {
+    public:
+        // Opens the file & writes the header, throws if it can't
+        PfmWriter(char const *filename, int width, int height);
+
+        // Writes the first rows of the band (band.Width() == width)
+        void WriteRows(const Image &band, int rows);
+        void Close() { _file.close(); }
+
+    private:
+        std::ofstream _file;
+        int _width{0};
+        int _height{0};
+        int _rowsWritten{0};
+        std::streamoff _headerSize{0};
+};
+
+// Reads a pfm file as PfmWriter writes them (RGB, little endian)
+// Returns an empty image if it's missing or in another format
+Image ReadPfm(char const *filename);
@@ -0,0 +1,260 @@
+#include <array>
+#include <stdexcept>
+
+#include "pngwriter.h"
+
+
+// Deflate lengths & distances: base values & extra bits of each code
+static const int LengthBase[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
+static const int LengthExtra[] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+static const int DistanceBase[] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32769 };
+static const int DistanceExtra[] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+static const int WindowSize = 32768;
+static const int MaxMatch = 258;
+// Candidates tested per position, more compress better & slower
+static const int MaxChain = 16;
+static const int HashBits = 15;
+
+static uint32_t Crc32(uint32_t crc, const unsigned char *data, size_t size) {
+    // Built once, thread safe: streamed server jobs write pngs at the same time
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void PutBigEndian(unsigned char *out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static unsigned char Paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+PngWriter::PngWriter(char const *filename, int width, int height)
+    : _file(filename, std::ios::binary), _width(width), _height(height) {
+    if (!_file)
+        throw std::runtime_error("Can't open " + std::string(filename));
+
+    const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    _file.write((const char*)signature, 8);
+    // 8 bits RGB, no interlacing
+    unsigned char header[13] = { 0 };
+    PutBigEndian(header, width);
+    PutBigEndian(header + 4, height);
+    header[8] = 8;
+    header[9] = 2;
+    _WriteChunk("IHDR", header, 13);
+
+    _previous.assign(3 * width, 0);
+    // zlib header: deflate with a 32KB window
+    _compressed = { 0x78, 0x01 };
+}
+
+PngWriter::~PngWriter() {
+    if (!_closed && _rowsWritten == _height)
+        Close();
+}
+
+void PngWriter::WriteRows(const Image &band, int rows) {
+    rows = Min(rows, _height - _rowsWritten);
+    const int stride = 3 * _width;
+    // Each row starts with its filter type, the one giving the smallest
+    // sum of absolute values is picked (the stb_image_write heuristic)
+    std::vector<unsigned char> data((size_t)rows * (stride + 1));
+    std::vector<unsigned char> row(stride);
+    std::vector<unsigned char> filtered(stride);
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < _width; x++) {
+            Color c = band(x, y);
+            row[3*x + 0] = Image::ToByte(c.x);
+            row[3*x + 1] = Image::ToByte(c.y);
+            row[3*x + 2] = Image::ToByte(c.z);
+        }
+        unsigned char *out = &data[(size_t)y * (stride + 1)];
+        int best = -1, best_cost = 0;
+        for (int type = 0; type < 5; type++) {
+            int cost = 0;
+            for (int i = 0; i < stride; i++) {
+                int left = i >= 3 ? row[i - 3] : 0;
+                int up = _previous[i];
+                int up_left = i >= 3 ? _previous[i - 3] : 0;
+                unsigned char predicted = 0;
+                switch (type) {
+                    case 1: predicted = left; break;
+                    case 2: predicted = up; break;
+                    case 3: predicted = (left + up) / 2; break;
+                    case 4: predicted = Paeth(left, up, up_left); break;
+                }
+                filtered[i] = row[i] - predicted;
+                cost += std::abs((signed char)filtered[i]);
+            }
+            if (best < 0 || cost < best_cost) {
+                best = type;
+                best_cost = cost;
+                out[0] = type;
+                std::copy(filtered.begin(), filtered.end(), out + 1);
+            }
+        }
+        _previous.swap(row);
+    }
+
+    _Compress(data);
+    _WriteChunk("IDAT", _compressed.data(), _compressed.size());
+    _compressed.clear();
+    _rowsWritten += rows;
+}
+
+void PngWriter::Close() {
+    if (_closed)
+        return;
+    _closed = true;
+    // Empty final block, then the adler32 of the data on a byte boundary
+    _AddBits(1, 1);
+    _AddBits(1, 2);
+    _AddSymbol(256);
+    if (_bitCount > 0)
+        _AddBits(0, 8 - _bitCount);
+    unsigned char adler[4];
+    PutBigEndian(adler, (_adlerB << 16) | _adlerA);
+    _compressed.insert(_compressed.end(), adler, adler + 4);
+    _WriteChunk("IDAT", _compressed.data(), _compressed.size());
+    _WriteChunk("IEND", nullptr, 0);
+    _file.close();
+}
+
+void PngWriter::_AddBits(uint32_t bits, int count) {
+    _bitBuffer |= (uint64_t)bits << _bitCount;
+    _bitCount += count;
+    while (_bitCount >= 8) {
+        _compressed.push_back(_bitBuffer & 0xFF);
+        _bitBuffer >>= 8;
+        _bitCount -= 8;
+    }
+}
+
+void PngWriter::_AddCode(uint32_t code, int count) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < count; i++)
+        reversed |= ((code >> i) & 1) << (count - 1 - i);
+    _AddBits(reversed, count);
+}
+
+void PngWriter::_AddSymbol(int symbol) {
+    if (symbol < 144)
+        _AddCode(0x30 + symbol, 8);
+    else if (symbol < 256)
+        _AddCode(0x190 + symbol - 144, 9);
+    else if (symbol < 280)
+        _AddCode(symbol - 256, 7);
+    else
+        _AddCode(0xC0 + symbol - 280, 8);
+}
+
+void PngWriter::_Compress(const std::vector<unsigned char> &data) {
+    for (unsigned char byte : data) {
+        _adlerA = (_adlerA + byte) % 65521;
+        _adlerB = (_adlerB + _adlerA) % 65521;
+    }
+
+    // The window of the previous bands, then the new data
+    std::vector<unsigned char> input(_window);
+    input.insert(input.end(), data.begin(), data.end());
+    const int n = input.size();
+    auto hash = [&](int i) {
+        uint32_t h = input[i] | (input[i + 1] << 8) | (input[i + 2] << 16);
+        return (h * 2654435761u) >> (32 - HashBits);
+    };
+    // Chains of the positions with the same hash, most recent first
+    std::vector<int> head(1 << HashBits, -1);
+    std::vector<int> previous(n, -1);
+    auto insert = [&](int i) {
+        if (i + 2 < n) {
+            uint32_t h = hash(i);
+            previous[i] = head[h];
+            head[h] = i;
+        }
+    };
+    for (int i = 0; i < (int)_window.size(); i++)
+        insert(i);
+
+    // Non final block with the fixed codes
+    _AddBits(0, 1);
+    _AddBits(1, 2);
+    int i = _window.size();
+    while (i < n) {
+        int best = 0, distance = 0;
+        if (i + 2 < n) {
+            int limit = Min(MaxMatch, n - i);
+            int chain = 0;
+            for (int candidate = head[hash(i)]; candidate >= 0 && i - candidate <= WindowSize && chain < MaxChain;
+                 candidate = previous[candidate], chain++) {
+                int length = 0;
+                while (length < limit && input[candidate + length] == input[i + length])
+                    length++;
+                if (length > best) {
+                    best = length;
+                    distance = i - candidate;
+                    if (length == limit)
+                        break;
+                }
+            }
+        }
+        if (best < 3) {
+            _AddSymbol(input[i]);
+            insert(i);
+            i++;
+            continue;
+        }
+
+        int j = 0;
+        while (best >= LengthBase[j + 1])
+            j++;
+        _AddSymbol(257 + j);
+        if (LengthExtra[j])
+            _AddBits(best - LengthBase[j], LengthExtra[j]);
+        int k = 0;
+        while (distance >= DistanceBase[k + 1])
+            k++;
+        _AddCode(k, 5);
+        if (DistanceExtra[k])
+            _AddBits(distance - DistanceBase[k], DistanceExtra[k]);
+        for (int end = i + best; i < end; i++)
+            insert(i);
+    }
+    _AddSymbol(256);
+
+    int keep = Min(n, WindowSize);
+    _window.assign(input.end() - keep, input.end());
+}
+
+void PngWriter::_WriteChunk(const char *tag, const unsigned char *data, size_t size) {
+    unsigned char bytes[4];
+    PutBigEndian(bytes, size);
+    _file.write((const char*)bytes, 4);
+    _file.write(tag, 4);
+    if (size > 0)
+        _file.write((const char*)data, size);
+    uint32_t crc = Crc32(0, (const unsigned char*)tag, 4);
+    crc = Crc32(crc, data, size);
+    PutBigEndian(bytes, crc);
+    _file.write((const char*)bytes, 4);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+#include "nray.h"
+#include "geometry.h"
+#include "image.h"
+
+// Streaming png writer
+// The image is written by bands of rows, top to bottom, as they are
+// ready: each band is filtered, compressed & written as its own IDAT
+// chunk, only the last 32KB (the deflate window) are kept in memory
+// The deflate stream uses the fixed Huffman codes, like stb_image_write
+class PngWriter {
+    public:
+        // Opens the file & writes the header, throws if it can't
+        PngWriter(char const *filename, int width, int height);
+        // Finishes the file if Close wasn't called
+        ~PngWriter();
+
+        // Writes the first rows of the band (band.Width() == width),
+        // tone mapped like Image::WriteToFile
+        void WriteRows(const Image &band, int rows);
+        // Ends the deflate stream & the file, all the rows must be written
+        void Close();
+
+    private:
+        // Bits are packed from the least significant one, as deflate wants
+        void _AddBits(uint32_t bits, int count);
+        // Huffman codes are packed from their most significant bit
+        void _AddCode(uint32_t code, int count);
+        // Fixed Huffman code of a literal/length symbol
+        void _AddSymbol(int symbol);
+        // Compresses the bytes (filtered rows) in a non final deflate block
+        void _Compress(const std::vector<unsigned char> &data);
+        // Writes the whole bytes compressed so far as an IDAT chunk
+        void _WriteChunk(const char *tag, const unsigned char *data, size_t size);
+
+        std::ofstream _file;
+        int _width{0};
+        int _height{0};
+        int _rowsWritten{0};
+        bool _closed{false};
+
+        // Last row (unfiltered), the filters predict from it
+        std::vector<unsigned char> _previous;
+        // Last uncompressed bytes, matches can reach back into them
+        std::vector<unsigned char> _window;
+        // Compressed bytes not written yet & bits of the last one
+        std::vector<unsigned char> _compressed;
+        uint64_t _bitBuffer{0};
+        int _bitCount{0};
+        // Adler32 of the uncompressed stream
+        uint32_t _adlerA{1};
+        uint32_t _adlerB{0};
+};
@@ -1,5 +1,9 @@
 #include <algorithm>
+#include <stdexcept>
+#include <thread>
 #include "primitive.h"
+#include "parallel.h"
+#include "timer.h"
 
 
 bool PrimitiveList::Intersect(const Ray& r, Float t_min, Float t_max, Intersection& rec) const {
@@ -12,12 +16,31 @@ bool PrimitiveList::Intersect(const Ray& r, Float t_min, Float t_max, Intersecti
             hit_anything = true;
             closest_so_far = temp_rec.t;
             rec = temp_rec;
+            if (!dynamic_cast<const PrimitiveList*>(object.get()))
+                rec.primitive = object.get();
         }
     }
 
     return hit_anything;
 }
 
+void PrimitiveList::Leaves(std::vector<const Primitive*> &leaves) const {
+    for (const auto& object : _objects) {
+        if (auto list = dynamic_cast<const PrimitiveList*>(object.get()))
+            list->Leaves(leaves);
+        else
+            leaves.push_back(object.get());
+    }
+}
+
+bool PrimitiveList::Occluded(const Ray& r, Float t_min, Float t_max) const {
+    for (const auto& object : _objects) {
+        if (object->Occluded(r, t_min, t_max))
+            return true;
+    }
+    return false;
+}
+
 
 bool PrimitiveList::BoundingBox(Float t0, Float t1, BBox& output_box) const {
     if (_objects.empty())
@@ -75,12 +98,44 @@ bool Sphere::Intersect(const Ray& r, Float t_min, Float t_max, Intersection& rec
     return false;
 }
 
+bool Sphere::Occluded(const Ray& r, Float t_min, Float t_max) const {
+    Vec3 oc = r.Origin() - center;
+    Float a = r.Direction().LengthSquared();
+    Float half_b = Dot(oc, r.Direction());
+    Float c = oc.LengthSquared() - radius*radius;
+    Float discriminant = half_b*half_b - a*c;
+    if (discriminant <= 0)
+        return false;
+
+    // Either root in the range is a hit
+    Float root = sqrt(discriminant);
+    Float t0 = (-half_b - root) / a;
+    Float t1 = (-half_b + root) / a;
+    return (t0 < t_max && t0 > t_min) || (t1 < t_max && t1 > t_min);
+}
+
 bool Sphere::BoundingBox(Float t0, Float t1, BBox& output_box) const {
     output_box = BBox( center - Vec3(radius, radius, radius),
                        center + Vec3(radius, radius, radius) );
     return true;
 }
 
+bool Sphere::Emission(Color &radiance, LightBounds &bounds) const {
+    radiance = material->Emitted();
+    if (MaxComponent(radiance) <= 0)
+        return false;
+    bounds = SphereEmitterBounds(center, radius, radiance);
+    return true;
+}
+
+bool Sphere::SampleDirection(const Point &p, Float u, Float v, Vec3 &wi, Float &distance, Float &pdf) const {
+    return SampleSphereDirection(center, radius, p, u, v, wi, distance, pdf);
+}
+
+Float Sphere::DirectionPdf(const Point &p, const Point &q) const {
+    return SphereDirectionPdf(center, radius, p, q);
+}
+
 
 
 
@@ -116,14 +171,44 @@ BVH::BVH( std::vector<shared_ptr<Primitive>>& objects,
         _right = make_shared<BVH> (objects, mid, end, time0, time1);
     }
 
-    BBox bbox_left, bbox_right;
-    if ( !_left->BoundingBox(time0, time1, bbox_left)
-      || !_right->BoundingBox(time0, time1, bbox_right) ) {
-          std::cerr << "No BBox in BVH Constructor.\n";
-    }
+    _time0 = time0;
+    _time1 = time1;
+    _UpdateBounds();
 
-    _bbox = BBoxUnion(bbox_left, bbox_right);
+    _axis = axis;
+    _LinkChildren();
+}
+
+BVH::BVH( shared_ptr<Primitive> left, shared_ptr<Primitive> right, const BBox &box, int axis,
+          Float time0, Float time1 )
+    : _left(left), _right(right), _axis(axis) {
+    _time0 = time0;
+    _time1 = time1;
+    _LinkChildren();
+    // Moving nodes get their boxes at both ends, like the other builder,
+    // so Refit keeps the motion. Static ones keep the clipped box
+    _UpdateBounds();
+    if (!_moving)
+        _bbox = _bbox1 = box;
+}
+
+void BVH::Leaves(std::vector<const Primitive*> &leaves) const {
+    const BVH *nodes[2] = { _leftNode, _rightNode };
+    const Primitive *children[2] = { _left.get(), _right.get() };
+    for (int i = 0; i < 2; i++) {
+        if (nodes[i])
+            nodes[i]->Leaves(leaves);
+        else
+            leaves.push_back(children[i]);
+    }
+}
 
+void BVH::_LinkChildren() {
+    _leftNode = dynamic_cast<BVH *>(_left.get());
+    _rightNode = dynamic_cast<BVH *>(_right.get());
+    _depth = 1 + Max(_leftNode ? _leftNode->_depth : 0, _rightNode ? _rightNode->_depth : 0);
+    if (_depth > MaxDepth)
+        throw std::runtime_error("BVH is too deep");
 }
 
 
@@ -132,7 +217,7 @@ inline bool _BBoxCompare(const shared_ptr<Primitive> a, const shared_ptr<Primiti
     if (!a->BoundingBox(0,0, ba) || !b->BoundingBox(0,0, bb)) {
         std::cerr << "No BoundingBox in BVH Constructor\n";
     }
-    return ba.Min()[axis] < ba.Min()[axis];
+    return ba.Min()[axis] < bb.Min()[axis];
 }
 
 bool _BBoxCompareX(const shared_ptr<Primitive> a, const shared_ptr<Primitive> b) {
@@ -148,21 +233,168 @@ bool _BBoxCompareZ(const shared_ptr<Primitive> a, const shared_ptr<Primitive> b)
 }
 
 bool BVH::BoundingBox(Float t0, Float t1, BBox& output_box) const {
-    output_box = _bbox;
+    output_box = _BoundsAt(_IntervalPosition(t0));
+    if (t1 != t0) {
+        BBox box1 = _BoundsAt(_IntervalPosition(t1));
+        output_box = BBoxUnion(output_box, box1);
+    }
     return true;
 }
 
+void BVH::Refit(int threads) {
+    // Go down until there are enough subtrees to keep the threads busy
+    // The nodes above them are refitted afterward, children first
+    std::vector<BVH *> subtrees{this};
+    std::vector<BVH *> upper;
+    while ((int)subtrees.size() < 4 * threads) {
+        std::vector<BVH *> next;
+        for (BVH *node : subtrees) {
+            if (!node->_leftNode && !node->_rightNode) {
+                next.push_back(node);
+                continue;
+            }
+            upper.push_back(node);
+            if (node->_leftNode)
+                next.push_back(node->_leftNode);
+            if (node->_rightNode)
+                next.push_back(node->_rightNode);
+        }
+        if (next.size() == subtrees.size())
+            break;
+        subtrees.swap(next);
+    }
+
+    ParallelFor(subtrees.size(), threads, [&](int i) { subtrees[i]->_Refit(); });
+    for (auto node = upper.rbegin(); node != upper.rend(); ++node)
+        (*node)->_UpdateBounds();
+}
+
+void BVH::_Refit() {
+    if (_leftNode)
+        _leftNode->_Refit();
+    if (_rightNode)
+        _rightNode->_Refit();
+    _UpdateBounds();
+}
+
+void BVH::_UpdateBounds() {
+    // Children boxes at both ends of the time interval
+    BBox bbox_left, bbox_right;
+    if ( !_left->BoundingBox(_time0, _time0, bbox_left)
+      || !_right->BoundingBox(_time0, _time0, bbox_right) ) {
+          std::cerr << "No BBox in BVH Constructor.\n";
+    }
+    _bbox = BBoxUnion(bbox_left, bbox_right);
+
+    _bbox1 = _bbox;
+    if (_time1 > _time0) {
+        _left->BoundingBox(_time1, _time1, bbox_left);
+        _right->BoundingBox(_time1, _time1, bbox_right);
+        _bbox1 = BBoxUnion(bbox_left, bbox_right);
+    }
+    _moving = _bbox.Min() != _bbox1.Min() || _bbox.Max() != _bbox1.Max();
+}
+
+Float BVH::_IntervalPosition(Float time) const {
+    if (_time1 <= _time0)
+        return 0;
+    return Clamp((time - _time0) / (_time1 - _time0), (Float)0, (Float)1);
+}
+
+BBox BVH::_BoundsAt(Float s) const {
+    return _moving ? Lerp(s, _bbox, _bbox1) : _bbox;
+}
+
 bool BVH::Intersect(const Ray& r, Float tmin, Float tmax, Intersection& rec) const {
+    return _Traverse<false>(r, tmin, tmax, &rec);
+}
+
+bool BVH::Occluded(const Ray& r, Float tmin, Float tmax) const {
+    return _Traverse<true>(r, tmin, tmax, nullptr);
+}
+
+template <bool AnyHit>
+bool BVH::_Traverse(const Ray& r, Float tmin, Float tmax, Intersection *rec) const {
     // Exit if the r doesn't intersect the bbox
-    if (!_bbox.Intersect(r, tmin, tmax))
+    BVHCounts &counts = BVHStats::local;
+    counts.traversals++;
+    counts.nodes++;
+    // The nodes share the time interval of the root
+    Float s = _IntervalPosition(r.Time());
+    Float t_enter, t_exit;
+    if (!_BoundsAt(s).Intersect(r, tmin, tmax, t_enter, t_exit))
         return false;
 
-    // Check if we intersect with the left obj
-    bool hit_left = _left->Intersect(r, tmin, tmax, rec);
-    // Check if we intersect with the right (and the hit is closer than the left one)
-    bool hit_right = _right->Intersect(r, tmin, hit_left ? rec.t : tmax, rec);
+    // Along the split axis, the left child is the near one
+    // unless the ray goes toward the negative side
+    const Vec3 &inv_dir = r.InvDirection();
+    const bool dir_neg[3] = { inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0 };
+
+    // Nodes left to visit and their entry distance
+    struct StackEntry {
+        const BVH *node;
+        Float t;
+    };
+    StackEntry stack[MaxDepth];
+    int stack_size = 0;
+
+    const BVH *node = this;
+    bool hit = false;
+    // Number of child boxes tested
+    uint64_t visits = 0;
+    while (node) {
+        bool swap = dir_neg[node->_axis];
+        const Primitive *children[2] = { node->_left.get(), node->_right.get() };
+        const BVH *nodes[2] = { node->_leftNode, node->_rightNode };
+        if (swap) {
+            std::swap(children[0], children[1]);
+            std::swap(nodes[0], nodes[1]);
+        }
+        // Single primitive leaves store it twice
+        int count = (children[0] == children[1]) ? 1 : 2;
+
+        const BVH *next = nullptr;
+        Float next_t = 0;
+        for (int i = 0; i < count; i++) {
+            if (nodes[i]) {
+                visits++;
+                if (!nodes[i]->_BoundsAt(s).Intersect(r, tmin, tmax, t_enter, t_exit))
+                    continue;
+                // Visit the near node next, the far one later
+                if (!next) {
+                    next = nodes[i];
+                    next_t = t_enter;
+                }
+                else {
+                    stack[stack_size++] = {nodes[i], t_enter};
+                }
+            }
+            else if (AnyHit) {
+                if (children[i]->Occluded(r, tmin, tmax)) {
+                    hit = true;
+                    break;
+                }
+            }
+            else if (children[i]->Intersect(r, tmin, tmax, *rec)) {
+                hit = true;
+                tmax = rec->t;
+                rec->primitive = children[i];
+            }
+        }
+        if (AnyHit && hit)
+            break;
+
+        // Skip the nodes entered beyond the closest hit
+        node = (next && next_t <= tmax) ? next : nullptr;
+        while (!node && stack_size > 0) {
+            const StackEntry &entry = stack[--stack_size];
+            if (entry.t <= tmax)
+                node = entry.node;
+        }
+    }
 
-    return hit_left || hit_right;
+    counts.nodes += visits;
+    return hit;
 }
 
 
@@ -172,37 +404,19 @@ Triangle::Triangle(const shared_ptr<TriangleMesh> &mesh, int index, shared_ptr<M
 }
 
 
-bool Triangle::Intersect(const Ray& r, Float tmin, Float tmax, Intersection& rec) const {
-    // Get Vertices pos
-    const Point &p0 = _mesh->vp[_index[0]];
-    const Point &p1 = _mesh->vp[_index[1]];
-    const Point &p2 = _mesh->vp[_index[2]];
+bool Triangle::_Hit(const Ray& r, Float tmin, Float tmax, Float &t, Float &u, Float &v) const {
+    return TriangleHit(_mesh->vp[_index[0]], _mesh->vp[_index[1]], _mesh->vp[_index[2]], r, tmin, tmax, t, u, v);
+}
 
-    Vec3 v0v1 = p1 - p0;
-    Vec3 v0v2 = p2 - p0;
-    Vec3 pvec = Cross(r.Direction(),v0v2);
-    float det = Dot(v0v1, pvec);
-#ifdef CULLING
-    // if the determinant is negative the triangle is backfacing
-    // if the determinant is close to 0, the ray misses the triangle
-    if (det < MachineEpsilon) return false;
-#else
-//     // ray and triangle are parallel if det is close to 0
-//     if (fabs(det) < MachineEpsilon) return false;
-#endif
-    float invDet = 1 / det;
-
-    Vec3 tvec = r.Origin() - p0;
-    Float u = Dot(tvec, pvec) * invDet;
-    if (u < 0 || u > 1) return false;
-
-    Vec3 qvec = Cross(tvec, v0v1);
-    Float v = Dot(r.Direction(), qvec) * invDet;
-    if (v < 0 || u + v > 1) return false;
-    
-    Float t = Dot(v0v2, qvec) * invDet;
-    // Exit is t is not between min and max
-    if (t < tmin || t > tmax) return false;
+bool Triangle::Occluded(const Ray& r, Float tmin, Float tmax) const {
+    Float t, u, v;
+    return _Hit(r, tmin, tmax, t, u, v);
+}
+
+bool Triangle::Intersect(const Ray& r, Float tmin, Float tmax, Intersection& rec) const {
+    Float t, u, v;
+    if (!_Hit(r, tmin, tmax, t, u, v))
+        return false;
 
     // Set intersection info
     rec.t = t;
@@ -216,7 +430,8 @@ bool Triangle::Intersect(const Ray& r, Float tmin, Float tmax, Intersection& rec
     const Normal &n0 = _mesh->vn[_index[0]];
     const Normal &n1 = _mesh->vn[_index[1]];
     const Normal &n2 = _mesh->vn[_index[2]];
-    Vec3 nn = u*n1 + v*n2 + (1-u-v)*n0;
+    // Interpolated normals are shorter than 1, the materials expect unit ones
+    Vec3 nn = Normalize(u*n1 + v*n2 + (1-u-v)*n0);
     rec.SetFaceNormal(r, nn);
 
     return true;
@@ -243,35 +458,255 @@ bool Triangle::BoundingBox(Float t0, Float t1, BBox& output_box) const {
     return true;
 }
 
+bool Triangle::Emission(Color &radiance, LightBounds &bounds) const {
+    radiance = material->Emitted();
+    if (MaxComponent(radiance) <= 0)
+        return false;
+    bounds = TriangleEmitterBounds(_mesh->vp[_index[0]], _mesh->vp[_index[1]], _mesh->vp[_index[2]], radiance);
+    return true;
+}
+
+bool Triangle::SampleDirection(const Point &p, Float u, Float v, Vec3 &wi, Float &distance, Float &pdf) const {
+    return SampleTriangleDirection(_mesh->vp[_index[0]], _mesh->vp[_index[1]], _mesh->vp[_index[2]],
+                                   p, u, v, wi, distance, pdf);
+}
+
+Float Triangle::DirectionPdf(const Point &p, const Point &q) const {
+    return TriangleDirectionPdf(_mesh->vp[_index[0]], _mesh->vp[_index[1]], _mesh->vp[_index[2]], p, q);
+}
+
 
 // Triangle & Triangle Mesh Utilities
 
-TriangleMesh::TriangleMesh(int nTriangles_, std::vector<int> &&vertexIndices_, std::vector<Point> &&vp_, std::vector<Normal> &&vn_) : 
-                                nTriangles(nTriangles_) {
+TriangleMesh::TriangleMesh(int nTriangles_, std::vector<int> &&vertexIndices_, std::vector<Point> &&vp_, std::vector<Normal> &&vn_,
+                           Float crease_angle, int max_threads) : nTriangles(nTriangles_), creaseAngle(crease_angle) {
     vertexIndices = std::move(vertexIndices_);
     vp = std::move(vp_);
     vn = std::move(vn_);
 
     // Create normals if they don't exist
     if (vp.size() != vn.size()) {
-        // Clear vn and resize it to vp
-        vn.clear();
-        vn.resize(vp.size());
-        // For each triangle
-        for (int i=0; i<nTriangles; i++) {
-            // Get vertex positions
-            const Point &p0 = vp[vertexIndices[i*3+0]];
-            const Point &p1 = vp[vertexIndices[i*3+1]];
-            const Point &p2 = vp[vertexIndices[i*3+2]];
-
-            Vec3 v0v1 = p1 - p0;
-            Vec3 v0v2 = p2 - p0;
-            Vec3 norm = Normalize(Cross(v0v1,v0v2));
-            vn[vertexIndices[i*3+0]] = norm;
-            vn[vertexIndices[i*3+1]] = norm;
-            vn[vertexIndices[i*3+2]] = norm;
+        Timer timer;
+        timer.Start();
+        CreateNormals(max_threads);
+        timer.Stop();
+        std::cout << " - Normals created in: ";
+        timer.Print();
+        std::cout << "\n";
+    }
+}
+
+void TriangleMesh::UpdateVertices(std::vector<Point> &&vp_, std::vector<Normal> &&vn_, int max_threads) {
+    // The new vertices are the obj ones
+    _MergeSplitVertices();
+    vp = std::move(vp_);
+    vn = std::move(vn_);
+    if (vp.size() != vn.size())
+        CreateNormals(max_threads);
+}
+
+bool TriangleMesh::SameFaces(const std::vector<int> &indices) const {
+    if (indices.size() != vertexIndices.size())
+        return false;
+    int nObjVertices = vp.size() - splitVertices.size();
+    for (size_t i = 0; i < indices.size(); i++) {
+        int v = vertexIndices[i];
+        if (v >= nObjVertices)
+            v = splitVertices[v - nObjVertices];
+        if (v != indices[i])
+            return false;
+    }
+    return true;
+}
+
+void TriangleMesh::_MergeSplitVertices() {
+    int nObjVertices = vp.size() - splitVertices.size();
+    for (int &v : vertexIndices) {
+        if (v >= nObjVertices)
+            v = splitVertices[v - nObjVertices];
+    }
+    vp.resize(nObjVertices);
+    splitVertices.clear();
+}
+
+// Angle between two edges from the length of their cross product and their dot product
+// It's only used as a weight so std::atan2 is replaced by a polynomial approximation
+// of atan on [0, 1] (1e-5 max error) and needs no square root
+static Float _Angle(Float cross, Float dot) {
+    Float x = std::abs(dot);
+    Float hi = Max(cross, x);
+    if (hi == 0)
+        return 0;
+    Float z = Min(cross, x) / hi;
+    Float z2 = z * z;
+    Float angle = z * (0.99997726f + z2 * (-0.33262347f + z2 * (0.19354346f + z2 * (-0.11643287f
+                    + z2 * (0.05265332f - 0.01172120f * z2)))));
+    angle = (cross > x) ? Pi / 2 - angle : angle;
+    return (dot < 0) ? Pi - angle : angle;
+}
+
+void TriangleMesh::CreateNormals(int max_threads) {
+    _MergeSplitVertices();
+    const int threads = ThreadCount(max_threads);
+    const int block = 4096;
+    const int nVertices = vp.size();
+    const int nCorners = 3 * nTriangles;
+
+    // Normal of face f (its length is twice the face area) & angles of its corners
+    auto face_weights = [this](int f, Vec3 &normal, Float angles[3]) {
+        const Point &p0 = vp[vertexIndices[3*f + 0]];
+        const Point &p1 = vp[vertexIndices[3*f + 1]];
+        const Point &p2 = vp[vertexIndices[3*f + 2]];
+        Vec3 v0v1 = p1 - p0;
+        Vec3 v0v2 = p2 - p0;
+        Vec3 v1v2 = p2 - p1;
+        normal = Cross(v0v1, v0v2);
+        // The cross product of any two edges has the same length
+        Float cross = normal.Length();
+        angles[0] = _Angle(cross, Dot(v0v1, v0v2));
+        angles[1] = _Angle(cross, -Dot(v0v1, v1v2));
+        angles[2] = Pi - angles[0] - angles[1];
+    };
+    auto normalize = [](const Vec3 &n) { return n.LengthSquared() > 0 ? Normalize(n) : Normal(0, 0, 1); };
+
+    vn.clear();
+    vn.resize(nVertices);
+    // Unit face normals, corners are weighted by area * angle
+    // Each face is computed once, then the vertices gather their corners
+    std::vector<Vec3> face_normals(nTriangles);
+    std::vector<Float> weights(nCorners);
+    ParallelForBlocks(nTriangles, block, threads, [&](int begin, int end) {
+        for (int f = begin; f < end; f++) {
+            Vec3 normal;
+            face_weights(f, normal, &weights[3*f]);
+            Float len = normal.Length();
+            face_normals[f] = len > 0 ? normal / len : normal;
+            for (int k = 0; k < 3; k++)
+                weights[3*f + k] *= len;
         }
+    });
+
+    // Corners around each vertex, in face order
+    // The corners of vertex v are corners[offsets[v]] to corners[offsets[v+1]-1]
+    std::vector<int> offsets(nVertices + 1, 0);
+    for (int v : vertexIndices)
+        offsets[v + 1]++;
+    for (int v = 0; v < nVertices; v++)
+        offsets[v + 1] += offsets[v];
+    std::vector<int> corners(nCorners);
+    {
+        std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+        for (int c = 0; c < nCorners; c++)
+            corners[fill[vertexIndices[c]]++] = c;
+    }
+    auto weighted = [&](int c) { return face_normals[c / 3] * weights[c]; };
+
+    if (creaseAngle >= 180) {
+        // Smooth: every face around a vertex contributes to its normal, summed
+        // in face order so the result doesn't depend on the threads
+        ParallelForBlocks(nVertices, block, threads, [&](int begin, int end) {
+            for (int v = begin; v < end; v++) {
+                Vec3 sum;
+                for (int s = offsets[v]; s < offsets[v + 1]; s++)
+                    sum += weighted(corners[s]);
+                vn[v] = normalize(sum);
+            }
+        });
+        return;
     }
+
+    // With a crease angle, the normal of a corner only sums the faces around
+    // its vertex that are within the crease angle of its face
+    // Corner normals of vertex v (in corners order) and the group of each corner
+    // Corners with the same normal are a group sharing a vertex
+    // Returns the number of groups
+    const Float cos_crease = std::cos(Radians(creaseAngle));
+    auto corner_groups = [&](int v, std::vector<Vec3> &normals, std::vector<int> &groups) {
+        int first = offsets[v], degree = offsets[v + 1] - first;
+        normals.assign(degree, Vec3());
+        groups.assign(degree, 0);
+        int count = 0;
+        for (int i = 0; i < degree; i++) {
+            const Vec3 &face = face_normals[corners[first + i] / 3];
+            for (int j = 0; j < degree; j++) {
+                if (Dot(face, face_normals[corners[first + j] / 3]) >= cos_crease)
+                    normals[i] += weighted(corners[first + j]);
+            }
+            // Same sums over the same faces are bit identical
+            groups[i] = count;
+            for (int j = 0; j < i; j++) {
+                if (normals[j] == normals[i]) {
+                    groups[i] = groups[j];
+                    break;
+                }
+            }
+            if (groups[i] == count)
+                count++;
+        }
+        return count;
+    };
+
+    // Number of vertices each vertex is split in, minus one
+    const Float cos_half_crease = std::cos(Radians(creaseAngle / 2));
+    std::vector<int> extra_vertices(nVertices + 1, 0);
+    ParallelForBlocks(nVertices, block, threads, [&](int begin, int end) {
+        std::vector<Vec3> normals;
+        std::vector<int> groups;
+        for (int v = begin; v < end; v++) {
+            // Most vertices are smooth: when all the faces are within half the
+            // crease angle of their average, they are all within the crease
+            // angle of each other and there's no need to compare every pair
+            Vec3 sum;
+            for (int s = offsets[v]; s < offsets[v + 1]; s++)
+                sum += weighted(corners[s]);
+            Float len = sum.Length();
+            bool smooth = true;
+            for (int s = offsets[v]; smooth && s < offsets[v + 1]; s++)
+                smooth = Dot(face_normals[corners[s] / 3], sum) >= cos_half_crease * len;
+            if (smooth) {
+                vn[v] = normalize(sum);
+                continue;
+            }
+            int count = corner_groups(v, normals, groups);
+            if (count == 1)
+                vn[v] = normalize(normals[0]);
+            else
+                extra_vertices[v + 1] = count - 1;
+        }
+    });
+    for (int v = 0; v < nVertices; v++)
+        extra_vertices[v + 1] += extra_vertices[v];
+
+    // The first group keeps the vertex, the other ones get new vertices
+    int nSplit = extra_vertices[nVertices];
+    if (nSplit == 0)
+        return;
+    vp.resize(nVertices + nSplit);
+    vn.resize(nVertices + nSplit);
+    splitVertices.resize(nSplit);
+    ParallelForBlocks(nVertices, block, threads, [&](int begin, int end) {
+        std::vector<Vec3> normals;
+        std::vector<int> groups;
+        for (int v = begin; v < end; v++) {
+            if (extra_vertices[v + 1] == extra_vertices[v])
+                continue;
+            corner_groups(v, normals, groups);
+            for (int i = 0; i < offsets[v + 1] - offsets[v]; i++) {
+                int vertex = v;
+                if (groups[i] > 0) {
+                    vertex = nVertices + extra_vertices[v] + groups[i] - 1;
+                    vp[vertex] = vp[v];
+                    splitVertices[vertex - nVertices] = v;
+                    vertexIndices[corners[offsets[v] + i]] = vertex;
+                }
+                vn[vertex] = normalize(normals[i]);
+            }
+        }
+    });
+}
+
+size_t TriangleMesh::MemoryUsage() const {
+    return sizeof(*this) + vertexIndices.size() * sizeof(int) + vp.size() * sizeof(Point) + vn.size() * sizeof(Normal);
 }
 
 
@@ -280,11 +715,12 @@ TriangleMesh::TriangleMesh(int nTriangles_, std::vector<int> &&vertexIndices_, s
 std::vector<shared_ptr<Primitive>> CreateTriangleMesh(
     int nTriangles, std::vector<int> &&vertexIndices, 
     std::vector<Point> &&vp, std::vector<Normal> &&vn,
-    shared_ptr<Material> material) {
+    shared_ptr<Material> material, Float crease_angle, int max_threads) {
 
     std::cout << " - Creating TriangleMesh: " << nTriangles << " triangles, " << vp.size() << " vertices\n";
 
-    shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>( nTriangles, std::move(vertexIndices), std::move(vp), std::move(vn) );
+    shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>( nTriangles, std::move(vertexIndices), std::move(vp), std::move(vn),
+                                                                    crease_angle, max_threads );
     std::vector<shared_ptr<Primitive>> tris;
 
     // shared_ptr<Material> mat = make_shared<EmissiveMaterial>(Color(1, 0.2, 0.5));
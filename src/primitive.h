@@ -1,12 +1,15 @@
 #pragma once
 
 #include <vector>
+#include <atomic>
 
 #include "nray.h"
 
 #include "geometry.h"
 #include "material.h"
 #include "bbox.h"
+#include "lights.h"
+#include "vec3a.h"
 
 /* Interesction stores all the data related to 
 a Ray hitting (intersecting) a surface (Primitive)
@@ -17,6 +20,8 @@ struct Intersection {
     Normal normal;
     shared_ptr<Material> material;
     bool front_face{false};
+    // Leaf primitive that was hit, set by the containers
+    const Primitive *primitive{nullptr};
 
     void SetFaceNormal(const Ray& r, const Normal& outward_normal) {
         front_face = Dot(r.Direction(), outward_normal) < 0;
@@ -33,6 +38,31 @@ class Primitive {
         // can be intersected and we can get its bounding box
         virtual bool Intersect(const Ray& r, Float t_min, Float t_max, Intersection& rec) const = 0;
         virtual bool BoundingBox(Float t0, Float t1, BBox& output_box) const = 0;
+
+        // Any hit query: returns true if r hits something between t_min and t_max
+        // Stops at the first hit and doesn't compute the intersection data,
+        // it's meant for shadow rays, ambient occlusion & visibility tests
+        virtual bool Occluded(const Ray& r, Float t_min, Float t_max) const {
+            Intersection rec;
+            return Intersect(r, t_min, t_max, rec);
+        }
+
+        // Emitters, sampled by the LightBVH (see lights.h)
+        // Radiance & bounds of the light emitted, returns false if the
+        // primitive doesn't emit or can't be sampled
+        virtual bool Emission(Color &radiance, LightBounds &bounds) const {
+            return false;
+        }
+        // Samples a direction from p toward a point of the primitive,
+        // with its density (in solid angle) & the distance to the point
+        virtual bool SampleDirection(const Point &p, Float u, Float v, Vec3 &wi, Float &distance, Float &pdf) const {
+            return false;
+        }
+        // Density SampleDirection samples the direction from p to q with,
+        // q being a point of the primitive
+        virtual Float DirectionPdf(const Point &p, const Point &q) const {
+            return 0;
+        }
 };
 
 // Primitive List Container
@@ -50,6 +80,13 @@ class PrimitiveList: public Primitive  {
 
         virtual bool Intersect(const Ray& r, Float tmin, Float tmax, Intersection& rec) const;
         virtual bool BoundingBox(Float t0, Float t1, BBox& output_box) const;
+        virtual bool Occluded(const Ray& r, Float tmin, Float tmax) const;
+
+        const std::vector<shared_ptr<Primitive>>& Objects() const { return _objects; }
+
+        // Appends the leaf primitives (the ones that aren't containers),
+        // in traversal order. The SBVH can list a primitive more than once
+        virtual void Leaves(std::vector<const Primitive*> &leaves) const;
 
     
     private:
@@ -68,6 +105,11 @@ class Sphere: public Primitive  {
 
         virtual bool Intersect(const Ray& r, Float tmin, Float tmax, Intersection& rec) const;
         virtual bool BoundingBox(Float t0, Float t1, BBox& output_box) const;
+        virtual bool Occluded(const Ray& r, Float tmin, Float tmax) const;
+
+        virtual bool Emission(Color &radiance, LightBounds &bounds) const;
+        virtual bool SampleDirection(const Point &p, Float u, Float v, Vec3 &wi, Float &distance, Float &pdf) const;
+        virtual Float DirectionPdf(const Point &p, const Point &q) const;
 
         Point center;
         Float radius;
@@ -75,6 +117,45 @@ class Sphere: public Primitive  {
 };
 
 
+// BVH builders
+enum class BVHType
+{
+    Median,  // Median split along a random axis
+    Spatial  // SAH with spatial splits (SBVH)
+};
+
+// BVH traversal counts of one thread
+struct BVHCounts {
+    uint64_t traversals{0};
+    // Number of nodes whose box was tested
+    uint64_t nodes{0};
+};
+
+// BVH traversal statistics, shared by all the BVH
+struct BVHStats {
+    // Counted by each thread, added to the totals by Flush once per tile
+    inline static thread_local BVHCounts local;
+
+    std::atomic<uint64_t> traversals{0};
+    std::atomic<uint64_t> nodes{0};
+
+    // Adds the counts of the calling thread to the totals
+    void Flush() {
+        if (local.traversals == 0)
+            return;
+        traversals.fetch_add(local.traversals, std::memory_order_relaxed);
+        nodes.fetch_add(local.nodes, std::memory_order_relaxed);
+        local = BVHCounts();
+    }
+
+    void Print() const {
+        if (traversals == 0)
+            return;
+        std::cout << "\nBVH: " << traversals << " traversals, "
+                  << nodes / (Float)traversals << " nodes visited per traversal\n";
+    }
+};
+
 // BVH Container
 class BVH : public PrimitiveList {
     public:
@@ -83,14 +164,59 @@ class BVH : public PrimitiveList {
 
         BVH( std::vector<shared_ptr<Primitive>>& objects,
              size_t start, size_t end, Float time0, Float time1 );
+        // Node over already built children (used by the SBVH builder)
+        // box bounds them over [time0, time1], clipped by the spatial splits
+        BVH( shared_ptr<Primitive> left, shared_ptr<Primitive> right, const BBox &box, int axis,
+             Float time0, Float time1 );
 
         virtual bool Intersect(const Ray& r, Float tmin, Float tmax, Intersection& rec) const;
         virtual bool BoundingBox(Float t0, Float t1, BBox& output_box) const;
+        virtual bool Occluded(const Ray& r, Float tmin, Float tmax) const;
+
+        virtual void Leaves(std::vector<const Primitive*> &leaves) const;
+
+        // Recomputes the boxes bottom-up after the primitives moved
+        // The tree topology is kept, subtrees are refitted in parallel
+        void Refit(int threads);
+
+        inline static BVHStats stats;
+
+        // Maximum depth of the traversal stack
+        static constexpr int MaxDepth = 64;
     
     private:
+        // Front to back traversal, the near child is chosen from the split
+        // axis & the ray direction sign and the far one is pushed on a stack
+        // with its entry distance. Stops at the first hit if AnyHit
+        template <bool AnyHit>
+        bool _Traverse(const Ray& r, Float tmin, Float tmax, Intersection *rec) const;
+
+        // Sets the traversal data of the children
+        void _LinkChildren();
+        // Serial refit of the subtree
+        void _Refit();
+        // Sets the boxes from the children ones
+        void _UpdateBounds();
+        // Position of time in the interval, from 0 (time0) to 1 (time1)
+        Float _IntervalPosition(Float time) const;
+        // Box at a position in the interval
+        BBox _BoundsAt(Float s) const;
+
         shared_ptr<Primitive> _left;
         shared_ptr<Primitive> _right;
+        // Children that are BVH nodes (nullptr for leaves)
+        BVH *_leftNode{nullptr};
+        BVH *_rightNode{nullptr};
+        // Axis the children were sorted along
+        int _axis{0};
+        int _depth{1};
+        // Boxes at the start & end of the time interval, the
+        // box of a ray is interpolated between them from its time
         BBox _bbox;
+        BBox _bbox1;
+        Float _time0{0};
+        Float _time1{0};
+        bool _moving{false};
 };
 
 // BVH Utility functions
@@ -102,18 +228,74 @@ bool _BBoxCompareZ(const shared_ptr<Primitive> a, const shared_ptr<Primitive> b)
 
 // Triangle & TriangleMesh
 struct TriangleMesh {
-    TriangleMesh(int nTriangles_, std::vector<int> &&vertexIndices_, std::vector<Point> &&vp_, std::vector<Normal> &&vn_);
+    // Missing normals are created with CreateNormals, faces meeting
+    // at more than crease_angle (in degrees) don't share their normals
+    TriangleMesh(int nTriangles_, std::vector<int> &&vertexIndices_, std::vector<Point> &&vp_, std::vector<Normal> &&vn_,
+                 Float crease_angle = 180, int max_threads = -1);
+
+    // Replaces the vertices, the topology stays the same
+    void UpdateVertices(std::vector<Point> &&vp_, std::vector<Normal> &&vn_, int max_threads = -1);
+    // Creates smooth vertex normals from the faces (on up to max_threads, see ThreadCount)
+    // Each face contributes its normal weighted by its area and the angle of
+    // its corner. Vertices where faces meet at more than the crease angle
+    // are split, one copy per group of faces
+    void CreateNormals(int max_threads = -1);
+    // True if indices (as read from the obj) are the faces of the mesh
+    bool SameFaces(const std::vector<int> &indices) const;
+
+    // Bytes used by the faces & vertices
+    size_t MemoryUsage() const;
 
     const int nTriangles;
+    Float creaseAngle;
     std::vector<int> vertexIndices;
     std::vector<Point> vp; // Vertices positions
     std::vector<Point> vn; // Vertices normals
+    // Obj vertex of the vertices added by the crease splits,
+    // they are stored after the obj ones
+    std::vector<int> splitVertices;
     // unique_ptr<Vec3[]> s;
     // unique_ptr<Vec2[]> uv;
     // std::shared_ptr<Texture<Float>> alphaMask, shadowAlphaMask;
 
+    private:
+        // Points the faces back to the obj vertices & removes the split ones
+        void _MergeSplitVertices();
 };
 
+// Ray/triangle test (Moller-Trumbore, using Vec3A to keep the math in SSE registers)
+// Sets the distance and the barycentric coordinates of the hit
+inline bool TriangleHit(const Vec3A &p0, const Vec3A &p1, const Vec3A &p2, const Ray& r,
+                        Float tmin, Float tmax, Float &t, Float &u, Float &v) {
+    Vec3A dir = r.Direction();
+
+    Vec3A v0v1 = p1 - p0;
+    Vec3A v0v2 = p2 - p0;
+    Vec3A pvec = Cross(dir, v0v2);
+    float det = Dot(v0v1, pvec);
+#ifdef CULLING
+    // if the determinant is negative the triangle is backfacing
+    // if the determinant is close to 0, the ray misses the triangle
+    if (det < MachineEpsilon) return false;
+#else
+//     // ray and triangle are parallel if det is close to 0
+//     if (fabs(det) < MachineEpsilon) return false;
+#endif
+    float invDet = 1 / det;
+
+    Vec3A tvec = Vec3A(r.Origin()) - p0;
+    u = Dot(tvec, pvec) * invDet;
+    if (u < 0 || u > 1) return false;
+
+    Vec3A qvec = Cross(tvec, v0v1);
+    v = Dot(dir, qvec) * invDet;
+    if (v < 0 || u + v > 1) return false;
+    
+    t = Dot(v0v2, qvec) * invDet;
+    // Exit is t is not between min and max
+    return t >= tmin && t <= tmax;
+}
+
 class Triangle : public Primitive {
     public:
         // Triangle(const shared_ptr<TriangleMesh> &mesh, int index, shared_ptr<Material> mat) : _mesh(mesh), material(mat) { _index = &mesh->vertexIndices[3*index]; }
@@ -121,6 +303,11 @@ class Triangle : public Primitive {
 
         virtual bool Intersect(const Ray& r, Float tmin, Float tmax, Intersection& rec) const;
         virtual bool BoundingBox(Float t0, Float t1, BBox& output_box) const;
+        virtual bool Occluded(const Ray& r, Float tmin, Float tmax) const;
+
+        virtual bool Emission(Color &radiance, LightBounds &bounds) const;
+        virtual bool SampleDirection(const Point &p, Float u, Float v, Vec3 &wi, Float &distance, Float &pdf) const;
+        virtual Float DirectionPdf(const Point &p, const Point &q) const;
 
         shared_ptr<TriangleMesh> Mesh() { return _mesh;};
         int * Index() { return _index;}
@@ -128,6 +315,9 @@ class Triangle : public Primitive {
         shared_ptr<Material> material;
     
     private:
+        // Ray/triangle test, sets the distance and barycentric coordinates
+        bool _Hit(const Ray& r, Float tmin, Float tmax, Float &t, Float &u, Float &v) const;
+
         shared_ptr<TriangleMesh> _mesh;
         //const int *_index;
         int *_index;
@@ -139,4 +329,4 @@ class Triangle : public Primitive {
 std::vector<shared_ptr<Primitive>> CreateTriangleMesh(
     int nTriangles, std::vector<int> &&vertexIndices, 
     std::vector<Point> &&vp, std::vector<Normal> &&vn,
-    shared_ptr<Material> material );
\ No newline at end of file
+    shared_ptr<Material> material, Float crease_angle = 180, int max_threads = -1 );
\ No newline at end of file
@@ -0,0 +1,202 @@
+#include "sampler.h"
+
+
+SamplerType ToSamplerType(std::string const &str) {
+    if (str == "independent")
+        return SamplerType::Independent;
+    else if (str == "stratified")
+        return SamplerType::Stratified;
+    else if (str == "sobol")
+        return SamplerType::Sobol;
+    else if (str == "bluenoise")
+        return SamplerType::BlueNoise;
+
+    return SamplerType::Unknown;
+}
+
+char const *SamplerTypeName(SamplerType type) {
+    switch (type) {
+        case SamplerType::Independent : return "independent";
+        case SamplerType::Stratified : return "stratified";
+        case SamplerType::Sobol : return "sobol";
+        case SamplerType::BlueNoise : return "bluenoise";
+        default : return "unknown";
+    }
+}
+
+unique_ptr<Sampler> CreateSampler(SamplerType type, int samplesPerPixel, uint64_t seed) {
+    switch (type) {
+        case SamplerType::Stratified :
+            return make_unique<StratifiedSampler>(samplesPerPixel, seed);
+        case SamplerType::Sobol :
+            return make_unique<SobolSampler>(samplesPerPixel, seed);
+        case SamplerType::BlueNoise :
+            return make_unique<BlueNoiseSampler>(samplesPerPixel, seed);
+        default :
+            return make_unique<IndependentSampler>(samplesPerPixel, seed);
+    }
+}
+
+
+uint64_t Sampler::_DimensionHash() const {
+    uint64_t pixel = (uint64_t(uint32_t(_x)) << 32) | uint32_t(_y);
+    return Hash(pixel, _dim, _seed);
+}
+
+
+// Independent Sampler
+
+void IndependentSampler::StartPixelSample(int x, int y, int index) {
+    Sampler::StartPixelSample(x, y, index);
+    uint64_t pixel = (uint64_t(uint32_t(x)) << 32) | uint32_t(y);
+    _state = Hash(pixel, index, _seed);
+}
+
+Float IndependentSampler::Get1D() {
+    // SplitMix64 step
+    _state += 0x9e3779b97f4a7c15;
+    _dim++;
+    return BitsToFloat(uint32_t(MixBits(_state) >> 32));
+}
+
+void IndependentSampler::Get2D(Float &u, Float &v) {
+    u = Get1D();
+    v = Get1D();
+}
+
+
+// Stratified Sampler
+
+StratifiedSampler::StratifiedSampler(int samplesPerPixel, uint64_t seed) : Sampler(samplesPerPixel, seed) {
+    // Closest grid holding at least samplesPerPixel cells
+    _nx = Max(1, (int)std::sqrt((Float)samplesPerPixel));
+    _ny = (samplesPerPixel + _nx - 1) / _nx;
+}
+
+Float StratifiedSampler::Get1D() {
+    uint64_t h = _DimensionHash();
+    int stratum = PermutationElement(_index % _spp, _spp, uint32_t(h));
+    Float jitter = BitsToFloat(uint32_t(Hash(h, _index, 1)));
+    _dim++;
+    return (stratum + jitter) / _spp;
+}
+
+void StratifiedSampler::Get2D(Float &u, Float &v) {
+    uint64_t h = _DimensionHash();
+    int n = _nx * _ny;
+    int stratum = PermutationElement(_index % n, n, uint32_t(h));
+    uint64_t jitter = Hash(h, _index, 2);
+    u = Min(((stratum % _nx) + BitsToFloat(uint32_t(jitter))) / _nx, OneMinusEpsilon);
+    v = Min(((stratum / _nx) + BitsToFloat(uint32_t(jitter >> 32))) / _ny, OneMinusEpsilon);
+    _dim += 2;
+}
+
+
+// Sobol Sampler
+
+Float SobolSampler::Get1D() {
+    uint64_t h = _DimensionHash();
+    uint32_t index = OwenScramble(_index, uint32_t(h));
+    _dim++;
+    return BitsToFloat(OwenScramble(SobolSample(index, 0), uint32_t(h >> 32)));
+}
+
+void SobolSampler::Get2D(Float &u, Float &v) {
+    uint64_t h = _DimensionHash();
+    uint32_t index = OwenScramble(_index, uint32_t(h));
+    uint64_t h2 = MixBits(h);
+    u = BitsToFloat(OwenScramble(SobolSample(index, 0), uint32_t(h2)));
+    v = BitsToFloat(OwenScramble(SobolSample(index, 1), uint32_t(h2 >> 32)));
+    _dim += 2;
+}
+
+
+// Blue Noise Sampler
+
+Float BlueNoiseSampler::_Mask(int dim) const {
+    // R2 sequence dither mask, shifted differently for every dimension
+    uint64_t h = Hash(dim, _seed, 0x5bd1e995);
+    double x = _x + double(h & 0xffff);
+    double y = _y + double((h >> 16) & 0xffff);
+    double m = 0.7548776662466927 * x + 0.5698402909980532 * y;
+    return Float(m - std::floor(m));
+}
+
+Float BlueNoiseSampler::Get1D() {
+    // Same points for every pixel, only the dimension changes the scrambling
+    uint64_t h = Hash(0, _dim, _seed);
+    uint32_t index = OwenScramble(_index, uint32_t(h));
+    Float u = BitsToFloat(OwenScramble(SobolSample(index, 0), uint32_t(h >> 32))) + _Mask(_dim);
+    _dim++;
+    return Min(u - std::floor(u), OneMinusEpsilon);
+}
+
+void BlueNoiseSampler::Get2D(Float &u, Float &v) {
+    uint64_t h = Hash(0, _dim, _seed);
+    uint32_t index = OwenScramble(_index, uint32_t(h));
+    uint64_t h2 = MixBits(h);
+    u = BitsToFloat(OwenScramble(SobolSample(index, 0), uint32_t(h2))) + _Mask(_dim);
+    v = BitsToFloat(OwenScramble(SobolSample(index, 1), uint32_t(h2 >> 32))) + _Mask(_dim+1);
+    u = Min(u - std::floor(u), OneMinusEpsilon);
+    v = Min(v - std::floor(v), OneMinusEpsilon);
+    _dim += 2;
+}
+
+
+// Sampling utility functions
+
+int PermutationElement(uint32_t i, uint32_t l, uint32_t p) {
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+uint32_t OwenScramble(uint32_t x, uint32_t seed) {
+    // Hash based nested uniform scramble, works on the reversed bits
+    // so every bit only depends on the higher ones
+    x = ReverseBits32(x);
+    x ^= x * 0x3d20adea;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56;
+    x ^= x * 0x53a22864;
+    return ReverseBits32(x);
+}
+
+uint32_t SobolSample(uint32_t index, int dim) {
+    // The first dimension is the van der Corput sequence
+    if (dim == 0)
+        return ReverseBits32(index);
+
+    // Second dimension, direction numbers are v_k = v_(k-1) ^ (v_(k-1) >> 1)
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1)
+            result ^= v;
+    }
+    return result;
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "nray.h"
+
+// Largest Float strictly smaller than 1
+constexpr Float OneMinusEpsilon = 0x1.fffffep-1;
+
+// Type of Sampler
+enum class SamplerType
+{
+    Independent,
+    Stratified,
+    Sobol,
+    BlueNoise,
+    Unknown
+};
+
+SamplerType ToSamplerType(std::string const &str);
+char const *SamplerTypeName(SamplerType type);
+
+
+// Sampler base class
+// A Sampler generates the random numbers used to render one pixel sample
+// Each call to Get1D/Get2D consumes the next dimension(s) of the current
+// sample, so a given pixel sample always uses the same dimensions
+// for its pixel position, lens position, time and then for each bounce
+class Sampler {
+    public:
+        Sampler(int samplesPerPixel, uint64_t seed) : _spp(samplesPerPixel), _seed(seed) {}
+        virtual ~Sampler() {}
+
+        // Starts sample number index of pixel (x, y)
+        // and resets the dimension counter
+        virtual void StartPixelSample(int x, int y, int index) {
+            _x = x; _y = y;
+            _index = index;
+            _dim = 0;
+        }
+
+        // Returns a sample in [0,1)
+        virtual Float Get1D() = 0;
+        // Returns a 2D sample in [0,1)^2
+        virtual void Get2D(Float &u, Float &v) = 0;
+
+        int SamplesPerPixel() const { return _spp; }
+
+    protected:
+        // Hash of the current pixel, dimension and seed
+        uint64_t _DimensionHash() const;
+
+        int _spp{1};
+        uint64_t _seed{0};
+        int _x{0};
+        int _y{0};
+        int _index{0};
+        int _dim{0};
+};
+
+
+// Independent Sampler
+// Uniform random values, no stratification at all
+class IndependentSampler : public Sampler {
+    public:
+        IndependentSampler(int samplesPerPixel, uint64_t seed) : Sampler(samplesPerPixel, seed) {}
+
+        void StartPixelSample(int x, int y, int index);
+        Float Get1D();
+        void Get2D(Float &u, Float &v);
+
+    private:
+        uint64_t _state{0};
+};
+
+
+// Stratified Sampler
+// Every dimension is split in pixel_samples strata (2D dimensions use a
+// jittered grid), each sample of the pixel picks a different stratum
+// through a per pixel and per dimension random permutation
+class StratifiedSampler : public Sampler {
+    public:
+        StratifiedSampler(int samplesPerPixel, uint64_t seed);
+
+        Float Get1D();
+        void Get2D(Float &u, Float &v);
+
+    private:
+        int _nx{1};
+        int _ny{1};
+};
+
+
+// Sobol Sampler
+// Owen scrambled Sobol (0,2) sequence, padded across dimension pairs
+// by shuffling the sample index per pixel and per dimension
+class SobolSampler : public Sampler {
+    public:
+        SobolSampler(int samplesPerPixel, uint64_t seed) : Sampler(samplesPerPixel, seed) {}
+
+        Float Get1D();
+        void Get2D(Float &u, Float &v);
+};
+
+
+// Blue Noise Sampler
+// Every pixel uses the same scrambled Sobol points, toroidally shifted by
+// a per pixel blue noise dither mask. Neighbouring pixels get
+// complementary samples so the remaining error is pushed to high frequencies
+class BlueNoiseSampler : public Sampler {
+    public:
+        BlueNoiseSampler(int samplesPerPixel, uint64_t seed) : Sampler(samplesPerPixel, seed) {}
+
+        Float Get1D();
+        void Get2D(Float &u, Float &v);
+
+    private:
+        // Dither mask value of the current pixel for the given dimension
+        Float _Mask(int dim) const;
+};
+
+
+// Creates a sampler of the given type
+unique_ptr<Sampler> CreateSampler(SamplerType type, int samplesPerPixel, uint64_t seed=0);
+
+
+// Sampling utility functions
+
+// Mixes the bits of a 64 bit integer
+inline uint64_t MixBits(uint64_t v) {
+    v ^= (v >> 31);
+    v *= 0x7fb5d329728ea185;
+    v ^= (v >> 27);
+    v *= 0x81dadef4bc2dd44d;
+    v ^= (v >> 33);
+    return v;
+}
+
+inline uint64_t Hash(uint64_t a, uint64_t b, uint64_t c) {
+    return MixBits(a ^ MixBits(b ^ MixBits(c)));
+}
+
+// Converts 32 random bits to a Float in [0,1)
+inline Float BitsToFloat(uint32_t bits) {
+    return Min(bits * 0x1p-32f, OneMinusEpsilon);
+}
+
+inline uint32_t ReverseBits32(uint32_t n) {
+    n = (n << 16) | (n >> 16);
+    n = ((n & 0x00ff00ff) << 8) | ((n & 0xff00ff00) >> 8);
+    n = ((n & 0x0f0f0f0f) << 4) | ((n & 0xf0f0f0f0) >> 4);
+    n = ((n & 0x33333333) << 2) | ((n & 0xcccccccc) >> 2);
+    n = ((n & 0x55555555) << 1) | ((n & 0xaaaaaaaa) >> 1);
+    return n;
+}
+
+// Returns the i-th element of a random permutation of [0, l)
+// (Kensler, Correlated Multi-Jittered Sampling)
+int PermutationElement(uint32_t i, uint32_t l, uint32_t p);
+
+// Nested uniform (Owen) scrambling of the bits of x
+// (Burley, Practical Hash-based Owen Scrambling)
+uint32_t OwenScramble(uint32_t x, uint32_t seed);
+
+// Returns the first (dim=0) or second (dim=1) dimension of the
+// Sobol sequence as 32 bits fixed point
+uint32_t SobolSample(uint32_t index, int dim);
@@ -0,0 +1,152 @@
+#include "sampling.h"
+#include "geometry.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define NRAY_SAMPLING_SSE
+#endif
+
+// The SSE code paths work on 4 packed Floats
+static_assert(sizeof(Float) == sizeof(float), "Batch sampling expects Float to be float");
+
+
+#ifdef NRAY_SAMPLING_SSE
+
+namespace {
+
+inline __m128 Select(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+inline __m128 Abs(__m128 a) {
+    return _mm_andnot_ps(_mm_set1_ps(-0.f), a);
+}
+
+inline __m128 CopySign(__m128 mag, __m128 sign) {
+    const __m128 sign_bit = _mm_set1_ps(-0.f);
+    return _mm_or_ps(_mm_andnot_ps(sign_bit, mag), _mm_and_ps(sign_bit, sign));
+}
+
+// Sine & Cosine for a in [-Pi/4, Pi/4]
+// Taylor polynomials, max error ~3e-7 over that range
+inline void SinCosQuarterPi(__m128 a, __m128 &s, __m128 &c) {
+    __m128 a2 = _mm_mul_ps(a, a);
+    s = _mm_add_ps(_mm_set1_ps(1.f / 120.f), _mm_mul_ps(a2, _mm_set1_ps(-1.f / 5040.f)));
+    s = _mm_add_ps(_mm_set1_ps(-1.f / 6.f), _mm_mul_ps(a2, s));
+    s = _mm_add_ps(_mm_set1_ps(1.f), _mm_mul_ps(a2, s));
+    s = _mm_mul_ps(a, s);
+    c = _mm_add_ps(_mm_set1_ps(-1.f / 720.f), _mm_mul_ps(a2, _mm_set1_ps(1.f / 40320.f)));
+    c = _mm_add_ps(_mm_set1_ps(1.f / 24.f), _mm_mul_ps(a2, c));
+    c = _mm_add_ps(_mm_set1_ps(-1.f / 2.f), _mm_mul_ps(a2, c));
+    c = _mm_add_ps(_mm_set1_ps(1.f), _mm_mul_ps(a2, c));
+}
+
+// Divides a by b, returns 0 where b is 0
+inline __m128 SafeDiv(__m128 a, __m128 b) {
+    __m128 nonzero = _mm_cmpneq_ps(b, _mm_setzero_ps());
+    return _mm_and_ps(nonzero, _mm_div_ps(a, b));
+}
+
+inline void ConcentricSampleDisk4(__m128 u, __m128 v, __m128 &x, __m128 &y) {
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 two = _mm_set1_ps(2.f);
+    __m128 uo = _mm_sub_ps(_mm_mul_ps(two, u), one);
+    __m128 vo = _mm_sub_ps(_mm_mul_ps(two, v), one);
+
+    // Pick the wedge without branching
+    __m128 mask = _mm_cmpgt_ps(Abs(uo), Abs(vo));
+    __m128 r = Select(mask, uo, vo);
+    __m128 ratio = SafeDiv(Select(mask, vo, uo), r);
+    __m128 s, c;
+    SinCosQuarterPi(_mm_mul_ps(_mm_set1_ps(Pi / 4), ratio), s, c);
+
+    // theta = Pi/2 - phi in the second wedge, which swaps cos & sin
+    x = _mm_mul_ps(r, Select(mask, c, s));
+    y = _mm_mul_ps(r, Select(mask, s, c));
+}
+
+inline void UniformSampleSphere4(__m128 u, __m128 v, __m128 &x, __m128 &y, __m128 &z) {
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 two = _mm_set1_ps(2.f);
+    __m128 uo = _mm_sub_ps(_mm_mul_ps(two, u), one);
+    __m128 vo = _mm_sub_ps(_mm_mul_ps(two, v), one);
+    __m128 up = Abs(uo);
+    __m128 vp = Abs(vo);
+    __m128 signed_distance = _mm_sub_ps(one, _mm_add_ps(up, vp));
+    __m128 r = _mm_sub_ps(one, Abs(signed_distance));
+    __m128 r2 = _mm_mul_ps(r, r);
+
+    // phi - Pi/4 stays within [-Pi/4, Pi/4]
+    __m128 s, c;
+    SinCosQuarterPi(_mm_mul_ps(_mm_set1_ps(Pi / 4), SafeDiv(_mm_sub_ps(vp, up), r)), s, c);
+    const __m128 inv_sqrt2 = _mm_set1_ps(0.70710678118654752f);
+    __m128 cos_phi = _mm_mul_ps(_mm_sub_ps(c, s), inv_sqrt2);
+    __m128 sin_phi = _mm_mul_ps(_mm_add_ps(c, s), inv_sqrt2);
+
+    __m128 rxy = _mm_mul_ps(r, _mm_sqrt_ps(_mm_max_ps(_mm_setzero_ps(), _mm_sub_ps(two, r2))));
+    x = _mm_mul_ps(CopySign(cos_phi, uo), rxy);
+    y = _mm_mul_ps(CopySign(sin_phi, vo), rxy);
+    z = CopySign(_mm_sub_ps(one, r2), signed_distance);
+}
+
+} // namespace
+
+#endif
+
+
+void ConcentricSampleDisk(int n, const Float *u, const Float *v, Float *x, Float *y) {
+    int i = 0;
+#ifdef NRAY_SAMPLING_SSE
+    for (; i + 4 <= n; i += 4) {
+        __m128 px, py;
+        ConcentricSampleDisk4(_mm_loadu_ps(u + i), _mm_loadu_ps(v + i), px, py);
+        _mm_storeu_ps(x + i, px);
+        _mm_storeu_ps(y + i, py);
+    }
+#endif
+    for (; i < n; i++) {
+        Vec3 p = ConcentricSampleDisk<Float>(u[i], v[i]);
+        x[i] = p.x;
+        y[i] = p.y;
+    }
+}
+
+void CosineSampleHemisphere(int n, const Float *u, const Float *v, Float *x, Float *y, Float *z) {
+    int i = 0;
+#ifdef NRAY_SAMPLING_SSE
+    for (; i + 4 <= n; i += 4) {
+        __m128 px, py;
+        ConcentricSampleDisk4(_mm_loadu_ps(u + i), _mm_loadu_ps(v + i), px, py);
+        __m128 d2 = _mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py));
+        __m128 pz = _mm_sqrt_ps(_mm_max_ps(_mm_setzero_ps(), _mm_sub_ps(_mm_set1_ps(1.f), d2)));
+        _mm_storeu_ps(x + i, px);
+        _mm_storeu_ps(y + i, py);
+        _mm_storeu_ps(z + i, pz);
+    }
+#endif
+    for (; i < n; i++) {
+        Vec3 d = CosineSampleHemisphere<Float>(u[i], v[i]);
+        x[i] = d.x;
+        y[i] = d.y;
+        z[i] = d.z;
+    }
+}
+
+void UniformSampleSphere(int n, const Float *u, const Float *v, Float *x, Float *y, Float *z) {
+    int i = 0;
+#ifdef NRAY_SAMPLING_SSE
+    for (; i + 4 <= n; i += 4) {
+        __m128 px, py, pz;
+        UniformSampleSphere4(_mm_loadu_ps(u + i), _mm_loadu_ps(v + i), px, py, pz);
+        _mm_storeu_ps(x + i, px);
+        _mm_storeu_ps(y + i, py);
+        _mm_storeu_ps(z + i, pz);
+    }
+#endif
+    for (; i < n; i++) {
+        Vec3 d = UniformSampleSphere<Float>(u[i], v[i]);
+        x[i] = d.x;
+        y[i] = d.y;
+        z[i] = d.z;
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// Batch sampling functions
+// Map n samples at once, reading and writing structure of
+// arrays buffers. They use SSE (4 samples per instruction)
+// when available and fall back to the scalar functions of geometry.h
+
+#include "nray.h"
+
+// Points in the unit disk, from 2D samples (u[i], v[i])
+void ConcentricSampleDisk(int n, const Float *u, const Float *v, Float *x, Float *y);
+
+// Cosine weighted directions around +z, from 2D samples (u[i], v[i])
+void CosineSampleHemisphere(int n, const Float *u, const Float *v, Float *x, Float *y, Float *z);
+
+// Unit vectors, from 2D samples (u[i], v[i])
+void UniformSampleSphere(int n, const Float *u, const Float *v, Float *x, Float *y, Float *z);
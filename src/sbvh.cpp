@@ -0,0 +1,350 @@
+#include <algorithm>
+#include <cmath>
+
+#include "sbvh.h"
+
+
+namespace {
+
+// Growable box, empty until a point is added
+struct Bounds {
+    Vec3 min{Infinity, Infinity, Infinity};
+    Vec3 max{-Infinity, -Infinity, -Infinity};
+
+    Bounds() {}
+    Bounds(const BBox &box) : min(box.Min()), max(box.Max()) {}
+
+    bool Empty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+
+    void Grow(const Vec3 &p) {
+        min = Vec3(Min(min.x, p.x), Min(min.y, p.y), Min(min.z, p.z));
+        max = Vec3(Max(max.x, p.x), Max(max.y, p.y), Max(max.z, p.z));
+    }
+
+    void Grow(const Bounds &b) {
+        if (b.Empty())
+            return;
+        Grow(b.min);
+        Grow(b.max);
+    }
+
+    Bounds Intersect(const Bounds &b) const {
+        Bounds out;
+        out.min = Vec3(Max(min.x, b.min.x), Max(min.y, b.min.y), Max(min.z, b.min.z));
+        out.max = Vec3(Min(max.x, b.max.x), Min(max.y, b.max.y), Min(max.z, b.max.z));
+        return out;
+    }
+
+    Float Area() const {
+        if (Empty())
+            return 0;
+        Vec3 d = max - min;
+        return 2*(d.x*d.y + d.y*d.z + d.z*d.x);
+    }
+
+    Vec3 Centroid() const { return (min + max) * (Float)0.5; }
+
+    BBox ToBBox() const { return BBox(min, max); }
+};
+
+// Part of a primitive inside a node
+struct Reference {
+    int index;
+    Bounds box;
+};
+
+// Best partition found for a node
+struct Split {
+    Float cost{Infinity};
+    int axis{0};
+    // Object splits: centroids below pos go left
+    // Spatial splits: plane position
+    Float pos{0};
+    bool spatial{false};
+    // Children boxes
+    Bounds left, right;
+};
+
+
+class SBVHBuilder {
+    public:
+        SBVHBuilder(const std::vector<shared_ptr<Primitive>> &objects, Float time0, Float time1, Float max_growth)
+            : _objects(objects), _time0(time0), _time1(time1) {
+            _maxReferences = objects.size() * (1 + Max(max_growth, (Float)0));
+            _triangles.reserve(objects.size());
+            for (auto &object : objects)
+                _triangles.push_back(dynamic_cast<Triangle *>(object.get()));
+        }
+
+        shared_ptr<BVH> Build() {
+            std::vector<Reference> refs;
+            refs.reserve(_maxReferences);
+            Bounds box;
+            for (size_t i = 0; i < _objects.size(); i++) {
+                BBox b;
+                if (!_objects[i]->BoundingBox(_time0, _time1, b))
+                    std::cerr << "No BBox in SBVH Constructor.\n";
+                refs.push_back({(int)i, Bounds(b)});
+                box.Grow(refs.back().box);
+            }
+            _numReferences = refs.size();
+            _rootArea = box.Area();
+
+            shared_ptr<Primitive> root = _Build(refs, box, 1);
+            // The root always is a BVH node
+            shared_ptr<BVH> bvh = std::dynamic_pointer_cast<BVH>(root);
+            if (!bvh)
+                bvh = make_shared<BVH>(root, root, box.ToBBox(), 0, _time0, _time1);
+
+            std::cout << "SBVH: " << _objects.size() << " primitives, " << _numReferences << " references, "
+                      << _spatialSplits << " spatial splits\n";
+            return bvh;
+        }
+
+    private:
+        shared_ptr<Primitive> _Build(std::vector<Reference> &refs, const Bounds &box, int depth);
+        Split _ObjectSplit(const std::vector<Reference> &refs) const;
+        Split _SpatialSplit(const std::vector<Reference> &refs, const Bounds &box) const;
+        // Grows out by the part of ref between lo and hi along axis
+        void _Clip(const Reference &ref, int axis, Float lo, Float hi, Bounds &out) const;
+
+        // Number of bins of the SAH sweeps
+        static constexpr int NumBins = 16;
+        // Spatial splits are only tried when the children of the best object
+        // split overlap by more than this fraction of the root area
+        static constexpr Float SpatialAlpha = 1e-5;
+
+        const std::vector<shared_ptr<Primitive>> &_objects;
+        // Triangle view of the objects, nullptr for other primitives
+        std::vector<Triangle *> _triangles;
+        Float _time0, _time1;
+        size_t _maxReferences{0};
+        size_t _numReferences{0};
+        int _spatialSplits{0};
+        Float _rootArea{0};
+};
+
+
+shared_ptr<Primitive> SBVHBuilder::_Build(std::vector<Reference> &refs, const Bounds &box, int depth) {
+    if (refs.size() == 1)
+        return _objects[refs[0].index];
+
+    // Find the cheapest partition
+    Split split = _ObjectSplit(refs);
+    Float overlap = split.left.Intersect(split.right).Area();
+    if (_numReferences < _maxReferences && overlap > SpatialAlpha * _rootArea) {
+        Split spatial = _SpatialSplit(refs, box);
+        if (spatial.cost < split.cost)
+            split = spatial;
+    }
+
+    // Partition the references
+    std::vector<Reference> left, right;
+    if (split.spatial) {
+        for (const Reference &ref : refs) {
+            if (ref.box.max[split.axis] <= split.pos)
+                left.push_back(ref);
+            else if (ref.box.min[split.axis] >= split.pos)
+                right.push_back(ref);
+            else {
+                // Straddling reference, each side gets its clipped part
+                Reference l{ref.index, Bounds()}, r{ref.index, Bounds()};
+                _Clip(ref, split.axis, -Infinity, split.pos, l.box);
+                _Clip(ref, split.axis, split.pos, Infinity, r.box);
+                if (!l.box.Empty())
+                    left.push_back(l);
+                if (!r.box.Empty())
+                    right.push_back(r);
+                if (!l.box.Empty() && !r.box.Empty())
+                    _numReferences++;
+            }
+        }
+        _spatialSplits++;
+    }
+    else if (split.cost < Infinity) {
+        for (const Reference &ref : refs)
+            (ref.box.Centroid()[split.axis] < split.pos ? left : right).push_back(ref);
+    }
+
+    // Median split when the SAH failed to partition the references
+    // or the tree would get deeper than the traversal stack
+    int median_depth = (int)std::ceil(std::log2((Float)refs.size()));
+    if (left.empty() || right.empty() || depth + median_depth >= BVH::MaxDepth) {
+        int axis = box.ToBBox().LongestAxis();
+        auto mid = refs.begin() + refs.size() / 2;
+        std::nth_element(refs.begin(), mid, refs.end(), [axis](const Reference &a, const Reference &b) {
+            return a.box.Centroid()[axis] < b.box.Centroid()[axis];
+        });
+        left.assign(refs.begin(), mid);
+        right.assign(mid, refs.end());
+        split.axis = axis;
+    }
+    std::vector<Reference>().swap(refs);
+
+    Bounds left_box, right_box;
+    for (const Reference &ref : left)
+        left_box.Grow(ref.box);
+    for (const Reference &ref : right)
+        right_box.Grow(ref.box);
+
+    shared_ptr<Primitive> left_child = _Build(left, left_box, depth + 1);
+    shared_ptr<Primitive> right_child = _Build(right, right_box, depth + 1);
+    return make_shared<BVH>(left_child, right_child, box.ToBBox(), split.axis, _time0, _time1);
+}
+
+Split SBVHBuilder::_ObjectSplit(const std::vector<Reference> &refs) const {
+    Split best;
+    Bounds centroids;
+    for (const Reference &ref : refs)
+        centroids.Grow(ref.box.Centroid());
+
+    for (int axis = 0; axis < 3; axis++) {
+        Float lo = centroids.min[axis];
+        Float extent = centroids.max[axis] - lo;
+        if (extent <= 0)
+            continue;
+
+        // Bin the references by centroid
+        Bounds bins[NumBins];
+        int counts[NumBins] = {0};
+        Float scale = NumBins / extent;
+        for (const Reference &ref : refs) {
+            int b = Min((int)((ref.box.Centroid()[axis] - lo) * scale), NumBins - 1);
+            bins[b].Grow(ref.box);
+            counts[b]++;
+        }
+
+        // Sweep from the right to get the right side areas
+        Float right_area[NumBins];
+        int right_count[NumBins];
+        Bounds acc;
+        int count = 0;
+        for (int b = NumBins - 1; b > 0; b--) {
+            acc.Grow(bins[b]);
+            count += counts[b];
+            right_area[b] = acc.Area();
+            right_count[b] = count;
+        }
+
+        // Then from the left, evaluating the SAH at each bin boundary
+        acc = Bounds();
+        count = 0;
+        for (int b = 1; b < NumBins; b++) {
+            acc.Grow(bins[b - 1]);
+            count += counts[b - 1];
+            if (count == 0 || right_count[b] == 0)
+                continue;
+            Float cost = acc.Area() * count + right_area[b] * right_count[b];
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.pos = lo + b / scale;
+                best.spatial = false;
+            }
+        }
+    }
+
+    // Children boxes of the best split
+    if (best.cost < Infinity) {
+        for (const Reference &ref : refs)
+            (ref.box.Centroid()[best.axis] < best.pos ? best.left : best.right).Grow(ref.box);
+    }
+    return best;
+}
+
+Split SBVHBuilder::_SpatialSplit(const std::vector<Reference> &refs, const Bounds &box) const {
+    Split best;
+    for (int axis = 0; axis < 3; axis++) {
+        Float lo = box.min[axis];
+        Float extent = box.max[axis] - lo;
+        if (extent <= 0)
+            continue;
+
+        // Chop the references into the bins they overlap
+        Bounds bins[NumBins];
+        int entries[NumBins] = {0};
+        int exits[NumBins] = {0};
+        Float width = extent / NumBins;
+        auto bin_of = [&](Float x) { return Clamp((int)((x - lo) / width), 0, NumBins - 1); };
+        for (const Reference &ref : refs) {
+            int first = bin_of(ref.box.min[axis]);
+            int last = bin_of(ref.box.max[axis]);
+            entries[first]++;
+            exits[last]++;
+            if (first == last) {
+                bins[first].Grow(ref.box);
+                continue;
+            }
+            for (int b = first; b <= last; b++)
+                _Clip(ref, axis, lo + b * width, lo + (b + 1) * width, bins[b]);
+        }
+
+        Float right_area[NumBins];
+        int right_count[NumBins];
+        Bounds acc;
+        int count = 0;
+        for (int b = NumBins - 1; b > 0; b--) {
+            acc.Grow(bins[b]);
+            count += exits[b];
+            right_area[b] = acc.Area();
+            right_count[b] = count;
+        }
+
+        acc = Bounds();
+        count = 0;
+        for (int b = 1; b < NumBins; b++) {
+            acc.Grow(bins[b - 1]);
+            count += entries[b - 1];
+            if (count == 0 || right_count[b] == 0)
+                continue;
+            Float cost = acc.Area() * count + right_area[b] * right_count[b];
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.pos = lo + b * width;
+                best.spatial = true;
+            }
+        }
+    }
+    return best;
+}
+
+void SBVHBuilder::_Clip(const Reference &ref, int axis, Float lo, Float hi, Bounds &out) const {
+    Bounds clipped;
+    Triangle *tri = _triangles[ref.index];
+    if (tri) {
+        // Vertices inside the slab & edges crossing its planes
+        const int *index = tri->Index();
+        const std::vector<Point> &vp = tri->Mesh()->vp;
+        for (int i = 0; i < 3; i++) {
+            const Point &a = vp[index[i]];
+            const Point &b = vp[index[(i + 1) % 3]];
+            if (a[axis] >= lo && a[axis] <= hi)
+                clipped.Grow(a);
+            for (Float plane : {lo, hi}) {
+                if ((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane)) {
+                    Point p = a + (b - a) * ((plane - a[axis]) / (b[axis] - a[axis]));
+                    p[axis] = plane;
+                    clipped.Grow(p);
+                }
+            }
+        }
+        clipped = clipped.Intersect(ref.box);
+    }
+    else {
+        // Other primitives are clipped by their box
+        clipped = ref.box;
+        clipped.min[axis] = Max(clipped.min[axis], lo);
+        clipped.max[axis] = Min(clipped.max[axis], hi);
+    }
+    out.Grow(clipped);
+}
+
+} // namespace
+
+
+shared_ptr<BVH> CreateSBVH(const std::vector<shared_ptr<Primitive>> &objects,
+                           Float time0, Float time1, Float max_growth) {
+    SBVHBuilder builder(objects, time0, time1, max_growth);
+    return builder.Build();
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+// Spatial split BVH (Stich et al. 2009)
+// SAH builder that, on top of the usual object partitions, can split
+// the primitive references across a plane when the children boxes
+// would overlap too much (long & thin triangles, large floors...)
+// A primitive can then be referenced by several leaves, each one
+// bounded by the part of the primitive on its side of the planes
+
+#include <vector>
+
+#include "nray.h"
+#include "primitive.h"
+
+// Builds a SBVH over objects
+// The number of references is limited to (1 + max_growth) * objects.size()
+shared_ptr<BVH> CreateSBVH(const std::vector<shared_ptr<Primitive>> &objects,
+                           Float time0, Float time1, Float max_growth);
@@ -1,58 +1,160 @@
-
+#include <algorithm>
 
 #include "scene.h"
 #include "parser.h"
 
 #include "image.h"
 #include "implicit.h"
+#include "timer.h"
+#include "denoiser.h"
+
+// Power heuristic weight of a sample of density pdf_a, when pdf_b
+// could have sampled it as well
+static Float PowerHeuristic(Float pdf_a, Float pdf_b) {
+    Float a = pdf_a * pdf_a, b = pdf_b * pdf_b;
+    return a / (a + b);
+}
+
+// Light reaching rec from a sample of the bright parts of the environment
+// Weighted against the material sampling the same direction
+static Color EnvironmentLight(const Ray& r, const Intersection& rec, Scene *scene, Sampler &sampler) {
+    Float u, v;
+    sampler.Get2D(u, v);
+    Vec3 wi;
+    Float light_pdf;
+    Color light = scene->ibl->Sample(u, v, wi, light_pdf);
+    if (light_pdf <= 0)
+        return Color(0,0,0);
+    Float bsdf_pdf;
+    Color f = rec.material->Eval(rec, wi, bsdf_pdf);
+    if (bsdf_pdf <= 0)
+        return Color(0,0,0);
+    if (scene->World()->Occluded(Ray(rec.p, wi, RayType::Diffuse, r.Time()), 0.001, Infinity))
+        return Color(0,0,0);
+    return f * light * (PowerHeuristic(light_pdf, bsdf_pdf) / light_pdf);
+}
+
+// Light reaching rec from a point of an emitter, picked by the light BVH
+// Weighted against the material sampling the same direction
+static Color EmitterLight(const Ray& r, const Intersection& rec, const LightBVH &lights, Scene *scene, Sampler &sampler) {
+    Float pick = sampler.Get1D();
+    Float u, v;
+    sampler.Get2D(u, v);
+    Float pmf;
+    const LightBVH::Emitter *emitter = lights.Sample(rec.p, rec.normal, pick, pmf);
+    if (!emitter)
+        return Color(0,0,0);
+    Vec3 wi;
+    Float distance, light_pdf;
+    if (!emitter->primitive->SampleDirection(rec.p, u, v, wi, distance, light_pdf) || !(light_pdf > 0))
+        return Color(0,0,0);
+    light_pdf *= pmf;
+    Float bsdf_pdf;
+    Color f = rec.material->Eval(rec, wi, bsdf_pdf);
+    if (bsdf_pdf <= 0)
+        return Color(0,0,0);
+    // Stops short of the emitter, it would hide itself
+    if (scene->World()->Occluded(Ray(rec.p, wi, RayType::Diffuse, r.Time()), 0.001, distance * (1 - 1e-3f)))
+        return Color(0,0,0);
+    return f * emitter->radiance * (PowerHeuristic(light_pdf, bsdf_pdf) / light_pdf);
+}
 
-Color Trace(const Ray& r, Scene *scene, int depth) {
-
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    // if (depth <= 0) {
-    //     // If we're color at Ray Limit
-    //     if (scene->Settings().useBgColorAtLimit)
-    //         return scene->SampleEnvironment(r);
-    //     return Color(0,0,0);
-    // }
-
-    // Check if we've exceeded the max ray depth
-    int max = 0;
-    switch (r.Type()) {
-        case RayType::Primary :
-            max = 999999;
+Color Trace(const Ray& r, Scene *scene, Sampler &sampler, Float pixel_spread, AovSample *aov) {
+
+    // Read the depth limits once for the whole path
+    // They are indexed by RayType, Primary rays have no limit
+    const RenderSettings &opt = scene->Settings();
+    const int max_depth[4] = { 0, opt.max_diffuse_rdepth, opt.max_reflect_rdepth, opt.max_refract_rdepth };
+    int depth[4] = { 0, 0, 0, 0 };
+
+    Color radiance(0,0,0);
+    Color throughput(1,1,1);
+    Ray ray = r;
+    // The environment lookups are filtered over the footprint of the ray:
+    // the pixel for camera rays, a part of the lobe for glossy ones
+    // Each of the pixel samples covers about 1/sqrt(samples) of its width
+    const Float sample_share = 1 / std::sqrt((Float)opt.pixel_samples);
+    Float spread = pixel_spread * sample_share;
+    // Density the last diffuse bounce was sampled with, its environment
+    // & emitters light is shared with their sampling (0 otherwise)
+    Float bsdf_pdf = 0;
+    // Point & normal the emitters were sampled from
+    Point last_p;
+    Normal last_normal;
+    const LightBVH *lights = scene->lights && scene->lights->Size() > 0 ? scene->lights.get() : nullptr;
+
+    for (int bounce = 0; ; bounce++) {
+        Intersection rec;
+        // If no intersection is found gather the environment color
+        if (!scene->World()->Intersect(ray, 0.001, Infinity, rec)) {
+            Color environment = scene->SampleEnvironment(ray, spread);
+            if (bsdf_pdf > 0 && scene->ibl)
+                environment *= PowerHeuristic(bsdf_pdf, scene->ibl->Pdf(Normalize(ray.Direction())));
+            radiance += throughput * environment;
             break;
-        case RayType::Diffuse :
-            max = scene->Settings().max_diffuse_rdepth;
+        }
+        if (aov && bounce == 0) {
+            aov->albedo = rec.material->Albedo();
+            aov->normal = Normalize(rec.normal);
+            aov->depth = rec.t * ray.Direction().Length();
+            aov->primitive = rec.primitive;
+        }
+
+        // Scatter light
+        Ray scattered;
+        Color attenuation;
+        Color emitted = rec.material->Emitted();
+        if (bsdf_pdf > 0 && lights && MaxComponent(emitted) > 0) {
+            Float light_pdf = lights->Pmf(last_p, last_normal, rec.primitive);
+            if (light_pdf > 0)
+                light_pdf *= rec.primitive->DirectionPdf(last_p, rec.p);
+            emitted *= PowerHeuristic(bsdf_pdf, light_pdf);
+        }
+        radiance += throughput * emitted;
+        if (!rec.material->Scatter(ray, rec, attenuation, scattered, sampler))
             break;
-        case RayType::Reflect :
-            max = scene->Settings().max_reflect_rdepth;
+        Color incoming = throughput;
+        throughput *= attenuation;
+
+        // Check if we've exceeded the max ray depth for this type of ray
+        int type = static_cast<int>(scattered.Type());
+        if (++depth[type] > max_depth[type]) {
+            // If we're color at Ray Limit
+            if (opt.useBgColorAtLimit)
+                radiance += throughput * scene->SampleEnvironment(scattered);
             break;
-        case RayType::Refract :
-            max = scene->Settings().max_refract_rdepth;
+        }
+
+        // Diffuse bounces also sample the environment & the emitters directly
+        bsdf_pdf = 0;
+        spread = rec.material->Spread() * sample_share;
+        if ((scene->ibl || lights) && scattered.Type() == RayType::Diffuse) {
+            if (scene->ibl)
+                radiance += incoming * EnvironmentLight(ray, rec, scene, sampler);
+            if (lights) {
+                radiance += incoming * EmitterLight(ray, rec, *lights, scene, sampler);
+                last_p = rec.p;
+                last_normal = rec.normal;
+            }
+            rec.material->Eval(rec, scattered.Direction(), bsdf_pdf);
+        }
+
+        // Russian roulette: randomly kill low contribution paths and
+        // boost the surviving ones so the estimate stays unbiased
+        Float max_throughput = MaxComponent(throughput);
+        if (max_throughput <= 0)
             break;
-    }
-    if (depth > max) {
-        // If we're color at Ray Limit
-        if (scene->Settings().useBgColorAtLimit)
-            return scene->SampleEnvironment(r);
-        return Color(0,0,0);
-    }
+        if (opt.rr_min_depth >= 0 && bounce >= opt.rr_min_depth) {
+            Float survive = Min(max_throughput, (Float)0.95);
+            if (sampler.Get1D() >= survive)
+                break;
+            throughput /= survive;
+        }
 
-    Intersection rec;
-    // If no intersection is found return the environment color
-    if (!scene->World()->Intersect(r, 0.001, Infinity, rec)) {
-        return scene->SampleEnvironment(r);
+        ray = scattered;
     }
 
-    // Scatter light
-    Ray scattered;
-    Color attenuation;
-    Color emitted = rec.material->Emitted();
-    if (!rec.material->Scatter(r, rec, attenuation, scattered))
-        return emitted;
-    // return emitted + attenuation * Trace(scattered, scene, depth-1);
-    return emitted + attenuation * Trace(scattered, scene, depth+1);
+    return radiance;
 }
 
 Color TraceNormalOnly(const Ray& r, Scene *scene) {
@@ -67,39 +169,122 @@ Color TraceNormalOnly(const Ray& r, Scene *scene) {
     return Color(0,0,0);
 }
 
+Color TraceAmbientOcclusion(const Ray& r, Scene *scene, Sampler &sampler) {
+    Intersection rec;
+    if (!scene->World()->Intersect(r, 0.001, Infinity, rec))
+        return Color(1,1,1);
+
+    // Cosine weighted directions around the normal
+    const RenderSettings &opt = scene->Settings();
+    Vec3 s, t;
+    CoordinateSystem(rec.normal, &s, &t);
+    int visible = 0;
+    for (int i = 0; i < opt.ao_samples; i++) {
+        Float u, v;
+        sampler.Get2D(u, v);
+        Vec3 d = CosineSampleHemisphere<Float>(u, v);
+        Ray ao(rec.p, s * d.x + t * d.y + rec.normal * d.z, RayType::Diffuse, r.Time());
+        if (!scene->World()->Occluded(ao, 0.001, opt.ao_distance))
+            visible++;
+    }
+    Float ao = visible / (Float)opt.ao_samples;
+    return Color(ao, ao, ao);
+}
+
 
 Scene::Scene(const Scene& other) {
     _camera = other._camera;
     _world = other._world;
     _options = other._options;
-    _img = other._img;
     ibl = other.ibl;
+    lights = other.lights;
+    cameras = other.cameras;
+    motion_open = other.motion_open;
+    motion_close = other.motion_close;
+    implicits = other.implicits;
+    animated = other.animated;
+    files = other.files;
+    pool = other.pool;
 }
 Scene::Scene(Scene&& other) {
     _camera = other._camera;
     _world = std::move(other._world);
     _options = other._options;
-    _img = std::move(other._img);
     ibl = std::move(other.ibl);
+    lights = std::move(other.lights);
+    cameras = std::move(other.cameras);
+    motion_open = other.motion_open;
+    motion_close = other.motion_close;
+    implicits = std::move(other.implicits);
+    animated = std::move(other.animated);
+    files = std::move(other.files);
+    pool = std::move(other.pool);
 }
 Scene& Scene::operator=(const Scene& other) {
     _camera = other._camera;
     _world = other._world;
     _options = other._options;
-    _img = other._img;
     ibl = other.ibl;
+    lights = other.lights;
+    cameras = other.cameras;
+    motion_open = other.motion_open;
+    motion_close = other.motion_close;
+    implicits = other.implicits;
+    animated = other.animated;
+    files = other.files;
+    pool = other.pool;
     return *this;
 }
 Scene& Scene::operator=(Scene&& other) {
     _camera = other._camera;
     _world = std::move(other._world);
     _options = other._options;
-    _img = std::move(other._img);
     ibl = std::move(other.ibl);
+    lights = std::move(other.lights);
+    cameras = std::move(other.cameras);
+    motion_open = other.motion_open;
+    motion_close = other.motion_close;
+    implicits = std::move(other.implicits);
+    animated = std::move(other.animated);
+    files = std::move(other.files);
+    pool = std::move(other.pool);
     return *this;
 }
 
 
+// Buffers guiding the denoiser, rendered even if they aren't written
+static const unsigned DenoiserGuides = (1u << static_cast<int>(Aov::Albedo)) | (1u << static_cast<int>(Aov::Normal)) |
+                                       (1u << static_cast<int>(Aov::Depth)) | (1u << static_cast<int>(Aov::Variance));
+
+Aov ToAov(std::string const &str) {
+    for (int i = 0; i < AovCount; i++) {
+        if (str == AovName(static_cast<Aov>(i)))
+            return static_cast<Aov>(i);
+    }
+    return Aov::Count;
+}
+
+char const *AovName(Aov aov) {
+    switch (aov) {
+        case Aov::Albedo : return "albedo";
+        case Aov::Normal : return "normal";
+        case Aov::Depth : return "depth";
+        case Aov::PrimitiveId : return "primid";
+        case Aov::Samples : return "samples";
+        case Aov::Variance : return "variance";
+        default : return "unknown";
+    }
+}
+
+std::string AovPath(std::string const &image_path, Aov aov) {
+    auto ext = image_path.rfind('.');
+    auto dir = image_path.find_last_of("/\\");
+    if (ext == std::string::npos || (dir != std::string::npos && ext < dir))
+        ext = image_path.size();
+    return image_path.substr(0, ext) + "_" + AovName(aov) + ".pfm";
+}
+
+
 bool Scene::_getNextTile(int &tile) {
     // Returns true if a tile was given
     // false if there's no more tile in the queue
@@ -108,44 +293,143 @@ bool Scene::_getNextTile(int &tile) {
         return false;
     tile = _tilesToRender.front();
     _tilesToRender.pop();
+    if (_png) {
+        // Wait for the rows above to be written, bounding the memory
+        int row = tile / _numTilesWidth;
+        _rowWritten.wait(lck, [&] { return row < _nextRow + _maxRows; });
+        if (_rows.find(row) == _rows.end()) {
+            TileRow &tile_row = _rows.emplace(row, TileRow{Image(_options.image_width, _options.tile_size), _numTilesWidth}).first->second;
+            _AllocateAovs(tile_row.aovs, _options.image_width, _options.tile_size);
+        }
+    }
     return true;
 }
 
+void Scene::_TileDone(int tile) {
+    std::unique_lock<std::mutex> lck(_mtx);
+    _rows[tile / _numTilesWidth].remaining--;
+    // A single thread writes, the others go on rendering
+    if (_writing)
+        return;
+    _writing = true;
+    for (auto row = _rows.find(_nextRow); row != _rows.end() && row->second.remaining == 0; row = _rows.find(_nextRow)) {
+        TileRow done = std::move(row->second);
+        _rows.erase(row);
+        lck.unlock();
+        _png->WriteRows(done.image, _options.tile_size);
+        for (int i = 0; i < AovCount; i++) {
+            if (_aovWriters[i])
+                _aovWriters[i]->WriteRows(done.aovs[i], _options.tile_size);
+        }
+        lck.lock();
+        _nextRow++;
+        _rowWritten.notify_all();
+    }
+    _writing = false;
+}
+
 
 void Scene::_RenderTile() {
+    // Every thread owns its sampler
+    unique_ptr<Sampler> sampler = CreateSampler(_options.sampler, _options.pixel_samples);
     int tile_number;
     // Run until there's no more tiles left to render
     while(_getNextTile(tile_number)) {
+        // The tiles are numbered view by view
+        View &view = _views[tile_number / _numTilesView];
+        int view_tile = tile_number % _numTilesView;
+
         // Get the start & end pixel position of the tile
         int tsize = _options.tile_size;
-        int start_x = (tile_number % _numTilesWidth) * tsize;
+        int start_x = (view_tile % _numTilesWidth) * tsize;
         int end_x = start_x + tsize;
         
-        int start_y = (tile_number / _numTilesWidth) * tsize;
+        int start_y = (view_tile / _numTilesWidth) * tsize;
         int end_y = start_y + tsize;
 
+        // Streamed renders write each row of tiles to its own image
+        Image *target = &view.image;
+        Image *aovs = view.aovs;
+        int target_y = 0;
+        if (_png) {
+            std::unique_lock<std::mutex> lck(_mtx);
+            TileRow &row = _rows[view_tile / _numTilesWidth];
+            target = &row.image;
+            aovs = row.aovs;
+            target_y = start_y;
+        }
+        // AOVs only come with the beauty render
+        const bool fill_aovs = _aovMask != 0;
+
         // For every pixel in the tile
         for (int y = start_y; y< end_y; y++) {
             for (int x = start_x; x< end_x; x++) {
+                // Outside the crop or the mask, kept black
+                if (!Rendered(x, y))
+                    continue;
                 Color color;
+                // Sums of the first hits, the primitive is the first sample's
+                Color albedo, normal;
+                Float depth = 0, luminance = 0, luminance2 = 0;
+                const Primitive *primitive = nullptr;
                 // For every sample
                 for (int s = 0; s < _options.pixel_samples; ++s) {
-                    Float u = (x + Rng::Rand01()) / _img.Width();
-                    Float v = 1.0 - (y + Rng::Rand01()) / _img.Height();
-                    Ray r = _camera.GetRay(u, v);
+                    sampler->StartPixelSample(x, y, s);
+                    Float px, py;
+                    sampler->Get2D(px, py);
+                    Float u = (x + px) / _options.image_width;
+                    Float v = 1.0 - (y + py) / _options.image_height;
+                    Ray r = view.camera.GetRay(u, v, *sampler);
                     if(_options.normalOnly){
                         color += TraceNormalOnly(r, this);
+                    } else if (_options.aoOnly) {
+                        color += TraceAmbientOcclusion(r, this, *sampler);
+                    } else if (fill_aovs) {
+                        AovSample aov;
+                        Color sample = ClampMax(Trace(r, this, *sampler, view.pixelSpread, &aov), _options.color_limit);
+                        color += sample;
+                        Float l = Luminance(sample);
+                        luminance += l;
+                        luminance2 += l * l;
+                        albedo += aov.albedo;
+                        normal += aov.normal;
+                        depth += aov.depth;
+                        if (s == 0)
+                            primitive = aov.primitive;
                     } else {
-                        // color += ClampMax(Trace(r, this, _options.max_ray_depth), _options.color_limit);
-                        color += ClampMax(Trace(r, this, 0), _options.color_limit);
+                        color += ClampMax(Trace(r, this, *sampler, view.pixelSpread), _options.color_limit);
                     }
                 }
                 color /= (Float) _options.pixel_samples;
 
-                _img.SetPixel(x, y, color);
+                target->SetPixel(x, y - target_y, color);
+                if (fill_aovs) {
+                    const int n = _options.pixel_samples;
+                    Float inv_samples = 1 / (Float)n;
+                    Float id = _PrimitiveId(primitive);
+                    // Sample variance over n, single samples only know their value
+                    Float mean = luminance * inv_samples;
+                    Float variance = n > 1 ? Max(luminance2 - n * mean * mean, (Float)0) / ((n - 1) * n) : mean * mean;
+                    const Color values[AovCount] = {
+                        albedo * inv_samples,
+                        normal * inv_samples,
+                        Color(depth, depth, depth) * inv_samples,
+                        Color(id, id, id),
+                        Color(1, 1, 1) * (Float)n,
+                        Color(variance, variance, variance)
+                    };
+                    for (int i = 0; i < AovCount; i++) {
+                        if (_aovMask & (1u << i))
+                            aovs[i].SetPixel(x, y - target_y, values[i]);
+                    }
+                }
             }
         }
+        ImplicitPrimitive::stats.Flush();
+        BVH::stats.Flush();
         _updateProgress();
+        if (_png)
+            _TileDone(tile_number);
     }
 }
 
@@ -161,35 +445,276 @@ void Scene::_updateProgress() {
 
 
 Image Scene::Render() {
+    return std::move(RenderViews({ _camera })[0]);
+}
 
-    // Initialize the image buffer
-    _img = Image(_options.image_width, _options.image_height);
+std::vector<Image> Scene::RenderViews(const std::vector<Camera> &cameras) {
+    _CheckShutters(cameras);
+
+    // Initialize the image buffers
+    _aovMask = _AovMask(_options.denoise);
+    _InitViews(cameras, true);
+    _InitRegion(true);
+    _RenderTiles();
+    _Denoise();
+
+    // Return the image buffers, the AOVs are kept
+    std::vector<Image> images;
+    for (View &view : _views)
+        images.push_back(std::move(view.image));
+    return images;
+}
+
+std::vector<Image> Scene::RenderPreviews(const std::vector<Camera> &cameras, int scale) {
+    // Previews show the whole image
+    RenderSettings options = _options;
+    _options.crop_x0 = _options.crop_x1 = 0;
+    _options.render_mask = nullptr;
+    _options.image_width = Max(options.image_width / scale, 1);
+    _options.image_height = Max(options.image_height / scale, 1);
+    _options.pixel_samples = 1;
+    _options.aovs = 0;
+    _options.denoise = false;
+    std::vector<Image> previews = RenderViews(cameras);
+    _options = options;
+
+    for (Image &preview : previews)
+        preview = preview.Resized(_options.image_width, _options.image_height);
+    return previews;
+}
+
+void Scene::_CheckShutters(const std::vector<Camera> &cameras) const {
+    for (const Camera &camera : cameras) {
+        Float open = camera.settings.shutter_open, close = camera.settings.shutter_close;
+        if (Min(open, close) < motion_open || Max(open, close) > motion_close)
+            throw std::runtime_error("Camera shutter " + std::to_string(open) + " " + std::to_string(close) +
+                                     " is outside the motion interval of the scene " +
+                                     std::to_string(motion_open) + " " + std::to_string(motion_close));
+    }
+}
+
+void Scene::_InitViews(const std::vector<Camera> &cameras, bool allocate) {
+    _views.clear();
+    _views.resize(cameras.size());
+    for (size_t i = 0; i < cameras.size(); i++) {
+        View &view = _views[i];
+        const Camera &camera = cameras[i];
+        view.camera = camera;
+        Vec3 center = camera.lower_left_corner + camera.horizontal * 0.5 + camera.vertical * 0.5 - camera.origin;
+        view.pixelSpread = camera.vertical.Length() / (center.Length() * _options.image_height);
+        if (allocate) {
+            view.image = Image(_options.image_width, _options.image_height);
+            _AllocateAovs(view.aovs, _options.image_width, _options.image_height);
+        }
+    }
+}
+
+void Scene::_InitRegion(bool enabled) {
+    _cropX0 = 0;
+    _cropY0 = 0;
+    _cropX1 = _options.image_width;
+    _cropY1 = _options.image_height;
+    _mask = Image();
+    if (!enabled)
+        return;
+    if (_options.crop_x1 > _options.crop_x0 && _options.crop_y1 > _options.crop_y0) {
+        _cropX0 = Clamp(_options.crop_x0, 0, _options.image_width);
+        _cropY0 = Clamp(_options.crop_y0, 0, _options.image_height);
+        _cropX1 = Clamp(_options.crop_x1, 0, _options.image_width);
+        _cropY1 = Clamp(_options.crop_y1, 0, _options.image_height);
+    }
+    if (_options.render_mask) {
+        _mask.LoadFromFile(_options.render_mask);
+        if (_mask.Width() != _options.image_width || _mask.Height() != _options.image_height)
+            throw std::runtime_error("Render mask " + std::string(_options.render_mask) + " isn't the size of the image");
+    }
+}
+
+bool Scene::Rendered(int x, int y) const {
+    if (x < _cropX0 || x >= _cropX1 || y < _cropY0 || y >= _cropY1)
+        return false;
+    return !_mask.Valid() || MaxComponent(_mask(x, y)) > 0;
+}
+
+bool Scene::_TileRendered(int tile) const {
+    int tsize = _options.tile_size;
+    int start_x = (tile % _numTilesWidth) * tsize;
+    int start_y = (tile / _numTilesWidth) * tsize;
+    int end_x = Min(start_x + tsize, _cropX1), end_y = Min(start_y + tsize, _cropY1);
+    for (int y = Max(start_y, _cropY0); y < end_y; y++) {
+        for (int x = Max(start_x, _cropX0); x < end_x; x++) {
+            if (Rendered(x, y))
+                return true;
+        }
+    }
+    return false;
+}
+
+bool Scene::_Region() const {
+    return _mask.Valid() || _cropX0 > 0 || _cropY0 > 0 ||
+           _cropX1 < _options.image_width || _cropY1 < _options.image_height;
+}
+
+void Scene::Composite(Image &image, const Image &base) const {
+    if (base.Width() != image.Width() || base.Height() != image.Height())
+        return;
+    for (int y = 0; y < image.Height(); y++) {
+        for (int x = 0; x < image.Width(); x++) {
+            if (!Rendered(x, y))
+                image.SetPixel(x, y, base(x, y));
+        }
+    }
+}
+
+void Scene::_Denoise() {
+    if (!_options.denoise || !_aovMask)
+        return;
+    Timer timer;
+    timer.Start();
+    // Crops & masks are filtered alone, the pixels left black
+    // are composited afterwards
+    Image region;
+    if (_Region()) {
+        region = Image(_options.image_width, _options.image_height);
+        for (int y = 0; y < region.Height(); y++) {
+            for (int x = 0; x < region.Width(); x++) {
+                if (Rendered(x, y))
+                    region.SetPixel(x, y, Color(1, 1, 1));
+            }
+        }
+    }
+    for (View &view : _views) {
+        view.image = Denoise(view.image, view.aovs[static_cast<int>(Aov::Albedo)], view.aovs[static_cast<int>(Aov::Normal)],
+                             view.aovs[static_cast<int>(Aov::Depth)], view.aovs[static_cast<int>(Aov::Variance)],
+                             _ThreadCount(), region);
+    }
+    timer.Stop();
+    std::cout << "\nDenoised in: ";
+    timer.Print();
+}
+
+void Scene::RenderToFile(char const *filename) {
+    _CheckShutters({ _camera });
+    // The denoiser needs the whole image, it isn't streamed
+    if (_options.denoise)
+        std::cerr << "Ignoring --denoise with --stream\n";
+    _aovMask = _AovMask(false);
+    _png = make_unique<PngWriter>(filename, _options.image_width, _options.image_height);
+    for (int i = 0; i < AovCount; i++) {
+        if (_options.aovs & (1u << i))
+            _aovWriters[i] = make_unique<PfmWriter>(AovPath(filename, static_cast<Aov>(i)).c_str(),
+                                                    _options.image_width, _options.image_height);
+    }
+    _InitViews({ _camera }, false);
+    // The rows are all written, skipped tiles would stall them
+    if (_options.crop_x1 > _options.crop_x0 || _options.render_mask)
+        std::cerr << "Ignoring the crop & mask with --stream\n";
+    _InitRegion(false);
+    _nextRow = 0;
+    _RenderTiles();
+    _png->Close();
+    _png.reset();
+    for (auto &writer : _aovWriters)
+        writer.reset();
+}
+
+const Image& Scene::AovBuffer(Aov aov, int view) const {
+    static const Image none;
+    if (view < 0 || view >= (int)_views.size())
+        return none;
+    return _views[view].aovs[static_cast<int>(aov)];
+}
+
+void Scene::WriteAovs(std::string const &image_path, int view) const {
+    for (int i = 0; i < AovCount; i++) {
+        const Image &aov = AovBuffer(static_cast<Aov>(i), view);
+        if (!aov.Valid() || !(_options.aovs & (1u << i)))
+            continue;
+        std::string path = AovPath(image_path, static_cast<Aov>(i));
+        // Crops & masks keep the pixels of the previous AOVs
+        Image composited;
+        if (_Region()) {
+            composited = aov;
+            Composite(composited, ReadPfm(path.c_str()));
+        }
+        const Image &values = composited.Valid() ? composited : aov;
+        PfmWriter writer(path.c_str(), values.Width(), values.Height());
+        writer.WriteRows(values, values.Height());
+    }
+}
+
+unsigned Scene::_AovMask(bool denoise) const {
+    // AOVs only come with the beauty render
+    if (_options.normalOnly || _options.aoOnly)
+        return 0;
+    return _options.aovs | (denoise ? DenoiserGuides : 0);
+}
+
+void Scene::_AllocateAovs(Image *aovs, int width, int height) const {
+    for (int i = 0; i < AovCount; i++)
+        aovs[i] = _aovMask & (1u << i) ? Image(width, height) : Image();
+}
+
+int Scene::_PrimitiveId(const Primitive *primitive) const {
+    auto it = std::lower_bound(_primitiveIds.begin(), _primitiveIds.end(), std::make_pair(primitive, -1));
+    if (!primitive || it == _primitiveIds.end() || it->first != primitive)
+        return -1;
+    return it->second;
+}
+
+void Scene::_RenderTiles() {
+    // Emitters sampled by Trace
+    if (!lights)
+        BuildLights();
+
+    // Ids of the leaf primitives, numbered in the order of the BVH
+    _primitiveIds.clear();
+    if (_options.aovs & (1u << static_cast<int>(Aov::PrimitiveId))) {
+        for (const Primitive *leaf : _Leaves())
+            _primitiveIds.emplace_back(leaf, _primitiveIds.size());
+        // The first reference of a primitive (SBVH) gives its id,
+        // then the ids are made contiguous again
+        auto by_address = [](const auto &a, const auto &b) { return a.first < b.first; };
+        auto by_id = [](const auto &a, const auto &b) { return a.second < b.second; };
+        std::stable_sort(_primitiveIds.begin(), _primitiveIds.end(), by_address);
+        _primitiveIds.erase(std::unique(_primitiveIds.begin(), _primitiveIds.end(),
+            [](const auto &a, const auto &b) { return a.first == b.first; }), _primitiveIds.end());
+        std::sort(_primitiveIds.begin(), _primitiveIds.end(), by_id);
+        for (size_t i = 0; i < _primitiveIds.size(); i++)
+            _primitiveIds[i].second = i;
+        std::sort(_primitiveIds.begin(), _primitiveIds.end(), by_address);
+    }
 
     // Init the _threads
     _threads.clear();
     
-    // Slice the image in multiple tiles
+    // Slice the images in multiple tiles
     _numTilesWidth = (int) ceil( (Float)_options.image_width / _options.tile_size );
     int _numTilesHeight = (int) ceil( (Float)_options.image_height / _options.tile_size );
-    _numTiles = _numTilesWidth * _numTilesHeight;
+    _numTilesView = _numTilesWidth * _numTilesHeight;
     _renderedTiles = 0;
 
-    // Get the number of threads available
-    int availableThreads = std::thread::hardware_concurrency();
-    // If user override the thread number
-    if (_options.max_threads != -1)
-        availableThreads = Min(availableThreads, _options.max_threads);
+    // Adding the tiles with pixels to render to the queue
+    _numTiles = 0;
+    for (int i = 0; i < _numTilesView * (int)_views.size(); i++) {
+        if (_TileRendered(i % _numTilesView)) {
+            _tilesToRender.push(i);
+            _numTiles++;
+        }
+    }
 
     // Final number of threads
-    int nThreads = Min(_numTiles, availableThreads);
+    int nThreads = Min(_numTiles, pool ? Min(pool->Size(), _ThreadCount()) : _ThreadCount());
     std::cout << "\n\nRunning " << nThreads << " threads\n";
+    // Enough rows of tiles in flight to keep every thread busy
+    _maxRows = 2 + nThreads / _numTilesWidth;
 
-
-    // Adding all the tiles to the queue
-    for (int i = 0; i < _numTiles; i++) {
-        _tilesToRender.push(i);
+    // Shared workers pick the tiles once done with the previous renders
+    if (pool) {
+        pool->Run(nThreads, [this] { _RenderTile(); });
+        return;
     }
-    
+
     // Send each tile to render on a thread
     for (int i = 0; i < nThreads; i++) {
         _threads.emplace_back(std::thread(&Scene::_RenderTile, this));
@@ -199,9 +724,81 @@ Image Scene::Render() {
     for (auto &thread : _threads) {
         thread.join();
     }
+}
+
+int Scene::_ThreadCount() const {
+    // Threads available, unless the user overrides their number
+    return ThreadCount(_options.max_threads);
+}
 
-    // Return the image buffer
-    return std::move(_img);
+bool Scene::LoadFrame(int frame) {
+    for (AnimatedMesh &anim : animated) {
+        int nTriangles;
+        std::vector<int> indices;
+        std::vector<Point> vp;
+        std::vector<Normal> vn;
+        ReadObjFile(FramePath(anim.path, frame).c_str(), nTriangles, indices, vp, vn);
+        // Refitting needs the same faces
+        if (nTriangles != anim.mesh->nTriangles || !anim.mesh->SameFaces(indices))
+            return false;
+        anim.mesh->UpdateVertices(std::move(vp), std::move(vn), _options.max_threads);
+    }
+    // The emitters moved with the meshes
+    if (!animated.empty())
+        lights = nullptr;
+
+    shared_ptr<BVH> bvh = std::dynamic_pointer_cast<BVH>(_world);
+    if (bvh && !animated.empty()) {
+        Timer timer;
+        timer.Start();
+        bvh->Refit(_ThreadCount());
+        timer.Stop();
+        std::cout << "BVH refitted in: ";
+        timer.Print();
+        std::cout << "\n";
+    }
+    return true;
+}
+
+void Scene::BuildLights() {
+    Timer timer;
+    timer.Start();
+    // The SBVH can list a primitive more than once
+    std::vector<const Primitive*> leaves = _Leaves();
+    std::sort(leaves.begin(), leaves.end());
+    leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+    lights = make_shared<LightBVH>(leaves);
+    timer.Stop();
+    if (lights->Size() > 0) {
+        std::cout << "Light BVH: " << lights->Size() << " emitters, built in: ";
+        timer.Print();
+        std::cout << "\n";
+    }
+}
+
+std::vector<const Primitive*> Scene::_Leaves() const {
+    std::vector<const Primitive*> leaves;
+    if (auto list = std::dynamic_pointer_cast<PrimitiveList>(_world))
+        list->Leaves(leaves);
+    else
+        leaves.push_back(_world.get());
+    return leaves;
+}
+
+void Scene::BuildImplicitCaches() {
+    if (_options.sdf_cache_resolution <= 0 || implicits.empty())
+        return;
+
+    int threads = _ThreadCount();
+    std::cout << "Building SDF brick caches...\n";
+    size_t budget = size_t(_options.sdf_cache_mb) << 20;
+    for (auto &implicit : implicits) {
+        if (!implicit->BuildCache(_options.sdf_cache_resolution, budget, threads))
+            continue;
+        const SdfBrickCache *cache = implicit->Cache();
+        std::cout << "Cache " << cache->Resolution() << "^3: " << cache->NumNearBricks() << "/"
+                  << cache->NumBricks() << " bricks, " << (cache->MemoryUsage() >> 10) << " KB\n";
+    }
 }
 
 void Scene::PrintSettings() {
@@ -209,13 +806,23 @@ void Scene::PrintSettings() {
     std::cout << "Image: " << _options.image_width << "x" << _options.image_height << "\n";
     std::cout << "Tile size: " << _options.tile_size << "x" << _options.tile_size << "\n";
     std::cout << "Pixel samples: " << _options.pixel_samples << "\n";
+    std::cout << "Sampler: " << SamplerTypeName(_options.sampler) << "\n";
+    if (_options.bvh == BVHType::Spatial)
+        std::cout << "BVH: SBVH (max growth " << _options.sbvh_max_growth << ")\n";
     std::cout << "Diffuse Ray Depth: " << _options.max_diffuse_rdepth << "\n";
     std::cout << "Reflect Ray Depth: " << _options.max_reflect_rdepth << "\n";
     std::cout << "Refract Ray Depth: " << _options.max_refract_rdepth << "\n";
+    if (_options.rr_min_depth >= 0)
+        std::cout << "Russian Roulette Depth: " << _options.rr_min_depth << "\n";
+    if (_options.sdf_cache_resolution > 0)
+        std::cout << "SDF Cache: " << _options.sdf_cache_resolution << " (" << _options.sdf_cache_mb << " MB)\n";
     std::cout << "Color Limit: " << _options.color_limit << "\n";
-    std::cout << "Output: " << _options.image_out << "\n\n";
+    std::cout << "Output: " << _options.image_out << (_options.stream ? " (streamed)" : "") << "\n\n";
     if(_options.normalOnly)
         std::cout << "\nSetting renderer to Normal Only\n\n";
+    else if (_options.aoOnly)
+        std::cout << "\nSetting renderer to Ambient Occlusion (" << _options.ao_samples
+                  << " rays, distance " << _options.ao_distance << ")\n\n";
 }
 
 
@@ -281,6 +888,6 @@ Scene GenerateTestScene(RenderSettings opt) {
     shared_ptr<BVH> bvh = make_shared<BVH>(world, 0.0, 0.0);
     Scene scene(bvh, cam, opt);
     // Scene scene(sph, cam, opt);
-    scene.ibl.LoadFromFile("../scenes/maps/abandoned_hopper_terminal_02_2k.hdr");
+    scene.ibl = LoadEnvironmentMap("../scenes/maps/abandoned_hopper_terminal_02_2k.hdr");
     return std::move(scene);
 }
\ No newline at end of file
@@ -2,13 +2,51 @@
 
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <map>
 #include <queue>
+#include <string>
 
 #include "nray.h"
 #include "image.h"
+#include "envmap.h"
+#include "pngwriter.h"
+#include "pfmwriter.h"
+#include "parallel.h"
 #include "camera.h"
 #include "primitive.h"
+#include "lights.h"
+#include "sampler.h"
 
+class ImplicitPrimitive;
+
+// Mesh loaded from a sequence of obj files
+struct AnimatedMesh {
+  // Path with the frame number replaced by #
+  std::string path;
+  shared_ptr<TriangleMesh> mesh;
+};
+
+
+// Arbitrary output variables: buffers filled from the
+// first hit of the camera rays during the beauty render
+enum class Aov
+{
+  Albedo,       // Color of the material
+  Normal,       // Shading normal, facing the ray
+  Depth,        // Distance to the camera (0 for the environment)
+  PrimitiveId,  // Index of the leaf primitive in the BVH (-1 for none)
+  Samples,      // Samples taken for the pixel
+  Variance,     // Variance of the pixel luminance (of its mean)
+  Count
+};
+constexpr int AovCount = static_cast<int>(Aov::Count);
+
+// Returns Aov::Count for unknown names
+Aov ToAov(std::string const &str);
+char const *AovName(Aov aov);
+// Path of an AOV next to the image: out.png -> out_albedo.pfm
+std::string AovPath(std::string const &image_path, Aov aov);
 
 // RenderSettings
 struct RenderSettings {
@@ -24,12 +62,18 @@ struct RenderSettings {
   // Number of samples per pixel
   int pixel_samples{20};
 
+  // Sampler used to generate the pixel, lens & bounces samples
+  SamplerType sampler{SamplerType::Sobol};
+
   // Maximum Ray Depth
-  // TODO: split this between Diffuse, Reflect & Refract
   int max_diffuse_rdepth{2};
   int max_reflect_rdepth{5};
   int max_refract_rdepth{5};
 
+  // Russian roulette
+  // Once a path reaches this depth it is randomly
+  // terminated based on its throughput (disabled if < 0)
+  int rr_min_depth{-1};
 
   // When reached the max ray depth
   // returns bg (env) color instead of black
@@ -44,8 +88,49 @@ struct RenderSettings {
   // the normals
   bool normalOnly{false};
 
+  // Set the renderer in Ambient Occlusion mode
+  // Returns the fraction of the hemisphere (cosine
+  // weighted) that is unoccluded within ao_distance
+  bool aoOnly{false};
+  int ao_samples{4};
+  Float ao_distance{1};
+
+  // Acceleration structure builder & SBVH
+  // references limit (relative to the primitives)
+  BVHType bvh{BVHType::Median};
+  Float sbvh_max_growth{0.5};
+
+  // Sparse brick cache of the implicit graphs
+  // Voxels along the longest axis of each graph (disabled if 0)
+  int sdf_cache_resolution{0};
+  // Memory budget of each cache, in MB
+  int sdf_cache_mb{256};
+
   // Limit the number of threads (if >0)
   int max_threads{-1};
+
+  // Write the png by rows of tiles as they are rendered
+  // instead of keeping the whole image in memory
+  bool stream{false};
+
+  // AOVs rendered with the beauty, one bit (1 << Aov) each
+  unsigned aovs{0};
+
+  // Only the pixels of [crop_x0, crop_x1) x [crop_y0, crop_y1) are
+  // rendered (all of them if empty), and where render_mask isn't black
+  int crop_x0{0};
+  int crop_y0{0};
+  int crop_x1{0};
+  int crop_y1{0};
+  char const *render_mask{nullptr};
+
+  // Writes previews at 1/8, 1/4 & 1/2 of the resolution
+  // before rendering the image (see Scene::RenderPreviews)
+  bool preview{false};
+
+  // Filters the noise of the beauty after rendering, guided
+  // by the albedo, normal, depth & variance of the pixels
+  bool denoise{false};
   
   // Output image path
   char const *image_out{"./out.png"};
@@ -60,7 +145,7 @@ class Scene {
     Scene() {};
     Scene(RenderSettings opt) : _options(opt) {}
     Scene(shared_ptr<Primitive> world, Camera camera, RenderSettings opt) : _world(world), _camera(camera), _options(opt) {}
-    Scene(shared_ptr<Primitive> world, Camera camera, RenderSettings opt, Image &&ibl_) : _world(world), _camera(camera), _options(opt), ibl(ibl_) {}
+    Scene(shared_ptr<Primitive> world, Camera camera, RenderSettings opt, shared_ptr<EnvironmentMap> ibl_) : _world(world), _camera(camera), _options(opt), ibl(ibl_) {}
 
     Scene(const Scene& other); // copy constructor
     Scene(Scene&& other); // move constructor
@@ -69,21 +154,53 @@ class Scene {
     ~Scene() {}
 
     shared_ptr<Primitive> World() { return _world;}
+    Camera& GetCamera() { return _camera;}
+
+    // Loads the animated meshes of a frame and refits the BVH
+    // Returns false if a mesh topology changed, the scene then
+    // needs to be loaded (and its BVH built) again
+    bool LoadFrame(int frame);
 
     // Render the scene to an image
     Image Render();
+    // Renders the scene from each camera, the tiles of all the views
+    // are scheduled together so no thread idles between the views
+    std::vector<Image> RenderViews(const std::vector<Camera> &cameras);
+    // Quick previews of the views: rendered at 1/scale of the resolution
+    // with a sample per pixel, then scaled up to the full resolution
+    std::vector<Image> RenderPreviews(const std::vector<Camera> &cameras, int scale);
+    // Render the scene straight to a png file, the rows of tiles are
+    // written in order once rendered so only the ones in flight are in memory
+    void RenderToFile(char const *filename);
 
     // Sample the environment color
-    Color SampleEnvironment(const Ray &r) {
-      if (ibl.Valid()) {
-        Vec3 w = Normalize(r.Direction());
-        Float t = SphericalPhi(w) * Inv2Pi;
-        Float s = SphericalTheta(w) * InvPi;
-        return ibl(s, t);
-      }
+    // filtered over a cone of width radians (0 for no filtering)
+    Color SampleEnvironment(const Ray &r, Float width = 0) {
+      if (ibl)
+        return ibl->Lookup(Normalize(r.Direction()), width);
       return Color(0,0,0);
     }
 
+    // Whether the pixel is rendered, inside the crop & the mask
+    bool Rendered(int x, int y) const;
+    // Copies the pixels the last Render skipped from base,
+    // a previous render of the image
+    void Composite(Image &image, const Image &base) const;
+
+    // AOV buffer of a view of the last Render (empty if it wasn't enabled)
+    const Image& AovBuffer(Aov aov, int view = 0) const;
+    // Writes the AOVs of a view of the last Render as pfm files next to the image
+    // Crops & masks are composited over the AOVs already written, like the image
+    void WriteAovs(std::string const &image_path, int view = 0) const;
+
+    // Builds the BVH of the emitters Trace samples, done by
+    // the first render if not called before
+    void BuildLights();
+
+    // Builds the brick caches of the implicit primitives
+    // if enabled in the settings
+    void BuildImplicitCaches();
+
     // Print Render Settings
     void PrintSettings();
     // Returns Render Settings
@@ -93,26 +210,87 @@ class Scene {
       _options = opt;
       }
 
-    Image ibl;
+    shared_ptr<EnvironmentMap> ibl;
+    // Emitters of the world, rebuilt after LoadFrame moves them
+    shared_ptr<LightBVH> lights;
+    // Every <Camera> of the scene file, the first one is GetCamera()'s
+    std::vector<Camera> cameras;
+    // Time interval the BVH bounds the moving primitives over, the
+    // rendered shutters must be inside it (unbounded if nothing moves)
+    Float motion_open{-Infinity};
+    Float motion_close{Infinity};
+    // Implicit primitives that can be cached
+    std::vector<shared_ptr<ImplicitPrimitive>> implicits;
+    // Meshes updated by LoadFrame
+    std::vector<AnimatedMesh> animated;
+    // Files the scene was loaded from (scene, objs & maps)
+    std::vector<std::string> files;
+    // Renders on these workers instead of its own threads if set
+    // (the jobs of the render server share them)
+    shared_ptr<ThreadPool> pool;
     
   private:
 
+    // Number of threads to use
+    int _ThreadCount() const;
+
     // Update the render progress
     void _updateProgress();
     // Get next tile in the queue
     bool _getNextTile(int &tile);
     // Render the tiles
     void _RenderTile();
+    // Slices the images of the views in tiles & renders them on the threads
+    void _RenderTiles();
+    // Sets up the views of the cameras & their AOVs
+    void _InitViews(const std::vector<Camera> &cameras, bool allocate);
+    // Filters the views if enabled in the settings
+    void _Denoise();
+    // Sets up the crop & loads the mask of the render
+    void _InitRegion(bool enabled);
+    // Throws if a camera's shutter isn't in the motion interval of the BVH,
+    // its boxes wouldn't contain the moving primitives
+    void _CheckShutters(const std::vector<Camera> &cameras) const;
+    // Whether the tile has a pixel to render
+    bool _TileRendered(int tile) const;
+    // Whether the last render skipped pixels (crop or mask)
+    bool _Region() const;
+    // AOVs the render fills, with the guides of the denoiser or not
+    unsigned _AovMask(bool denoise) const;
+    // Images of the AOVs in _aovMask
+    void _AllocateAovs(Image *aovs, int width, int height) const;
+    // Leaf primitives of the world, in traversal order
+    std::vector<const Primitive*> _Leaves() const;
+    // PrimitiveId of a leaf primitive
+    int _PrimitiveId(const Primitive *primitive) const;
+    // Counts a rendered tile of a streamed render & writes
+    // the rows of tiles that are complete, in order
+    void _TileDone(int tile);
 
     Camera _camera;
     shared_ptr<Primitive> _world;
     RenderSettings _options;
 
-    // Output Image
-    Image _img;
-    
-    // Total Number of tiles
+    // Output images, one per camera
+    struct View {
+      Camera camera;
+      Image image;
+      Image aovs[AovCount];
+      // Angle of a pixel, filter width of the environment lookups
+      Float pixelSpread{0};
+    };
+    std::vector<View> _views;
+    // Pixels rendered, see RenderSettings::crop_x0
+    int _cropX0{0}, _cropY0{0}, _cropX1{0}, _cropY1{0};
+    Image _mask;
+    // AOVs filled by the render: the requested ones & the denoiser's
+    unsigned _aovMask{0};
+    // Leaf primitives & their PrimitiveId, sorted by address
+    std::vector<std::pair<const Primitive*, int>> _primitiveIds;
+    // Total Number of tiles, of all the views
     int _numTiles{0};
+    // Number of tiles of each view
+    int _numTilesView{0};
     // Number of tiles along the img width
     int _numTilesWidth{0};
 
@@ -125,13 +303,45 @@ class Scene {
     std::vector<std::thread> _threads;
     std::mutex _mtx;
     std::mutex _mtx_cout;
+
+    // Streamed output: the rows of tiles in flight & their tiles left
+    struct TileRow {
+      Image image;
+      int remaining;
+      Image aovs[AovCount];
+    };
+    unique_ptr<PngWriter> _png;
+    unique_ptr<PfmWriter> _aovWriters[AovCount];
+    std::map<int, TileRow> _rows;
+    // Next row to write & max rows in flight, further tiles wait for it
+    int _nextRow{0};
+    int _maxRows{0};
+    bool _writing{false};
+    std::condition_variable _rowWritten;
 };
 
 // Generates the test scene
 Scene GenerateTestScene(RenderSettings opt);
 
-// Recursive raytracing function
-Color Trace(const Ray& r, Scene *scene, int depth);
+// First hit data of a camera ray, for the AOVs
+struct AovSample {
+  Color albedo;
+  Normal normal;
+  Float depth{0};
+  const Primitive *primitive{nullptr};
+};
+
+// Path tracing function
+// Iteratively bounces the ray through the scene, accumulating
+// the path throughput, until it escapes, gets absorbed or
+// reaches the depth limit of its ray type
+// The environment seen by camera rays is filtered over pixel_spread,
+// the angle of a pixel. Fills aov (if not null) from the first hit
+Color Trace(const Ray& r, Scene *scene, Sampler &sampler, Float pixel_spread = 0, AovSample *aov = nullptr);
 
 // Returns the Normal values
-Color TraceNormalOnly(const Ray& r, Scene *scene);
\ No newline at end of file
+Color TraceNormalOnly(const Ray& r, Scene *scene);
+
+// Returns the ambient occlusion at the first hit
+// Uses ao_samples any hit rays per call
+Color TraceAmbientOcclusion(const Ray& r, Scene *scene, Sampler &sampler);
\ No newline at end of file
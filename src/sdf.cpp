@@ -0,0 +1,188 @@
+#include <stdexcept>
+
+#include "sdf.h"
+
+
+SdfProgram::SdfProgram(const SdfNode &root) {
+    _Compile(root, _bmin, _bmax, 0, 0);
+}
+
+bool SdfProgram::Bounds(BBox &box) const {
+    for (int i = 0; i < 3; i++) {
+        if (!std::isfinite(_bmin[i]) || !std::isfinite(_bmax[i]))
+            return false;
+    }
+    box = BBox(_bmin, _bmax);
+    return true;
+}
+
+void SdfProgram::_Compile(const SdfNode &node, Vec3 &bmin, Vec3 &bmax, int values, int points) {
+    // values & points are the stack depths before the node runs
+    if (values >= MaxValueStack || points >= MaxPointStack)
+        throw std::runtime_error("Implicit graph is too deep");
+
+    auto expect_children = [&node](size_t min_count, size_t max_count) {
+        if (node.children.size() < min_count || node.children.size() > max_count)
+            throw std::runtime_error("Wrong number of children in implicit graph");
+    };
+
+    switch (node.op) {
+        case SdfOp::Sphere :
+            expect_children(0, 0);
+            _code.push_back({OpCode::Sphere, node.v.x, 0, 0});
+            bmin = -Vec3(node.v.x, node.v.x, node.v.x);
+            bmax = Vec3(node.v.x, node.v.x, node.v.x);
+            break;
+
+        case SdfOp::Box :
+            expect_children(0, 0);
+            _code.push_back({OpCode::Box, node.v.x, node.v.y, node.v.z});
+            bmin = -node.v;
+            bmax = node.v;
+            break;
+
+        case SdfOp::Union :
+        case SdfOp::Intersect :
+        case SdfOp::Subtract :
+        case SdfOp::SmoothUnion : {
+            expect_children(1, size_t(-1));
+            // A zero blend divides 0 by 0 in the smooth minimum
+            if (node.op == SdfOp::SmoothUnion && node.k <= 0)
+                throw std::runtime_error("Implicit smooth_union blend needs to be positive");
+            OpCode op = (node.op == SdfOp::Union) ? OpCode::Union
+                      : (node.op == SdfOp::Intersect) ? OpCode::Intersect
+                      : (node.op == SdfOp::Subtract) ? OpCode::Subtract
+                                                     : OpCode::SmoothUnion;
+            _Compile(*node.children[0], bmin, bmax, values, points);
+            for (size_t i = 1; i < node.children.size(); i++) {
+                Vec3 cmin, cmax;
+                // The previous result stays on the stack
+                _Compile(*node.children[i], cmin, cmax, values + 1, points);
+                _code.push_back({op, node.k, 0, 0});
+                if (node.op == SdfOp::Intersect) {
+                    bmin = Vec3(Max(bmin.x, cmin.x), Max(bmin.y, cmin.y), Max(bmin.z, cmin.z));
+                    bmax = Vec3(Min(bmax.x, cmax.x), Min(bmax.y, cmax.y), Min(bmax.z, cmax.z));
+                }
+                else if (node.op != SdfOp::Subtract) {
+                    bmin = Vec3(Min(bmin.x, cmin.x), Min(bmin.y, cmin.y), Min(bmin.z, cmin.z));
+                    bmax = Vec3(Max(bmax.x, cmax.x), Max(bmax.y, cmax.y), Max(bmax.z, cmax.z));
+                }
+            }
+            // The smooth blend can grow the surface by up to k/4
+            if (node.op == SdfOp::SmoothUnion) {
+                Vec3 grow(node.k / 4, node.k / 4, node.k / 4);
+                bmin -= grow;
+                bmax += grow;
+            }
+            break;
+        }
+
+        case SdfOp::Translate :
+            expect_children(1, 1);
+            _code.push_back({OpCode::PushTranslate, node.v.x, node.v.y, node.v.z});
+            _Compile(*node.children[0], bmin, bmax, values, points + 1);
+            _code.push_back({OpCode::PopPoint, 0, 0, 0});
+            bmin += node.v;
+            bmax += node.v;
+            break;
+
+        case SdfOp::Scale :
+            expect_children(1, 1);
+            if (node.k <= 0)
+                throw std::runtime_error("Implicit scale needs to be positive");
+            _code.push_back({OpCode::PushScale, 1 / node.k, 0, 0});
+            _Compile(*node.children[0], bmin, bmax, values, points + 1);
+            _code.push_back({OpCode::PopScale, node.k, 0, 0});
+            bmin *= node.k;
+            bmax *= node.k;
+            break;
+
+        case SdfOp::Repeat :
+            expect_children(1, 1);
+            _code.push_back({OpCode::PushRepeat, node.v.x, node.v.y, node.v.z});
+            _Compile(*node.children[0], bmin, bmax, values, points + 1);
+            _code.push_back({OpCode::PopPoint, 0, 0, 0});
+            // Repeated axes are unbounded
+            for (int i = 0; i < 3; i++) {
+                if (node.v[i] > 0) {
+                    bmin[i] = -Infinity;
+                    bmax[i] = Infinity;
+                }
+            }
+            break;
+    }
+}
+
+Float SdfProgram::Evaluate(Point p) const {
+    Float values[MaxValueStack];
+    Point points[MaxPointStack];
+    int vp = 0;
+    int pp = 0;
+
+    for (const Instruction &ins : _code) {
+        switch (ins.op) {
+            case OpCode::Sphere :
+                values[vp++] = p.Length() - ins.a;
+                break;
+
+            case OpCode::Box : {
+                Vec3 d = Abs(p) - Vec3(ins.a, ins.b, ins.c);
+                Vec3 outside(Max(d.x, (Float)0), Max(d.y, (Float)0), Max(d.z, (Float)0));
+                values[vp++] = Min(Max(d.x, Max(d.y, d.z)), (Float)0) + outside.Length();
+                break;
+            }
+
+            case OpCode::Union :
+                vp--;
+                values[vp-1] = Min(values[vp-1], values[vp]);
+                break;
+
+            case OpCode::Intersect :
+                vp--;
+                values[vp-1] = Max(values[vp-1], values[vp]);
+                break;
+
+            case OpCode::Subtract :
+                vp--;
+                values[vp-1] = Max(values[vp-1], -values[vp]);
+                break;
+
+            case OpCode::SmoothUnion : {
+                // Polynomial smooth min
+                vp--;
+                Float a = values[vp-1];
+                Float b = values[vp];
+                Float h = Max(ins.a - std::abs(a - b), (Float)0) / ins.a;
+                values[vp-1] = Min(a, b) - h * h * ins.a * (Float)0.25;
+                break;
+            }
+
+            case OpCode::PushTranslate :
+                points[pp++] = p;
+                p -= Vec3(ins.a, ins.b, ins.c);
+                break;
+
+            case OpCode::PushScale :
+                points[pp++] = p;
+                p *= ins.a;
+                break;
+
+            case OpCode::PushRepeat :
+                points[pp++] = p;
+                if (ins.a > 0) p.x -= ins.a * std::round(p.x / ins.a);
+                if (ins.b > 0) p.y -= ins.b * std::round(p.y / ins.b);
+                if (ins.c > 0) p.z -= ins.c * std::round(p.z / ins.c);
+                break;
+
+            case OpCode::PopPoint :
+                p = points[--pp];
+                break;
+
+            case OpCode::PopScale :
+                p = points[--pp];
+                values[vp-1] *= ins.a;
+                break;
+        }
+    }
+    return values[0];
+}
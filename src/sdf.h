@@ -0,0 +1,84 @@
+#pragma once
+
+// SDF composition
+// Implicit surfaces described as a graph of shapes, booleans
+// and domain operations. The graph is flattened into a compact
+// stack based bytecode (SdfProgram) so a whole composition
+// costs a single primitive and a single march
+
+#include <vector>
+
+#include "nray.h"
+#include "geometry.h"
+#include "bbox.h"
+
+// Type of SdfNode
+enum class SdfOp
+{
+    // Shapes
+    Sphere,       // v.x = radius
+    Box,          // v = half size
+    // Booleans (n children)
+    Union,
+    Intersect,
+    Subtract,     // first child minus the others
+    SmoothUnion,  // k = blend radius
+    // Domain operations (1 child)
+    Translate,    // v = offset
+    Scale,        // k = uniform scale
+    Repeat        // v = cell size, 0 disables the axis
+};
+
+// Node of the SDF graph, as built by the parser
+struct SdfNode {
+    SdfOp op;
+    Vec3 v;
+    Float k{0};
+    std::vector<shared_ptr<SdfNode>> children;
+
+    SdfNode(SdfOp op_) : op(op_) {}
+    SdfNode(SdfOp op_, Vec3 v_, Float k_=0) : op(op_), v(v_), k(k_) {}
+};
+
+
+// Compiled SDF graph
+class SdfProgram {
+    public:
+        SdfProgram() {}
+        // Flattens the graph, throws if the graph is invalid
+        explicit SdfProgram(const SdfNode &root);
+
+        // Returns the signed distance at p
+        Float Evaluate(Point p) const;
+
+        // Bounds of the surface, false if it is infinite
+        bool Bounds(BBox &box) const;
+
+        // Number of instructions
+        size_t Size() const { return _code.size(); }
+
+        // Stack limits of the evaluator
+        static constexpr int MaxValueStack = 32;
+        static constexpr int MaxPointStack = 16;
+
+    private:
+        enum class OpCode : int {
+            Sphere, Box,
+            Union, Intersect, Subtract, SmoothUnion,
+            PushTranslate, PushScale, PushRepeat,
+            PopPoint, PopScale
+        };
+
+        // 16 bytes per instruction
+        struct Instruction {
+            OpCode op;
+            Float a, b, c;
+        };
+
+        // Emits the instructions of node, returns its bounds
+        void _Compile(const SdfNode &node, Vec3 &bmin, Vec3 &bmax, int values, int points);
+
+        std::vector<Instruction> _code;
+        Vec3 _bmin;
+        Vec3 _bmax;
+};
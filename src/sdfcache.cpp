@@ -0,0 +1,136 @@
+#include "sdfcache.h"
+#include "parallel.h"
+
+
+SdfBrickCache::SdfBrickCache(const std::function<Float(const Point&)> &sdf, const BBox &box,
+                             int resolution, size_t budget_bytes, int threads) {
+    const size_t brick_bytes = BrickSamples * sizeof(Float);
+    size_t near = 0;
+
+    // Coarse pass: distance at every brick center
+    // Halve the resolution until the near bricks fit in the budget
+    int res = Max(resolution, BrickSize);
+    while (true) {
+        _SetResolution(box, res);
+        int n = _nBricks[0] * _nBricks[1] * _nBricks[2];
+        _brickDistance.assign(n, 0);
+        ParallelFor(n, threads, [&](int i) {
+            int bx = i % _nBricks[0];
+            int by = (i / _nBricks[0]) % _nBricks[1];
+            int bz = i / (_nBricks[0] * _nBricks[1]);
+            Point center = _origin + Vec3(bx + 0.5, by + 0.5, bz + 0.5) * (BrickSize * _voxel);
+            _brickDistance[i] = sdf(center);
+        });
+
+        Float band = _halfDiagonal + (_exactBand + 1) * _voxel;
+        near = 0;
+        for (Float d : _brickDistance) {
+            if (std::abs(d) <= band)
+                near++;
+        }
+        if (near * brick_bytes <= budget_bytes || res <= BrickSize)
+            break;
+        res /= 2;
+    }
+
+    // Give the near bricks their samples, within the budget
+    Float band = _halfDiagonal + (_exactBand + 1) * _voxel;
+    size_t max_near = budget_bytes / brick_bytes;
+    std::vector<int> near_bricks;
+    _brickIndex.assign(_brickDistance.size(), FarBrick);
+    for (size_t i = 0; i < _brickDistance.size(); i++) {
+        if (std::abs(_brickDistance[i]) > band)
+            continue;
+        if (near_bricks.size() < max_near) {
+            _brickIndex[i] = near_bricks.size();
+            near_bricks.push_back(i);
+        }
+        else {
+            _brickIndex[i] = ExactBrick;
+        }
+    }
+
+    // Fine pass: sample the near bricks
+    _samples.resize(near_bricks.size() * BrickSamples);
+    const int S = BrickSize + 1;
+    ParallelFor(near_bricks.size(), threads, [&](int n) {
+        int i = near_bricks[n];
+        int bx = i % _nBricks[0];
+        int by = (i / _nBricks[0]) % _nBricks[1];
+        int bz = i / (_nBricks[0] * _nBricks[1]);
+        Float *samples = &_samples[size_t(n) * BrickSamples];
+        for (int z = 0; z < S; z++) {
+            for (int y = 0; y < S; y++) {
+                for (int x = 0; x < S; x++) {
+                    Vec3 voxel(bx * BrickSize + x, by * BrickSize + y, bz * BrickSize + z);
+                    samples[(z * S + y) * S + x] = sdf(_origin + voxel * _voxel);
+                }
+            }
+        }
+    });
+}
+
+void SdfBrickCache::_SetResolution(const BBox &box, int resolution) {
+    Vec3 extent = box.Max() - box.Min();
+    _resolution = resolution;
+    _origin = box.Min();
+    _voxel = MaxComponent(extent) / resolution;
+    _invVoxel = 1 / _voxel;
+    for (int i = 0; i < 3; i++)
+        _nBricks[i] = Max(1, (int)std::ceil(extent[i] / (BrickSize * _voxel)));
+    _halfDiagonal = (Float)0.5 * BrickSize * _voxel * std::sqrt((Float)3);
+}
+
+size_t SdfBrickCache::MemoryUsage() const {
+    return _samples.size() * sizeof(Float)
+         + _brickDistance.size() * sizeof(Float)
+         + _brickIndex.size() * sizeof(int);
+}
+
+bool SdfBrickCache::Lookup(const Point &p, Float &d) const {
+    // Position in voxels
+    Vec3 f = (p - _origin) * _invVoxel;
+    int b[3];
+    for (int i = 0; i < 3; i++) {
+        b[i] = (int)std::floor(f[i] * (Float(1) / BrickSize));
+        if (b[i] < 0 || b[i] >= _nBricks[i])
+            return false;
+    }
+    int id = (b[2] * _nBricks[1] + b[1]) * _nBricks[0] + b[0];
+    int index = _brickIndex[id];
+
+    // Far from the surface, the sdf is 1-Lipschitz so the center distance
+    // minus the half diagonal is a safe bound anywhere in the brick
+    if (index == FarBrick) {
+        Float center = _brickDistance[id];
+        d = center - std::copysign(_halfDiagonal, center);
+        return true;
+    }
+    if (index == ExactBrick)
+        return false;
+
+    // Trilinear interpolation of the 8 samples around p
+    int c[3];
+    Float w[3];
+    for (int i = 0; i < 3; i++) {
+        Float l = Clamp(f[i] - b[i] * BrickSize, (Float)0, (Float)BrickSize);
+        c[i] = Min((int)l, BrickSize - 1);
+        w[i] = l - c[i];
+    }
+    const int S = BrickSize + 1;
+    const Float *s = &_samples[size_t(index) * BrickSamples + (c[2] * S + c[1]) * S + c[0]];
+    Float d00 = s[0]         + w[0] * (s[1]           - s[0]);
+    Float d10 = s[S]         + w[0] * (s[S + 1]       - s[S]);
+    Float d01 = s[S*S]       + w[0] * (s[S*S + 1]     - s[S*S]);
+    Float d11 = s[S*S + S]   + w[0] * (s[S*S + S + 1] - s[S*S + S]);
+    Float d0 = d00 + w[1] * (d10 - d00);
+    Float d1 = d01 + w[1] * (d11 - d01);
+    Float v = d0 + w[2] * (d1 - d0);
+
+    // Close to the surface the exact sdf gives precise hits
+    if (std::abs(v) < _exactBand * _voxel)
+        return false;
+    // Interpolation can overestimate the distance, keep a voxel of margin
+    d = v - std::copysign(_voxel, v);
+    return true;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+// Sparse SDF brick cache
+// Samples an expensive SDF once at load time so ray marching can
+// use cheap trilinear lookups. The bounding box is divided in bricks
+// of BrickSize^3 voxels. Only the bricks close to the surface (the
+// narrow band) store samples, the other ones only keep the distance
+// at their center which is enough to step over them safely
+
+#include <functional>
+#include <vector>
+
+#include "nray.h"
+#include "geometry.h"
+#include "bbox.h"
+
+class SdfBrickCache {
+    public:
+        // Samples sdf over box with resolution voxels along its longest axis
+        // The resolution is halved until the bricks fit in budget_bytes
+        SdfBrickCache(const std::function<Float(const Point&)> &sdf, const BBox &box,
+                      int resolution, size_t budget_bytes, int threads);
+
+        // Sets d to the cached distance at p and returns true
+        // Returns false when p is too close to the surface (or outside
+        // the cache) and the exact sdf needs to be evaluated
+        bool Lookup(const Point &p, Float &d) const;
+
+        int Resolution() const { return _resolution; }
+        size_t NumBricks() const { return _brickIndex.size(); }
+        size_t NumNearBricks() const { return _samples.size() / BrickSamples; }
+        size_t MemoryUsage() const;
+
+        // Voxels per brick side
+        static constexpr int BrickSize = 8;
+        // Samples per brick (one extra sample per side for interpolation)
+        static constexpr int BrickSamples = (BrickSize+1) * (BrickSize+1) * (BrickSize+1);
+
+    private:
+        // Sets the grid dimensions for a resolution
+        void _SetResolution(const BBox &box, int resolution);
+
+        Vec3 _origin;
+        Float _voxel{1};
+        Float _invVoxel{1};
+        int _resolution{0};
+        int _nBricks[3]{0, 0, 0};
+
+        // Below this distance (in voxels) we use the exact sdf
+        Float _exactBand{2};
+        // Half diagonal of a brick
+        Float _halfDiagonal{0};
+
+        // _brickIndex values of the bricks without samples
+        static constexpr int FarBrick = -1;
+        static constexpr int ExactBrick = -2;  // near, but over the memory budget
+
+        // Per brick: index of its samples (-1 when far from the surface)
+        // and distance at its center
+        std::vector<int> _brickIndex;
+        std::vector<Float> _brickDistance;
+        // Samples of the near bricks
+        std::vector<Float> _samples;
+};
@@ -0,0 +1,321 @@
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include "server.h"
+
+#include "parser.h"
+
+
+// Value of a flat JSON object: a string, a number, a boolean
+// or an array of numbers. text is the string or the literal as written
+struct JsonValue {
+    std::string text;
+    bool is_string{false};
+    std::vector<double> numbers;
+};
+
+static std::map<std::string, JsonValue> ParseJsonObject(const std::string &line) {
+    size_t i = 0;
+    auto skip = [&]() {
+        while (i < line.size() && std::isspace(static_cast<unsigned char>(line[i])))
+            i++;
+    };
+    auto expect = [&](char c) {
+        skip();
+        if (i >= line.size() || line[i] != c)
+            throw std::runtime_error(std::string("Invalid job, expected '") + c + "'");
+        i++;
+    };
+    auto parse_string = [&]() {
+        expect('"');
+        std::string text;
+        while (i < line.size() && line[i] != '"') {
+            char c = line[i++];
+            if (c == '\\' && i < line.size()) {
+                c = line[i++];
+                switch (c) {
+                    case 'n' : c = '\n'; break;
+                    case 't' : c = '\t'; break;
+                    case '"' : case '\\' : case '/' : break;
+                    default : throw std::runtime_error("Invalid job, unsupported string escape");
+                }
+            }
+            text += c;
+        }
+        expect('"');
+        return text;
+    };
+    auto parse_number = [&]() {
+        skip();
+        const char *begin = line.c_str() + i;
+        char *end;
+        double number = std::strtod(begin, &end);
+        if (end == begin)
+            throw std::runtime_error("Invalid job, expected a value");
+        i += end - begin;
+        return number;
+    };
+
+    std::map<std::string, JsonValue> object;
+    expect('{');
+    skip();
+    if (i < line.size() && line[i] == '}')
+        return object;
+    for (;;) {
+        std::string key = parse_string();
+        expect(':');
+        skip();
+        JsonValue value;
+        if (i < line.size() && line[i] == '"') {
+            value.text = parse_string();
+            value.is_string = true;
+        }
+        else if (i < line.size() && line[i] == '[') {
+            i++;
+            skip();
+            while (i < line.size() && line[i] != ']') {
+                value.numbers.push_back(parse_number());
+                skip();
+                if (i < line.size() && line[i] == ',')
+                    i++;
+            }
+            expect(']');
+        }
+        else if (line.compare(i, 4, "true") == 0 || line.compare(i, 5, "false") == 0) {
+            value.text = line[i] == 't' ? "true" : "false";
+            i += value.text.size();
+        }
+        else {
+            size_t begin = i;
+            value.numbers.push_back(parse_number());
+            value.text = line.substr(begin, i - begin);
+        }
+        object[key] = value;
+        skip();
+        if (i < line.size() && line[i] == ',') {
+            i++;
+            continue;
+        }
+        expect('}');
+        return object;
+    }
+}
+
+static std::string JsonString(const std::string &text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\')
+            quoted += '\\';
+        if (c == '\n')
+            quoted += "\\n";
+        else
+            quoted += c;
+    }
+    return quoted + "\"";
+}
+
+static long long Milliseconds(std::chrono::steady_clock::time_point start) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+}
+
+
+RenderServer::RenderServer(int threads, int cache_size, int jobs)
+    : _pool(make_shared<ThreadPool>(threads)), _cacheSize(Max(cache_size, 1)), _jobs(Max(jobs, 1)) {}
+
+void RenderServer::Run(std::istream &in, std::ostream &out) {
+    // The lines are queued for the job threads, answered in the
+    // order the jobs finish
+    std::deque<std::string> lines;
+    bool done = false;
+    std::mutex mtx, out_mtx;
+    std::condition_variable queued;
+    auto work = [&]() {
+        for (;;) {
+            std::string line;
+            {
+                std::unique_lock<std::mutex> lck(mtx);
+                queued.wait(lck, [&] { return done || !lines.empty(); });
+                if (lines.empty())
+                    return;
+                line = std::move(lines.front());
+                lines.pop_front();
+            }
+            std::string answer = _Render(line);
+            std::unique_lock<std::mutex> lck(out_mtx);
+            out << answer << std::endl;
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int j = 0; j < _jobs; j++)
+        threads.emplace_back(work);
+
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+        std::unique_lock<std::mutex> lck(mtx);
+        lines.push_back(line);
+        queued.notify_one();
+    }
+    {
+        std::unique_lock<std::mutex> lck(mtx);
+        done = true;
+    }
+    queued.notify_all();
+    for (auto &thread : threads)
+        thread.join();
+}
+
+shared_ptr<const Scene> RenderServer::_LoadScene(const std::string &path, bool &cached) {
+    std::promise<shared_ptr<const Scene>> promise;
+    shared_ptr<CachedScene> entry;
+    {
+        std::unique_lock<std::mutex> lck(_mtx);
+        for (auto it = _cache.begin(); it != _cache.end(); ++it) {
+            if ((*it)->path != path)
+                continue;
+            bool changed = false;
+            for (const auto &file : (*it)->files) {
+                std::error_code error;
+                auto time = std::filesystem::last_write_time(file.first, error);
+                changed |= error || time != file.second;
+            }
+            if (changed) {
+                _cache.erase(it);
+                break;
+            }
+            // Most recently used
+            _cache.splice(_cache.begin(), _cache, it);
+            auto scene = _cache.front()->scene;
+            lck.unlock();
+            cached = true;
+            return scene.get();
+        }
+        entry = make_shared<CachedScene>();
+        entry->path = path;
+        entry->scene = promise.get_future().share();
+        _cache.push_front(entry);
+        if ((int)_cache.size() > _cacheSize)
+            _cache.pop_back();
+    }
+
+    cached = false;
+    try {
+        auto scene = make_shared<Scene>(LoadSceneFile(path.c_str(), 0, _pool->Size()));
+        scene->BuildImplicitCaches();
+        // Shared by the copies the jobs render
+        scene->BuildLights();
+        std::vector<std::pair<std::string, std::filesystem::file_time_type>> files;
+        for (const std::string &file : scene->files) {
+            std::error_code error;
+            files.emplace_back(file, std::filesystem::last_write_time(file, error));
+        }
+        {
+            std::unique_lock<std::mutex> lck(_mtx);
+            entry->files = std::move(files);
+        }
+        promise.set_value(scene);
+        return scene;
+    }
+    catch (...) {
+        // Loaded again by the next job
+        {
+            std::unique_lock<std::mutex> lck(_mtx);
+            _cache.remove(entry);
+        }
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+}
+
+std::string RenderServer::_Render(const std::string &line) {
+    std::string id = "null";
+    try {
+        auto job = ParseJsonObject(line);
+        // Echoed back as a string or a number only, anything else is null
+        if (job.count("id")) {
+            const JsonValue &value = job["id"];
+            if (value.is_string)
+                id = JsonString(value.text);
+            else if (value.numbers.size() == 1 && !value.text.empty())
+                id = value.text;
+        }
+        if (!job.count("scene") || !job["scene"].is_string)
+            throw std::runtime_error("Job is missing its scene");
+
+        auto start = std::chrono::steady_clock::now();
+        bool cached;
+        Scene scene = *_LoadScene(job["scene"].text, cached);
+        long long load_ms = Milliseconds(start);
+
+        RenderSettings opt = scene.Settings();
+        CameraSettings camera = scene.GetCamera().settings;
+        std::string output = opt.image_out;
+        auto number = [&](const std::string &key) {
+            if (job[key].numbers.size() != 1)
+                throw std::runtime_error("Job " + key + " should be a number");
+            return job[key].numbers[0];
+        };
+        for (const auto &item : job) {
+            const std::string &key = item.first;
+            if (key == "id" || key == "scene")
+                continue;
+            else if (key == "output")
+                output = item.second.text;
+            else if (key == "width")
+                opt.image_width = (int)number(key);
+            else if (key == "height")
+                opt.image_height = (int)number(key);
+            else if (key == "spp")
+                opt.pixel_samples = (int)number(key);
+            else if (key == "sampler") {
+                opt.sampler = ToSamplerType(item.second.text);
+                if (opt.sampler == SamplerType::Unknown)
+                    throw std::runtime_error("Unknown sampler: " + item.second.text);
+            }
+            else if (key == "camera") {
+                std::istringstream linestream(item.second.text);
+                camera = ParseCamera(linestream);
+            }
+            else if (key == "denoise")
+                opt.denoise = item.second.text == "true";
+            else if (key == "stream")
+                opt.stream = item.second.text == "true";
+            else
+                throw std::runtime_error("Unknown job key " + key);
+        }
+        if (opt.image_width <= 0 || opt.image_height <= 0 || opt.pixel_samples <= 0)
+            throw std::runtime_error("Job size & samples should be positive");
+        opt.image_out = output.c_str();
+        opt.image_aspect_ratio = Float(opt.image_width) / opt.image_height;
+        scene.Settings(opt);
+        scene.GetCamera() = Camera(camera, opt.image_aspect_ratio);
+        scene.pool = _pool;
+
+        start = std::chrono::steady_clock::now();
+        if (opt.stream) {
+            scene.RenderToFile(output.c_str());
+        }
+        else {
+            Image image = scene.Render();
+            image.WriteToFile(output.c_str());
+            scene.WriteAovs(output);
+        }
+        long long render_ms = Milliseconds(start);
+
+        std::ostringstream answer;
+        answer << "{\"id\": " << id << ", \"status\": \"ok\", \"output\": " << JsonString(output)
+               << ", \"cached\": " << (cached ? "true" : "false") << ", \"load_ms\": " << load_ms
+               << ", \"render_ms\": " << render_ms << "}";
+        return answer.str();
+    }
+    catch (const std::exception &e) {
+        return "{\"id\": " + id + ", \"status\": \"error\", \"error\": " + JsonString(e.what()) + "}";
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <condition_variable>
+#include <filesystem>
+#include <future>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "nray.h"
+#include "scene.h"
+#include "parallel.h"
+
+// Render server (--serve)
+// Reads render jobs on stdin, one JSON object per line, and answers each
+// with a JSON line on stdout once its image is written, e.g.
+//   {"id": 1, "scene": "scenes/cornell_box.nray", "output": "thumb.png", "width": 256,
+//    "height": 144, "spp": 16, "camera": "-0.5 2 9.43 -0.15 1.47 0 0 1 0 18 0.1 3.5 0"}
+//   {"id": 1, "status": "ok", "output": "thumb.png", "cached": true, "load_ms": 0, "render_ms": 812}
+// Jobs can also set "sampler", "denoise" & "stream", the camera is a
+// <Camera> line. Loaded scenes (geometry, BVH & environment maps) are
+// kept in an LRU cache, reused until one of their files changes on disk
+// The cached BVH bounds the motion over the scene's interval only, jobs
+// whose camera shutter is outside of it are answered with an error
+class RenderServer {
+    public:
+        // threads: workers shared by all the jobs, cache_size: scenes kept
+        // loaded, jobs: jobs rendered at the same time
+        RenderServer(int threads, int cache_size, int jobs);
+
+        // Renders the jobs of in until it ends, answers are written to out
+        void Run(std::istream &in, std::ostream &out);
+
+    private:
+        struct CachedScene {
+            std::string path;
+            // Files of the scene & their modification time once loaded
+            std::vector<std::pair<std::string, std::filesystem::file_time_type>> files;
+            // Jobs asking for a scene being loaded wait for it
+            std::shared_future<shared_ptr<const Scene>> scene;
+        };
+
+        // Scene of a file, loaded or from the cache if none of its files changed
+        shared_ptr<const Scene> _LoadScene(const std::string &path, bool &cached);
+        // Renders the job of a line, returns its answer
+        std::string _Render(const std::string &line);
+
+        shared_ptr<ThreadPool> _pool;
+        int _cacheSize;
+        int _jobs;
+        // Most recently used first
+        std::list<shared_ptr<CachedScene>> _cache;
+        std::mutex _mtx;
+};
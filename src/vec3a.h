@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstring>
+
+#include "nray.h"
+#include "geometry.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define NRAY_VEC3A_SSE
+#endif
+
+
+// Vec3A
+// 16 bytes aligned Vec3, padded to 4 Floats so it fills a SSE register
+// Vector3 stays the storage type everywhere, Vec3A is meant for the
+// hot paths (bbox, triangle, camera) that load a few vectors and do
+// a lot of math on them. The 4th lane is kept at 0
+struct alignas(16) Vec3A
+{
+#ifdef NRAY_VEC3A_SSE
+    __m128 m;
+
+    Vec3A() : m(_mm_setzero_ps()) {}
+    explicit Vec3A(__m128 m_) : m(m_) {}
+    Vec3A(Float x, Float y, Float z) : m(_mm_set_ps(0, z, y, x)) {}
+    // Loads x & y as one 64 bits load and z in the 3rd lane
+    // (x & y are copied through memcpy, reading the floats through a double
+    // pointer breaks strict aliasing and lets the compiler use stale values)
+    Vec3A(const Vec3 &v) : m(_mm_movelh_ps(_mm_castpd_ps(_mm_set_sd(_LoadXY(v))), _mm_load_ss(&v.z))) {}
+
+    // Branch free indexed access
+    Float operator[](unsigned i) const {
+        assert(i<=3);
+        return reinterpret_cast<const Float *>(&m)[i];
+    }
+
+    Float X() const { return _mm_cvtss_f32(m); }
+
+    Vec3A operator+(const Vec3A &v) const { return Vec3A(_mm_add_ps(m, v.m)); }
+    Vec3A operator-(const Vec3A &v) const { return Vec3A(_mm_sub_ps(m, v.m)); }
+    Vec3A operator*(const Vec3A &v) const { return Vec3A(_mm_mul_ps(m, v.m)); }
+    Vec3A operator*(Float s) const { return Vec3A(_mm_mul_ps(m, _mm_set1_ps(s))); }
+    Vec3A operator-() const { return Vec3A(_mm_sub_ps(_mm_setzero_ps(), m)); }
+#else
+    Float e[4];
+
+    Vec3A() : e{0, 0, 0, 0} {}
+    Vec3A(Float x, Float y, Float z) : e{x, y, z, 0} {}
+    Vec3A(const Vec3 &v) : e{v.x, v.y, v.z, 0} {}
+
+    Float operator[](unsigned i) const {
+        assert(i<=3);
+        return e[i];
+    }
+
+    Float X() const { return e[0]; }
+
+    Vec3A operator+(const Vec3A &v) const { return Vec3A(e[0] + v.e[0], e[1] + v.e[1], e[2] + v.e[2]); }
+    Vec3A operator-(const Vec3A &v) const { return Vec3A(e[0] - v.e[0], e[1] - v.e[1], e[2] - v.e[2]); }
+    Vec3A operator*(const Vec3A &v) const { return Vec3A(e[0] * v.e[0], e[1] * v.e[1], e[2] * v.e[2]); }
+    Vec3A operator*(Float s) const { return Vec3A(e[0] * s, e[1] * s, e[2] * s); }
+    Vec3A operator-() const { return Vec3A(-e[0], -e[1], -e[2]); }
+#endif
+
+    Vec3 ToVec3() const { return Vec3((*this)[0], (*this)[1], (*this)[2]); }
+
+#ifdef NRAY_VEC3A_SSE
+  private:
+    static double _LoadXY(const Vec3 &v) {
+        double xy;
+        std::memcpy(&xy, &v.x, sizeof(xy));
+        return xy;
+    }
+#endif
+};
+
+inline Vec3A operator*(Float s, const Vec3A &v) {
+    return v * s;
+}
+
+
+// Vec3A utility functions
+
+#ifdef NRAY_VEC3A_SSE
+
+inline Float Dot(const Vec3A &u, const Vec3A &v) {
+    __m128 p = _mm_mul_ps(u.m, v.m);
+    __m128 y = _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2));
+    return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(p, y), z));
+}
+
+inline Vec3A Cross(const Vec3A &u, const Vec3A &v) {
+    // u.yzx * v.zxy - u.zxy * v.yzx, computed with 3 shuffles
+    __m128 u_yzx = _mm_shuffle_ps(u.m, u.m, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 v_yzx = _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(u.m, v_yzx), _mm_mul_ps(u_yzx, v.m));
+    return Vec3A(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+}
+
+inline Vec3A Min(const Vec3A &u, const Vec3A &v) {
+    return Vec3A(_mm_min_ps(u.m, v.m));
+}
+
+inline Vec3A Max(const Vec3A &u, const Vec3A &v) {
+    return Vec3A(_mm_max_ps(u.m, v.m));
+}
+
+// Largest of the x, y & z components
+inline Float MaxComponent(const Vec3A &v) {
+    __m128 y = _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(2, 2, 2, 2));
+    return _mm_cvtss_f32(_mm_max_ss(_mm_max_ss(v.m, y), z));
+}
+
+// Smallest of the x, y & z components
+inline Float MinComponent(const Vec3A &v) {
+    __m128 y = _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(2, 2, 2, 2));
+    return _mm_cvtss_f32(_mm_min_ss(_mm_min_ss(v.m, y), z));
+}
+
+inline Vec3A Normalize(const Vec3A &v) {
+    // Approximate reciprocal square root refined
+    // by one Newton-Raphson step (~23 bits of precision)
+    __m128 p = _mm_mul_ps(v.m, v.m);
+    __m128 l2 = _mm_add_ps(_mm_add_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(0, 0, 0, 0)),
+                                      _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1))),
+                                      _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2)));
+    __m128 r = _mm_rsqrt_ps(l2);
+    __m128 half_l2_r2 = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), l2), _mm_mul_ps(r, r));
+    r = _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f), half_l2_r2));
+    return Vec3A(_mm_mul_ps(v.m, r));
+}
+
+#else
+
+inline Float Dot(const Vec3A &u, const Vec3A &v) {
+    return u.e[0]*v.e[0] + u.e[1]*v.e[1] + u.e[2]*v.e[2];
+}
+
+inline Vec3A Cross(const Vec3A &u, const Vec3A &v) {
+    return Vec3A(  (u.e[1]*v.e[2] - u.e[2]*v.e[1]),
+                  -(u.e[0]*v.e[2] - u.e[2]*v.e[0]),
+                   (u.e[0]*v.e[1] - u.e[1]*v.e[0]));
+}
+
+inline Vec3A Min(const Vec3A &u, const Vec3A &v) {
+    return Vec3A(Min(u.e[0], v.e[0]), Min(u.e[1], v.e[1]), Min(u.e[2], v.e[2]));
+}
+
+inline Vec3A Max(const Vec3A &u, const Vec3A &v) {
+    return Vec3A(Max(u.e[0], v.e[0]), Max(u.e[1], v.e[1]), Max(u.e[2], v.e[2]));
+}
+
+inline Float MaxComponent(const Vec3A &v) {
+    return Max(v.e[0], Max(v.e[1], v.e[2]));
+}
+
+inline Float MinComponent(const Vec3A &v) {
+    return Min(v.e[0], Min(v.e[1], v.e[2]));
+}
+
+inline Vec3A Normalize(const Vec3A &v) {
+    return v * (1 / std::sqrt(Dot(v, v)));
+}
+
+#endif